@@ -17,13 +17,35 @@
  * license, as set out in <http://cesanta.com/products.html>.
  */
 
+/* Benchmark needs POSIX clock_gettime(), see SLRE_BENCHMARK below */
+#if defined(SLRE_BENCHMARK) && !defined(_POSIX_C_SOURCE) && !defined(_WIN32)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "slre.h"
 
+/* SIMD class scanning, selected by compiler target flags like -mavx2 */
+#if !defined(SLRE_NO_SIMD) && defined(__GNUC__)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SLRE_AVX2
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define SLRE_SSSE3
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SLRE_SSE2       /* No byte shuffle, for find_byte() only */
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SLRE_NEON
+#endif
+#endif
 static const char *static_error_no_match = "No match";
 static const char *static_error_unexpected_quantifier = "Unexpected quantifier";
 static const char *static_error_unbalanced_brackets = "Unbalanced brackets";
@@ -31,11 +53,21 @@ static const char *static_error_internal = "Internal error";
 static const char *static_error_invalid_set = "Invalid [] spec";
 static const char *static_error_invalid_metacharacter = "Invalid metacharacter";
 static const char *static_error_more_caps = "Caps array is too small";
+static const char *static_error_too_long =
+  "Too many instructions. Increase SLRE_MAX_INSNS";
+static const char *static_error_scratch =
+  "Not enough scratch memory, see slre_scratch_size()";
+static const char *static_error_limit = "Match limit exceeded";
+static const char *static_error_invalid_count = "Invalid {} count";
+static const char *static_error_invalid_utf8 = "Invalid UTF-8 in regex";
+static const char *static_error_saved_build =
+  "Saved regex is from another version or build";
+static const char *static_error_saved_invalid = "Saved regex is invalid";
+static const char *static_error_set_states =
+  "Counted loop is too long for a regex set";
 
-static const char *static_metacharacters = "^$().[]*+?|\\";
+static const char *static_metacharacters = "^$().[]{}*+?|\\";
 
-#define MAX_BRANCHES 100
-#define MAX_BRACKETS 100
 #define ARRAY_SIZE(ar) (int) (sizeof(ar) / sizeof((ar)[0]))
 #define FAIL_IF(cond,msg) do { if (cond) \
   {info->error_msg = msg; return 0; }} while (0)
@@ -46,40 +78,199 @@ static const char *static_metacharacters = "^$().[]*+?|\\";
 #define DBG(x)
 #endif
 
+/* Count work in slre_stats, see slre_exec_stats(). No code without it */
+#ifdef SLRE_STATS
+#define STAT(info, field, n) do { if ((info)->stats != NULL) \
+  (info)->stats->field += (n); } while (0)
+#else
+#define STAT(info, field, n) do { } while (0)
+#endif
+
+/* Private flags, stored in slre_compiled::flags along with SLRE_* ones */
+enum {
+  IS_ANCHORED = 0x100, CAN_SKIP = 0x200, HAS_EOL = 0x400,
+  ENDS_AT_EOL = 0x800,  /* Every match ends with $, see get_shape()      */
+  MUST_AT_END = 0x1000, /* slre_compiled::must is at the end of a match  */
+  IS_ONE_PASS = 0x2000  /* Next byte picks the way, see set_one_pass()    */
+};
+
+/* Size of the DFA cache: states, transitions and items. See dfa_search() */
+#ifndef SLRE_DFA_STATES
+#define SLRE_DFA_STATES 32
+#endif
+
+#ifndef SLRE_DFA_TRANS
+#define SLRE_DFA_TRANS 2048
+#endif
+
+#ifndef SLRE_DFA_ITEMS
+#define SLRE_DFA_ITEMS 1024
+#endif
+
+/*
+ * Cache of regexes compiled by slre_match(): number of regexes, shards
+ * with a lock each, and the longest regexp string that is cached.
+ * Disabled by default. See cache_get().
+ */
+#ifndef SLRE_CACHE_SIZE
+#define SLRE_CACHE_SIZE 0
+#endif
+
+#ifndef SLRE_CACHE_SHARDS
+#define SLRE_CACHE_SHARDS 8
+#endif
+
+#ifndef SLRE_CACHE_KEY
+#define SLRE_CACHE_KEY 128
+#endif
+
+/* Opcodes of the compiled program, see slre_insn */
+enum {
+  I_CHAR,     /* Match byte c, or letter c in either case if y is set   */
+  I_ANY,      /* Match any byte                                         */
+  I_CLASS,    /* Match byte from class bitmap x, e.g. [] set or \d      */
+  I_BOL,      /* ^, assert beginning of the buffer                      */
+  I_EOL,      /* $, assert end of the buffer                            */
+  I_SPLIT,    /* Continue at x, on failure at y. c is SPLIT_* bitmask   */
+  I_JMP,      /* Continue at x                                          */
+  I_SAVE,     /* Store current position in capture slot x               */
+  I_MARK,     /* Store current position (-1 if c is set) in register x  */
+  I_CHECK,    /* Fail if loop register x holds current position         */
+  I_REPEAT,   /* Loop counter c from x to y, see REPEAT_LAZY            */
+  I_INC,      /* Add 1 to loop counter c, continue at x                 */
+  I_MATCH     /* Successful end of the program                          */
+};
+
+/*
+ * SPLIT that starts a loop over single-byte instruction: the instruction
+ * is at pc + 1, followed by JMP back to the SPLIT, loop exit is at pc + 3.
+ * Possessive loop never gives back bytes, as the rest can't match then.
+ * In one-pass program, SPLIT_TO_MATCH is set if y reaches MATCH without
+ * consuming a byte or asserting anything, see set_one_pass().
+ */
+enum { SPLIT_SIMPLE_LOOP = 1, SPLIT_POSSESSIVE = 2, SPLIT_TO_MATCH = 4 };
+
+/*
+ * Counted loop of {lo,hi} quantifier is REPEAT with counter c, lo in x
+ * and hi in y, JMP to the loop exit, the repeated code and INC back to
+ * the REPEAT. The counter holds iterations done: REPEAT goes on to pc + 2
+ * while it is below lo, leaves at pc + 1 once it is hi, and tries both
+ * otherwise, leaving first if REPEAT_LAZY is set in c. Leaving resets the
+ * counter to 0, so that it is 0 outside of its loop.
+ */
+enum { REPEAT_LAZY = 0x80 };
+
+/* Parse tree node types */
+enum {
+  N_EMPTY, N_CHAR, N_ANY, N_CLASS, N_BOL, N_EOL, N_CAT, N_ALT, N_GROUP,
+  N_STAR, N_PLUS, N_QUEST, N_REPEAT, N_UTF8
+};
+
+/*
+ * Parse tree node. For N_CAT and N_ALT, a and b are children. For
+ * quantifiers, a is a child and b is non-zero for non-greedy ones. For
+ * N_GROUP, a is a child and b is the bracket number, starting from 1.
+ * N_CHAR keeps the byte in a, N_CLASS the class bitmap index in a.
+ * N_REPEAT is a {lo,hi} quantifier, hi is -1 if there is no upper bound.
+ * N_UTF8 is a character of SLRE_UTF8 regex: a is the class of its ASCII
+ * bytes, or -1 if none, and lo sequences from b in seqs are the rest.
+ */
+struct node {
+  unsigned char type;
+  short a, b;
+  short lo, hi;
+};
+
+/*
+ * Bytes of multi-byte UTF-8 characters, see add_utf8_seqs(). Byte is a
+ * value below 256, or 256 plus index of a class of bytes.
+ */
+struct utf8_seq {
+  int len;
+  short bytes[4];
+};
+
+/* Non-ASCII code points of a UTF-8 [] set, as sorted disjoint ranges */
+struct cp_set {
+  long lo[64], hi[64];
+  int n;
+};
+
+/* Compilation state */
+struct compile_info {
+  const char *re;
+  int re_len;
+  int pos;
+
+  /* Node 0 is never used, so that 0 can denote a failure */
+  struct node nodes[SLRE_MAX_INSNS];
+  int num_nodes;
+
+  /* Byte sequences of N_UTF8 nodes */
+  struct utf8_seq seqs[SLRE_MAX_INSNS];
+  int num_seqs;
+
+  struct slre_compiled *prog;
+  int reverse;  /* Generate code for reversed regex, see gen_reversed() */
+
+  /* Error message to be returned to the user */
+  const char *error_msg;
+};
+
+/*
+ * Working memory of one match, carved into arrays sized for the program,
+ * see slre_scratch_size(). Every engine starts from the same memory.
+ */
+struct scratch {
+  char *p;
+  int len;
+};
+
+/* Per-call matching state. Compiled regex itself is never modified. */
 struct regex_info {
-  /*
-   * Describes all bracket pairs in the regular expression.
-   * First entry is always present, and grabs the whole regex.
-   */
-  struct bracket_pair {
-    const char *ptr;  /* Points to the first char after '(' in regex  */
-    int len;          /* Length of the text between '(' and ')'       */
-    int branches;     /* Index in the branches array for this pair    */
-    int num_branches; /* Number of '|' in this bracket pair           */
-  } brackets[MAX_BRACKETS];
-  int num_brackets;
+  const struct slre_compiled *re;
+
+  /* Buffer being matched, and offset where current attempt started */
+  const unsigned char *s;
+  int s_len;
+  int start;
+
+  /* Match starts from offset from to to - 1, from match_start if need_start */
+  int from, to;
+  int need_start, match_start;
 
   /*
-   * Describes alternations ('|' operators) in the regular expression.
-   * Each branch falls into a specific branch pair.
+   * Capture slots and loop registers, -1 if not set. Only slots below
+   * num_slots, of the captures asked for, are tracked by backtracking.
    */
-  struct branch {
-    int bracket_index;    /* index into 'brackets' array defined above */
-    const char *schlong;  /* points to the '|' character in the regex */
-  } branches[MAX_BRANCHES];
-  int num_branches;
+  int *slots;
+  int *regs;
+  int num_slots;
+  int *counters;  /* Loop counters of backtracking, see REPEAT_LAZY */
+  struct scratch mem;
 
   /* Array of captures provided by the user */
   struct slre_cap *caps;
   int num_caps;
 
+  /* Bitmap of matched regexes for slre_set_exec(), NULL otherwise */
+  unsigned char *matched;
+  int num_matched, num_regexps;
+
   /* Error message to be returned to the user */
   const char *error_msg;
 
-  /* E.g. IGNORE_CASE. See enum below */
+  /* E.g. SLRE_IGNORE_CASE, see slre.h */
   int flags;
+
+  /* Limits of work, see spend(). Steps are only counted if limits is set */
+  const struct slre_limits *limits;
+  long steps_left, steps_done;
+  int depth, max_depth;
+
+  /* Counters of work for slre_exec_stats(), NULL otherwise */
+  struct slre_stats *stats;
 };
-enum { IGNORE_CASE = 1 };
 
 static int is_metacharacter(const unsigned char *s) {
   return strchr(static_metacharacters, *s) != NULL;
@@ -96,15 +287,26 @@ static int set_len(const char *re, int re_len) {
     len += op_len(re + len);
   }
 
-  return len <= re_len ? len + 1 : -1;
+  return len < re_len ? len + 1 : -1;
 }
 
-static int get_op_len(const char *re, int re_len) {
-  return re[0] == '[' ? set_len(re + 1, re_len - 1) + 1 : op_len(re);
+/* Length of {n}, {n,} or {n,m} at re, 0 if there is none */
+static int count_len(const char *re, int re_len) {
+  int len = 1;
+
+  if (re_len < 3 || re[0] != '{' || !isdigit((unsigned char) re[1])) return 0;
+  while (len < re_len && isdigit((unsigned char) re[len])) len++;
+  if (len < re_len && re[len] == ',') {
+    len++;
+    while (len < re_len && isdigit((unsigned char) re[len])) len++;
+  }
+
+  return len < re_len && re[len] == '}' ? len + 1 : 0;
 }
 
-static int is_quantifier(const char *re) {
-  return re[0] == '*' || re[0] == '+' || re[0] == '?';
+static int is_quantifier(const char *re, int re_len) {
+  return re_len > 0 && (re[0] == '*' || re[0] == '+' || re[0] == '?' ||
+                        count_len(re, re_len) > 0);
 }
 
 static int toi(int x) {
@@ -115,370 +317,4344 @@ static int hextoi(const unsigned char *s) {
   return (toi(tolower(s[0])) << 4) | toi(tolower(s[1]));
 }
 
-static int match_op(const unsigned char *re, const unsigned char *s,
-                    struct regex_info *info) {
-  int result = 0;
-  switch (*re) {
-    case '\\':
-      /* Metacharacters */
-      switch (re[1]) {
-        case 'S':
-          FAIL_IF(isspace(*s), static_error_no_match);
-          result++;
-          break;
+/*
+ * Byte classes are 256-bit bitmaps. Bytes are classified using C locale
+ * rules, independently of the current locale.
+ */
+#define CLASS_HAS(bits, ch) ((bits)[(ch) >> 3] & (1 << ((ch) & 7)))
+#define CLASS_ADD(bits, ch) ((bits)[(ch) >> 3] |= (unsigned char) \
+  (1 << ((ch) & 7)))
 
-        case 's':
-          FAIL_IF(!isspace(*s), static_error_no_match);
-          result++;
-          break;
+/* Bytes matched by \s, that is \t to \r and space, and by \d */
+static const unsigned char space_bytes[32] = {0, 0x3e, 0, 0, 1};
+static const unsigned char digit_bytes[32] = {0, 0, 0, 0, 0, 0, 0xff, 3};
 
-        case 'd':
-          FAIL_IF(!isdigit(*s), static_error_no_match);
-          result++;
-          break;
+static int to_lower_byte(int ch) {
+  return ch >= 'A' && ch <= 'Z' ? ch + 'a' - 'A' : ch;
+}
 
-        case 'x':
-          /* Match byte, \xHH where HH is hexadecimal byte representaion */
-          FAIL_IF(!(isxdigit(re[2]) && isxdigit(re[3])),
-                  static_error_invalid_metacharacter);
-          FAIL_IF(hextoi(re + 2) != *s, static_error_no_match);
-          result++;
-          break;
+static int to_upper_byte(int ch) {
+  return ch >= 'a' && ch <= 'z' ? ch - 'a' + 'A' : ch;
+}
 
-        default:
-          if (is_metacharacter(re + 1)) {
-            FAIL_IF(re[1] != s[0], static_error_no_match);
-            result++;
-          } else {
-            FAIL_IF(1, static_error_invalid_metacharacter);
-          }
-          break;
-      }
-      break;
+/* Add bytes from lo to hi to the class, folding case if required */
+static void class_add_range(unsigned char *bits, int lo, int hi, int flags) {
+  int ch;
 
-    case '|': FAIL_IF(1, static_error_internal); break;
-    case '$': FAIL_IF(1, static_error_no_match); break;
-    case '.': result++; break;
+  for (ch = lo; ch <= hi; ch++) {
+    CLASS_ADD(bits, ch);
+    if (flags & SLRE_IGNORE_CASE) {
+      CLASS_ADD(bits, to_lower_byte(ch));
+      CLASS_ADD(bits, to_upper_byte(ch));
+    }
+  }
+}
 
-    default:
-      if (info->flags & IGNORE_CASE) {
-        FAIL_IF(tolower(*re) != tolower(*s), static_error_no_match);
-      } else {
-        FAIL_IF(*re != *s, static_error_no_match);
-      }
-      result++;
-      break;
+/* Add bytes matched by \s, \S or \d */
+static void class_add_escape(unsigned char *bits, int esc) {
+  int i;
+
+  for (i = 0; i < 32; i++) {
+    bits[i] |= esc == 's' ? space_bytes[i] : esc == 'S' ?
+      (unsigned char) ~space_bytes[i] : digit_bytes[i];
   }
+}
 
-  return result;
+/* Check escape sequence at re, that is \xHH, \s, \S, \d or \meta */
+static int is_valid_escape(const unsigned char *re, int re_len) {
+  if (re_len < 2) return 0;
+  if (re[1] == 'x') return re_len >= 4 && isxdigit(re[2]) && isxdigit(re[3]);
+  return re[1] == 's' || re[1] == 'S' || re[1] == 'd' ||
+    is_metacharacter(re + 1);
 }
 
-static int match_set(const char *re, int re_len, const char *s,
-                     struct regex_info *info) {
-  int len = 0, result = 0, invert = re[0] == '^';
-
-  if (invert) re++, re_len--;
-
-  while (len <= re_len && re[len] != ']' && result == 0) {
-    /* Support character range */
-    if (re[len] != '-' && re[len + 1] == '-' && re[len + 2] != ']' &&
-        re[len + 2] != '\0') {
-      result = info->flags &&  IGNORE_CASE ?
-        *s >= re[len] && *s <= re[len + 2] :
-        tolower(*s) >= tolower(re[len]) && tolower(*s) <= tolower(re[len + 2]);
-      len += 3;
+/* Decode UTF-8 character at s. Returns its length, or 0 if it is invalid */
+static int decode_utf8(const unsigned char *s, int len, long *cp) {
+  static const long min_cp[] = {0, 0, 0x80, 0x800, 0x10000};
+  int i, n = s[0] < 0x80 ? 1 : s[0] < 0xc0 ? 0 : s[0] < 0xe0 ? 2 :
+    s[0] < 0xf0 ? 3 : s[0] < 0xf8 ? 4 : 0;
+
+  if (n == 0 || n > len) return 0;
+  *cp = n == 1 ? s[0] : s[0] & (0x3f >> (n - 1));
+  for (i = 1; i < n; i++) {
+    if ((s[i] & 0xc0) != 0x80) return 0;
+    *cp = (*cp << 6) | (s[i] & 0x3f);
+  }
+
+  return *cp < min_cp[n] || *cp > 0x10ffff ||
+    (*cp >= 0xd800 && *cp <= 0xdfff) ? 0 : n;
+}
+
+/* Store UTF-8 bytes of code point cp into s. Returns their number */
+static int encode_utf8(long cp, unsigned char *s) {
+  static const unsigned char lead[] = {0, 0, 0xc0, 0xe0, 0xf0};
+  int i, n = cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+
+  for (i = n - 1; i > 0; i--) {
+    s[i] = (unsigned char) (0x80 | (cp & 0x3f));
+    cp >>= 6;
+  }
+  s[0] = (unsigned char) (lead[n] | cp);
+
+  return n;
+}
+
+/* Add code points lo to hi to the set. Returns 0 if the set is full */
+static int cp_set_add(struct cp_set *set, long lo, long hi) {
+  int i, j;
+
+  /* Ranges that overlap or touch the new one are merged into it */
+  for (i = j = 0; i < set->n; i++) {
+    if (set->hi[i] + 1 < lo || set->lo[i] > hi + 1) {
+      set->lo[j] = set->lo[i];
+      set->hi[j++] = set->hi[i];
     } else {
-      result = match_op((unsigned char *) re + len, (unsigned char *) s, info);
-      len += op_len(re + len);
+      if (set->lo[i] < lo) lo = set->lo[i];
+      if (set->hi[i] > hi) hi = set->hi[i];
     }
   }
-  return (!invert && result) || (invert && !result) ? 1 : 0;
+  if (j >= ARRAY_SIZE(set->lo)) return 0;
+
+  for (i = j; i > 0 && set->lo[i - 1] > lo; i--) {
+    set->lo[i] = set->lo[i - 1];
+    set->hi[i] = set->hi[i - 1];
+  }
+  set->lo[i] = lo;
+  set->hi[i] = hi;
+  set->n = j + 1;
+
+  return 1;
 }
 
-static int doh(const char *s, int s_len, struct regex_info *info, int bi);
+/* Replace the set with non-ASCII code points that are not in it */
+static int cp_set_invert(struct cp_set *set) {
+  struct cp_set inv;
+  long next = 0x80, end;
+  int i;
 
-static int bar(const char *re, int re_len, const char *s, int s_len,
-               struct regex_info *info, int bi) {
-  /* i is offset in re, j is offset in s, bi is brackets index */
-  int i, j, n, step;
+  for (i = inv.n = 0; i <= set->n; i++) {
+    end = i < set->n ? set->lo[i] - 1 : 0x10ffff;
+    if (next <= end && !cp_set_add(&inv, next, end)) return 0;
+    if (i < set->n) next = set->hi[i] + 1;
+  }
+  *set = inv;
 
-  DBG(("%s [%.*s] [%.*s]\n", __func__, re_len, re, s_len, s));
+  return 1;
+}
 
-  for (i = j = 0; i < re_len && j < s_len; i += step) {
+/*************************** Parsing into a tree ****************************/
 
-    /* Handle quantifiers. Get the length of the chunk. */
-    step = re[i] == '(' ? info->brackets[bi + 1].len + 2 :
-      get_op_len(re + i, re_len - i);
+static int new_node(struct compile_info *info, int type, int a, int b) {
+  FAIL_IF(info->num_nodes >= ARRAY_SIZE(info->nodes), static_error_too_long);
+  info->nodes[info->num_nodes].type = (unsigned char) type;
+  info->nodes[info->num_nodes].a = (short) a;
+  info->nodes[info->num_nodes].b = (short) b;
+  info->nodes[info->num_nodes].lo = info->nodes[info->num_nodes].hi = 0;
+  return info->num_nodes++;
+}
 
-    DBG(("%s    [%.*s] [%.*s] re_len=%d step=%d i=%d j=%d\n", __func__,
-         re_len - i, re + i, s_len - j, s + j, re_len, step, i, j));
+static int parse_alt(struct compile_info *info);
 
-    FAIL_IF(is_quantifier(&re[i]), static_error_unexpected_quantifier);
-    FAIL_IF(step <= 0, static_error_invalid_set);
+/* Store class bitmap in the program, reusing an identical one if any */
+static int add_class(struct compile_info *info, const unsigned char *bits) {
+  struct slre_compiled *prog = info->prog;
+  int i;
 
-    if (i + step < re_len && is_quantifier(re + i + step)) {
-      DBG(("QUANTIFIER: [%.*s] %c\n", step, re + i, re[i + step]));
-      if (re[i + step] == '?') {
-        j += bar(re + i, step, s + j, s_len - j, info, bi);
-        i++;
-        continue;
-      } else if (re[i + step] == '+' || re[i + step] == '*') {
-        int j2 = j, nj = 0, n1, n2, ni, non_greedy = 0;
-
-        /* Points to the regexp code after the quantifier */
-        ni = i + step + 1;
-        if (ni < re_len && re[ni] == '?') {
-          non_greedy = 1;
-          ni++;
-        }
+  for (i = 0; i < prog->num_classes; i++) {
+    if (memcmp(prog->classes[i], bits, sizeof(prog->classes[i])) == 0) {
+      return i;
+    }
+  }
 
-        while ((n1 = bar(re + i, step, s + j2, s_len - j2, info, bi)) > 0) {
-          if (ni >= re_len) {
-            /* After quantifier, there is nothing */
-            nj = j2 + n1;
-          } else if ((n2 = bar(re + ni, re_len - ni, s + j2 + n1,
-                              s_len - (j2 + n1), info, bi)) > 0) {
-            nj = j2 + n1 + n2;
-          }
-          if (nj > 0 && non_greedy) break;
-          j2 += n1;
-        }
-        FAIL_IF(re[i + step] == '+' && nj == 0, static_error_no_match);
-        return nj;
-      }
-    }
-
-    if (re[i] == '[') {
-      n = match_set(re + i + 1, re_len - (i + 2), s + j, info);
-      DBG(("SET %.*s [%.*s] -> %d\n", step, re + i, s_len - j, s + j, n));
-      FAIL_IF(n <= 0, static_error_no_match);
-      j += n;
-    } else if (re[i] == '(') {
-      bi++;
-      FAIL_IF(bi >= info->num_brackets, static_error_internal);
-      DBG(("CAPTURING [%.*s] [%.*s]\n", step, re + i, s_len - j, s + j));
-      n = doh(s + j, s_len - j, info, bi);
-      DBG(("CAPTURED [%.*s] [%.*s]:%d\n", step, re + i, s_len - j, s + j, n));
-      FAIL_IF(n <= 0, info->error_msg);
-      if (info->caps != NULL) {
-        info->caps[bi - 1].ptr = s + j;
-        info->caps[bi - 1].len = n;
-      }
-      j += n;
-    } else if (re[i] == '^') {
-      FAIL_IF(j != 0, static_error_no_match);
+  if (prog->num_classes >= ARRAY_SIZE(prog->classes)) {
+    info->error_msg = "Too many [] sets. Increase SLRE_MAX_CLASSES";
+    return -1;
+  }
+  memcpy(prog->classes[i], bits, sizeof(prog->classes[i]));
+
+  return prog->num_classes++;
+}
+
+static int new_class_node(struct compile_info *info,
+                          const unsigned char *bits) {
+  int i = add_class(info, bits);
+  return i < 0 ? 0 : new_node(info, N_CLASS, i, 0);
+}
+
+/* Sequence of N_CHAR nodes matching n bytes */
+static int new_bytes_node(struct compile_info *info, const unsigned char *s,
+                          int n) {
+  int i, result = new_node(info, N_CHAR, s[0], 0);
+
+  for (i = 1; i < n && result != 0; i++) {
+    result = new_node(info, N_CAT, result, new_node(info, N_CHAR, s[i], 0));
+  }
+
+  return result;
+}
+
+/*
+ * Append byte sequences of code points lo to hi, that are at least 0x80.
+ * Range is split until it has one length and each byte of it takes all
+ * values between those of the first and the last code point, like
+ * U+0430 to U+044F is \xd0[\xb0-\xbf]|\xd1[\x80-\x8f].
+ */
+static int add_utf8_seqs(struct compile_info *info, long lo, long hi) {
+  static const long max_cp[] = {0x7f, 0x7ff, 0xffff};
+  unsigned char a[4], b[4], bits[32];
+  struct utf8_seq *seq;
+  long m;
+  int i, len, cls;
+
+  /* Surrogates are not characters */
+  if (lo <= 0xdfff && hi >= 0xd800) {
+    return (lo >= 0xd800 || add_utf8_seqs(info, lo, 0xd7ff)) &&
+      (hi <= 0xdfff || add_utf8_seqs(info, 0xe000, hi));
+  }
+  for (i = 0; i < ARRAY_SIZE(max_cp); i++) {
+    if (lo <= max_cp[i] && hi > max_cp[i]) {
+      return add_utf8_seqs(info, lo, max_cp[i]) &&
+        add_utf8_seqs(info, max_cp[i] + 1, hi);
+    }
+  }
+
+  len = encode_utf8(lo, a);
+  for (i = 1; i < len; i++) {
+    m = (1L << (6 * i)) - 1;
+    if ((lo & ~m) != (hi & ~m) && (lo & m) != 0) {
+      return add_utf8_seqs(info, lo, lo | m) &&
+        add_utf8_seqs(info, (lo | m) + 1, hi);
+    }
+    if ((lo & ~m) != (hi & ~m) && (hi & m) != m) {
+      return add_utf8_seqs(info, lo, (hi & ~m) - 1) &&
+        add_utf8_seqs(info, hi & ~m, hi);
+    }
+  }
+
+  FAIL_IF(info->num_seqs >= ARRAY_SIZE(info->seqs), static_error_too_long);
+  seq = &info->seqs[info->num_seqs++];
+  memset(seq, 0, sizeof(*seq));
+  seq->len = len;
+  encode_utf8(hi, b);
+  for (i = 0; i < len; i++) {
+    seq->bytes[i] = a[i];
+    if (a[i] != b[i]) {
+      memset(bits, 0, sizeof(bits));
+      class_add_range(bits, a[i], b[i], 0);
+      if ((cls = add_class(info, bits)) < 0) return 0;
+      seq->bytes[i] = (short) (256 + cls);
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Node matching UTF-8 character: ASCII one from class bits, or one from
+ * the set. Sequences of another node with the same set are shared.
+ */
+static int new_utf8_node(struct compile_info *info, const unsigned char *bits,
+                         const struct cp_set *set) {
+  int i, n, first = info->num_seqs, cls = -1;
+
+  for (i = 0; i < set->n; i++) {
+    if (!add_utf8_seqs(info, set->lo[i], set->hi[i])) return 0;
+  }
+  if ((n = info->num_seqs - first) == 0) return new_class_node(info, bits);
+
+  for (i = 0; i + n <= first; i++) {
+    if (memcmp(&info->seqs[i], &info->seqs[first],
+               n * sizeof(info->seqs[0])) == 0) {
+      info->num_seqs = first;
+      first = i;
+      break;
+    }
+  }
+
+  for (i = 0; i < 16 && bits[i] == 0; i++) {
+  }
+  if (i < 16 && (cls = add_class(info, bits)) < 0) return 0;
+  if ((i = new_node(info, N_UTF8, cls, first)) == 0) return 0;
+  info->nodes[i].lo = (short) n;
+
+  return i;
+}
+
+/* Add code points lo to hi to ASCII class bits or to the set */
+static int add_cp_range(struct compile_info *info, unsigned char *bits,
+                        struct cp_set *set, long lo, long hi) {
+  if (lo < 0x80 && lo <= hi) {
+    class_add_range(bits, (int) lo, hi < 0x80 ? (int) hi : 0x7f,
+                    info->prog->flags);
+  }
+  FAIL_IF(hi >= 0x80 && !cp_set_add(set, lo < 0x80 ? 0x80 : lo, hi),
+          static_error_too_long);
+
+  return 1;
+}
+
+/*
+ * Parse [] set of UTF-8 characters of len bytes, see parse_set(). Bytes
+ * from 0x80 on are not characters themselves, so the class keeps ASCII
+ * ones only.
+ */
+static int parse_utf8_set(struct compile_info *info, int len) {
+  const unsigned char *re = (const unsigned char *) info->re + info->pos;
+  unsigned char bits[32];
+  struct cp_set set;
+  long lo, hi;
+  int i, k, n, invert = len > 0 && re[0] == '^';
+
+  memset(bits, 0, sizeof(bits));
+  set.n = 0;
+
+  for (i = invert; i < len; i += n) {
+    n = op_len((const char *) re + i);
+    if (re[i] == '\\') {
+      FAIL_IF(!is_valid_escape(re + i, len - i),
+              static_error_invalid_metacharacter);
+      lo = hi = re[i + 1] == 'x' ? hextoi(re + i + 2) : re[i + 1];
+      if (re[i + 1] == 's' || re[i + 1] == 'S' || re[i + 1] == 'd') {
+        /* Bytes from 0x80 on that \S adds are dropped below */
+        class_add_escape(bits, re[i + 1]);
+        if (re[i + 1] != 'S') continue;
+        lo = 0x80;
+        hi = 0x10ffff;
+      }
+    } else if (re[i] == '.') {
+      lo = 0;
+      hi = 0x10ffff;
     } else {
-      n = match_op((unsigned char *) (re + i), (unsigned char *) (s + j), info);
-      FAIL_IF(n <= 0, info->error_msg);
-      j += n;
+      FAIL_IF((n = decode_utf8(re + i, len - i, &lo)) == 0,
+              static_error_invalid_utf8);
+      hi = lo;
+      if (re[i] != '-' && i + n + 1 < len && re[i + n] == '-') {
+        k = decode_utf8(re + i + n + 1, len - i - n - 1, &hi);
+        FAIL_IF(k == 0, static_error_invalid_utf8);
+        n += k + 1;
+      }
     }
+    if (!add_cp_range(info, bits, &set, lo, hi)) return 0;
   }
 
-  /*
-   * Process $ anchor here. If we've reached the end of the string,
-   * but did not exhaust regexp yet, this is no match.
-   */
-  FAIL_IF(i < re_len && !(re[i] == '$' && i + 1 == re_len),
-          static_error_no_match);
+  if (invert) {
+    for (i = 0; i < ARRAY_SIZE(bits); i++) {
+      bits[i] = (unsigned char) ~bits[i];
+    }
+    FAIL_IF(!cp_set_invert(&set), static_error_too_long);
+  }
+  memset(bits + 16, 0, 16);
+  info->pos += len + 1;
+
+  return new_utf8_node(info, bits, &set);
+}
+
+/*
+ * Parse [] set into a class bitmap, folding case at compile time.
+ * info->pos points to the first character after '['
+ */
+static int parse_set(struct compile_info *info) {
+  const unsigned char *re = (const unsigned char *) info->re + info->pos;
+  unsigned char bits[32];
+  int i, len = set_len((const char *) re, info->re_len - info->pos) - 1;
+  int invert = len > 0 && re[0] == '^', flags = info->prog->flags;
 
-  return j;
+  FAIL_IF(len < 0, static_error_invalid_set);
+  if (flags & SLRE_UTF8) return parse_utf8_set(info, len);
+  memset(bits, 0, sizeof(bits));
+
+  for (i = invert; i < len; i += op_len((const char *) re + i)) {
+    if (re[i] != '-' && re[i] != '\\' && i + 2 < len && re[i + 1] == '-') {
+      /* Character range */
+      class_add_range(bits, re[i], re[i + 2], flags);
+      i += 2;
+    } else if (re[i] == '\\') {
+      FAIL_IF(!is_valid_escape(re + i, len - i),
+              static_error_invalid_metacharacter);
+      if (re[i + 1] == 'x') {
+        class_add_range(bits, hextoi(re + i + 2), hextoi(re + i + 2), flags);
+      } else if (is_metacharacter(re + i + 1)) {
+        class_add_range(bits, re[i + 1], re[i + 1], flags);
+      } else {
+        class_add_escape(bits, re[i + 1]);
+      }
+    } else if (re[i] == '.') {
+      /* Dot matches any byte, even inside a set */
+      class_add_range(bits, 0, 255, 0);
+    } else {
+      class_add_range(bits, re[i], re[i], flags);
+    }
+  }
+
+  if (invert) {
+    for (i = 0; i < ARRAY_SIZE(bits); i++) {
+      bits[i] = (unsigned char) ~bits[i];
+    }
+  }
+  info->pos += len + 1;
+
+  return new_class_node(info, bits);
 }
 
-/* Process branch points */
-static int doh(const char *s, int s_len, struct regex_info *info, int bi) {
-  const struct
-# ifdef __cplusplus 
-  regex_info::
-# endif
-  bracket_pair *b = &info->brackets[bi];
-  int i = 0, len, result;
-  const char *p;
+/* Parse ., \S, \xHH or a non-ASCII character of SLRE_UTF8 regex */
+static int parse_utf8_atom(struct compile_info *info) {
+  const unsigned char *re = (const unsigned char *) info->re + info->pos;
+  unsigned char bits[32], s[4];
+  struct cp_set set;
+  long cp;
+  int n, left = info->re_len - info->pos;
 
-  do {
-    p = i == 0 ? b->ptr : info->branches[b->branches + i - 1].schlong + 1;
-    len = b->num_branches == 0 ? b->len :
-      i == b->num_branches ? b->ptr + b->len - p :
-      info->branches[b->branches + i].schlong - p;
-    DBG(("%s %d %d [%.*s]\n", __func__, bi, i, len, p));
-    result = bar(p, len, s, s_len, info, bi);
-  } while (i++ < b->num_branches);  /* At least 1 iteration */
+  if (re[0] == '.' || (re[0] == '\\' && re[1] == 'S')) {
+    memset(bits, 0, sizeof(bits));
+    if (re[0] == '.') class_add_range(bits, 0, 0x7f, 0);
+    if (re[0] == '\\') class_add_escape(bits, 'S');
+    memset(bits + 16, 0, 16);
+    set.n = 0;
+    cp_set_add(&set, 0x80, 0x10ffff);
+    info->pos += re[0] == '.' ? 1 : 2;
+    return new_utf8_node(info, bits, &set);
+  }
 
+  if (re[0] == '\\') {
+    FAIL_IF(!is_valid_escape(re, left), static_error_invalid_metacharacter);
+    cp = hextoi(re + 2);
+    n = 4;
+  } else {
+    FAIL_IF((n = decode_utf8(re, left, &cp)) == 0, static_error_invalid_utf8);
+  }
+  info->pos += n;
 
-  return result;
+  return new_bytes_node(info, s, encode_utf8(cp, s));
 }
 
-static void setup_branch_points(struct regex_info *info) {
-  int i, j;
-  struct
-# ifdef __cplusplus 
-  regex_info::
-# endif
-  branch tmp;
+static int parse_atom(struct compile_info *info) {
+  const unsigned char *re = (const unsigned char *) info->re + info->pos;
+  unsigned char bits[32];
+  int n, bracket, left = info->re_len - info->pos;
+
+  FAIL_IF(is_quantifier((const char *) re, left),
+          static_error_unexpected_quantifier);
+  if ((info->prog->flags & SLRE_UTF8) && (re[0] == '.' || re[0] >= 0x80 ||
+      (re[0] == '\\' && left > 1 && (re[1] == 'S' || re[1] == 'x')))) {
+    return parse_utf8_atom(info);
+  }
+  info->pos++;
 
-  /* First, sort branches. Must be stable, no qsort. Use bubble algo. */
-  for (i = 0; i < info->num_branches; i++) {
-    for (j = i + 1; j < info->num_branches; j++) {
-      if (info->branches[i].bracket_index > info->branches[j].bracket_index) {
-        tmp = info->branches[i];
-        info->branches[i] = info->branches[j];
-        info->branches[j] = tmp;
+  switch (re[0]) {
+    case '(':
+      FAIL_IF(left > 1 && re[1] == ')', static_error_no_match);
+      FAIL_IF(info->prog->num_brackets >= SLRE_MAX_BRACKETS,
+              "Too many (. Increase SLRE_MAX_BRACKETS");
+      bracket = ++info->prog->num_brackets;
+      if ((n = parse_alt(info)) == 0) return 0;
+      FAIL_IF(info->pos >= info->re_len, static_error_unbalanced_brackets);
+      info->pos++;
+      return new_node(info, N_GROUP, n, bracket);
+    case '[': return parse_set(info);
+    case '.': return new_node(info, N_ANY, 0, 0);
+    case '^': return new_node(info, N_BOL, 0, 0);
+    case '$': return new_node(info, N_EOL, 0, 0);
+    case '\\':
+      FAIL_IF(!is_valid_escape(re, left), static_error_invalid_metacharacter);
+      info->pos += op_len((const char *) re) - 1;
+      switch (re[1]) {
+        case 's': case 'S': case 'd':
+          memset(bits, 0, sizeof(bits));
+          class_add_escape(bits, re[1]);
+          return new_class_node(info, bits);
+        case 'x': return new_node(info, N_CHAR, hextoi(re + 2), 0);
+        default: return new_node(info, N_CHAR, re[1], 0);
       }
+    default:
+      return new_node(info, N_CHAR, re[0], 0);
+  }
+}
+
+/* Parse count in {n}, {n,} or {n,m} at info->pos */
+static int parse_count(struct compile_info *info, int *count) {
+  const char *re = info->re;
+
+  for (*count = 0; isdigit((unsigned char) re[info->pos]); info->pos++) {
+    *count = *count * 10 + re[info->pos] - '0';
+    FAIL_IF(*count > SHRT_MAX, static_error_invalid_count);
+  }
+
+  return 1;
+}
+
+/* Parse {n}, {n,} or {n,m} quantifier over node n into N_REPEAT node */
+static int parse_repeat(struct compile_info *info, int n) {
+  const char *re = info->re;
+  int lo, hi;
+
+  info->pos++;
+  if (!parse_count(info, &lo)) return 0;
+  hi = lo;
+  if (re[info->pos] == ',') {
+    info->pos++;
+    if (re[info->pos] == '}') {
+      hi = -1;
+    } else if (!parse_count(info, &hi)) {
+      return 0;
     }
   }
+  FAIL_IF(hi >= 0 && hi < lo, static_error_invalid_count);
+  info->pos++;
 
-  /*
-   * For each bracket, set their branch points. This way, for every bracket
-   * (i.e. every chunk of regex) we know all branch points before matching.
-   */
-  for (i = j = 0; i < info->num_brackets; i++) {
-    info->brackets[i].num_branches = 0;
-    info->brackets[i].branches = j;
-    while (j < info->num_branches && info->branches[j].bracket_index == i) {
-      info->brackets[i].num_branches++;
-      j++;
-    }
-  }
-}
-
-static int foo(const char *re, int re_len, const char *s, int s_len,
-               struct regex_info *info) {
-  int result, i, step, depth = 0;
-  const char *stack[ARRAY_SIZE(info->brackets)];
-
-  stack[0] = re;
-
-  /* First bracket captures everything */
-  info->brackets[0].ptr = re;
-  info->brackets[0].len = re_len;
-  info->num_brackets = 1;
-
-  /* Make a single pass over regex string, memorize brackets and branches */
-  for (i = 0; i < re_len; i += step) {
-    step = get_op_len(re + i, re_len - i);
-
-    if (re[i] == '|') {
-      FAIL_IF(info->num_branches >= ARRAY_SIZE(info->branches),
-              "Too many |. Increase MAX_BRANCHES");
-      info->branches[info->num_branches].bracket_index =
-        info->brackets[info->num_brackets - 1].len == -1 ?
-        info->num_brackets - 1 : depth;
-      info->branches[info->num_branches].schlong = &re[i];
-      info->num_branches++;
-    } else if (re[i] == '(') {
-      FAIL_IF(info->num_brackets >= ARRAY_SIZE(info->brackets),
-              "Too many (. Increase MAX_BRACKETS");
-      depth++;  /* Order is important here. Depth increments first. */
-      stack[depth] = &re[i];
-      info->brackets[info->num_brackets].ptr = re + i + 1;
-      info->brackets[info->num_brackets].len = -1;
-      info->num_brackets++;
-      FAIL_IF(info->num_caps > 0 && info->num_brackets - 1 > info->num_caps,
-              static_error_more_caps);
-    } else if (re[i] == ')') {
-      int ind = info->brackets[info->num_brackets - 1].len == -1 ?
-        info->num_brackets - 1 : depth;
-      info->brackets[ind].len = &re[i] - info->brackets[ind].ptr;
-      DBG(("SETTING BRACKET %d [%.*s]\n",
-           ind, info->brackets[ind].len, info->brackets[ind].ptr));
-      depth--;
-      FAIL_IF(depth < 0, static_error_unbalanced_brackets);
-      FAIL_IF(i > 0 && re[i - 1] == '(', static_error_no_match);
-    }
-  }
-
-  FAIL_IF(depth != 0, static_error_unbalanced_brackets);
-
-  setup_branch_points(info);
-
-  /* Scan the string from left to right, applying the regex. Stop on match. */
-  result = 0;
-  for (i = 0; i < s_len; i++) {
-    result = doh(s + i, s_len - i, info, 0);
-    DBG(("   (iter %d) -> %d [%.*s] [%.*s] [%s]\n", i, result, re_len, re,
-         s_len - i, s + i, info->error_msg));
-    if (result > 0 || re[0] == '^') {
-      result += i;
-      break;
+  if ((n = new_node(info, N_REPEAT, n, 0)) == 0) return 0;
+  info->nodes[n].lo = (short) lo;
+  info->nodes[n].hi = (short) hi;
+
+  return n;
+}
+
+/* Parse a sequence of atoms with optional quantifiers, up to '|' or ')' */
+static int parse_seq(struct compile_info *info) {
+  const char *re = info->re;
+  int result = 0, n, type;
+
+  while (info->pos < info->re_len && re[info->pos] != '|' &&
+         re[info->pos] != ')') {
+    if ((n = parse_atom(info)) == 0) return 0;
+
+    if (is_quantifier(re + info->pos, info->re_len - info->pos)) {
+      if (re[info->pos] == '{') {
+        n = parse_repeat(info, n);
+      } else {
+        type = re[info->pos] == '*' ? N_STAR : re[info->pos] == '+' ?
+          N_PLUS : N_QUEST;
+        info->pos++;
+        n = new_node(info, type, n, 0);
+      }
+      if (n == 0) return 0;
+      if (info->pos < info->re_len && re[info->pos] == '?') {
+        info->pos++;
+        info->nodes[n].b = 1;
+      }
     }
+
+    result = result == 0 ? n : new_node(info, N_CAT, result, n);
+    if (result == 0) return 0;
+  }
+
+  return result == 0 ? new_node(info, N_EMPTY, 0, 0) : result;
+}
+
+static int parse_alt(struct compile_info *info) {
+  int result = parse_seq(info), n;
+
+  if (result != 0 && info->pos < info->re_len &&
+      info->re[info->pos] == '|') {
+    info->pos++;
+    if ((n = parse_alt(info)) == 0) return 0;
+    result = new_node(info, N_ALT, result, n);
   }
 
   return result;
 }
 
-int slre_match(const char *regexp, const char *s, int s_len,
-               struct slre_cap *caps, int num_caps, const char **error_msg) {
-  struct regex_info info;
-  int result;
+/************************* Optimizing the tree ******************************/
 
-  /* Initialize info structure */
-  info.flags = info.num_brackets = info.num_branches = 0;
-  info.error_msg = "";
-  info.num_caps = num_caps;
-  info.caps = caps;
+static int is_single_byte(const struct node *n) {
+  return n->type == N_CHAR || n->type == N_ANY || n->type == N_CLASS;
+}
 
-  DBG(("========================> [%s] [%.*s]\n", regexp, s_len, s));
+/* Non-zero if k more nodes fit. If not, a rewrite is simply skipped */
+static int has_room(const struct compile_info *info, int k) {
+  return info->num_nodes + k <= ARRAY_SIZE(info->nodes);
+}
 
-  /* Handle regexp flags. At the moment, only 'i' is supported */
-  if (memcmp(regexp, "(?i)", 4) == 0) {
-    info.flags |= IGNORE_CASE;
-    regexp += 4;
+/* Add bytes matched by single-byte node to the class */
+static void add_node_bytes(const struct compile_info *info,
+                           const struct node *n, unsigned char *bits) {
+  int i;
+
+  switch (n->type) {
+    case N_CHAR: class_add_range(bits, n->a, n->a, info->prog->flags); break;
+    case N_ANY: memset(bits, 0xff, 32); break;
+    default:
+      for (i = 0; i < 32; i++) bits[i] |= info->prog->classes[n->a][i];
+      break;
   }
+}
 
-  result = foo(regexp, strlen(regexp), s, s_len, &info);
+/*
+ * Class node matching bytes of single-byte nodes a and b, so that a|b
+ * becomes [ab]. Returns 0 if there is no room for a new class.
+ */
+static int fold_bytes(struct compile_info *info, int a, int b) {
+  unsigned char bits[32];
 
-  if (error_msg != NULL) {
-    *error_msg = info.error_msg;
+  if (!has_room(info, 1) ||
+      info->prog->num_classes + 1 >= ARRAY_SIZE(info->prog->classes)) {
+    return 0;
   }
+  memset(bits, 0, sizeof(bits));
+  add_node_bytes(info, &info->nodes[a], bits);
+  add_node_bytes(info, &info->nodes[b], bits);
 
-  return result;
+  return new_class_node(info, bits);
+}
+
+/* First node of a sequence of N_CAT nodes */
+static int seq_head(const struct compile_info *info, int i) {
+  while (info->nodes[i].type == N_CAT) i = info->nodes[i].a;
+  return i;
+}
+
+/* Sequence i without its first node. Returns 0 if there is no room */
+static int seq_tail(struct compile_info *info, int i) {
+  const struct node *n = &info->nodes[i];
+  int a;
+
+  if (n->type != N_CAT) {
+    return has_room(info, 1) ? new_node(info, N_EMPTY, 0, 0) : 0;
+  }
+  if (info->nodes[n->a].type != N_CAT) return n->b;
+  if ((a = seq_tail(info, n->a)) == 0 || !has_room(info, 1)) return 0;
+
+  return new_node(info, N_CAT, a, n->b);
+}
+
+/*
+ * Rewrite alternation i, which has optimized branches. Single bytes are
+ * folded into a class, x|y|b to [xyb], and a byte that adjacent branches
+ * start with is factored out, ab|ac|d to a(?:b|c)|d. Order of branches
+ * is kept, so that the same match is preferred. Returns the new node.
+ */
+static int optimize_alt(struct compile_info *info, int i) {
+  struct node *n = &info->nodes[i], *next = &info->nodes[n->b];
+  int other = next->type == N_ALT ? next->a : n->b, head, tail, alt, cat;
+
+  if (is_single_byte(&info->nodes[n->a]) &&
+      is_single_byte(&info->nodes[other]) &&
+      (head = fold_bytes(info, n->a, other)) != 0) {
+    if (other == n->b) return head;
+    n->a = (short) head;
+    n->b = next->b;
+    return i;
+  }
+
+  head = seq_head(info, n->a);
+  if (is_single_byte(&info->nodes[head]) &&
+      info->nodes[head].type == info->nodes[seq_head(info, other)].type &&
+      info->nodes[head].a == info->nodes[seq_head(info, other)].a &&
+      (tail = seq_tail(info, n->a)) != 0 &&
+      (other = seq_tail(info, other)) != 0 && has_room(info, 2)) {
+    alt = optimize_alt(info, new_node(info, N_ALT, tail, other));
+    if (!has_room(info, 1)) return i;
+    cat = new_node(info, N_CAT, head, alt);
+    if (next->type != N_ALT) return cat;
+    n->a = (short) cat;
+    n->b = next->b;
+  }
+
+  return i;
+}
+
+/* Rewrite tree i into an equivalent one that is cheaper to match */
+static int optimize(struct compile_info *info, int i) {
+  struct node *n = &info->nodes[i];
+
+  switch (n->type) {
+    case N_CAT:
+      n->a = (short) optimize(info, n->a);
+      n->b = (short) optimize(info, n->b);
+      return i;
+    case N_ALT:
+      n->a = (short) optimize(info, n->a);
+      n->b = (short) optimize(info, n->b);
+      return optimize_alt(info, i);
+    case N_GROUP: case N_STAR: case N_PLUS: case N_QUEST: case N_REPEAT:
+      n->a = (short) optimize(info, n->a);
+      return i;
+    default: return i;
+  }
+}
+
+/************************* Code generation **********************************/
+
+/* Returns non-zero if node can match an empty string */
+static int is_nullable(const struct compile_info *info, int i) {
+  const struct node *n = &info->nodes[i];
+
+  switch (n->type) {
+    case N_CAT: return is_nullable(info, n->a) && is_nullable(info, n->b);
+    case N_ALT: return is_nullable(info, n->a) || is_nullable(info, n->b);
+    case N_GROUP: case N_PLUS: return is_nullable(info, n->a);
+    case N_REPEAT: return n->lo == 0 || is_nullable(info, n->a);
+    case N_STAR: case N_QUEST: case N_EMPTY: case N_BOL: case N_EOL: return 1;
+    default: return 0;
+  }
+}
+
+/* Returns non-zero if every match of the node must start with ^ */
+static int is_anchored(const struct compile_info *info, int i) {
+  const struct node *n = &info->nodes[i];
+
+  switch (n->type) {
+    case N_BOL: return 1;
+    case N_CAT: return is_anchored(info, n->a);
+    case N_ALT: return is_anchored(info, n->a) && is_anchored(info, n->b);
+    case N_GROUP: case N_PLUS: return is_anchored(info, n->a);
+    case N_REPEAT: return n->lo > 0 && is_anchored(info, n->a);
+    default: return 0;
+  }
+}
+
+/*
+ * Append bytes that every match of the node starts with to the prefix.
+ * Returns non-zero if the node matches only these bytes, so that the
+ * prefix can be continued by the next node.
+ */
+static int get_prefix(const struct compile_info *info, int i) {
+  const struct node *n = &info->nodes[i];
+  struct slre_compiled *prog = info->prog;
+  int k;
+
+  switch (n->type) {
+    case N_EMPTY: return 1;
+    case N_CHAR:
+      /* Case-insensitive prefix is in lower case, see find_start() */
+      if (prog->prefix_len >= SLRE_MAX_PREFIX) return 0;
+      prog->prefix[prog->prefix_len++] = (unsigned char)
+        (prog->flags & SLRE_IGNORE_CASE ? to_lower_byte(n->a) : n->a);
+      return 1;
+    case N_CAT: return get_prefix(info, n->a) && get_prefix(info, n->b);
+    case N_GROUP: return get_prefix(info, n->a);
+    case N_PLUS: get_prefix(info, n->a); return 0;
+    case N_REPEAT:
+      for (k = 0; k < n->lo; k++) {
+        if (!get_prefix(info, n->a)) return 0;
+      }
+      return n->hi == n->lo;
+    default: return 0;
+  }
+}
+
+/*
+ * Lengths of all matches of a node, and literals that every match starts
+ * with, ends with and contains. If is_exact, the node matches only the
+ * string that is in all three literals.
+ */
+struct shape {
+  int min_len, max_len;
+  int is_exact, ends_at_eol;
+  unsigned char prefix[SLRE_MAX_PREFIX], suffix[SLRE_MAX_PREFIX];
+  unsigned char must[SLRE_MAX_PREFIX];
+  int prefix_len, suffix_len, must_len;
+};
+
+/* Lengths past this are not counted: min_len stops at it, max_len is -1 */
+enum { SHAPE_MAX_LEN = INT_MAX / 2 };
+
+static int add_len(int a, int b) {
+  return a > SHAPE_MAX_LEN - b ? SHAPE_MAX_LEN : a + b;
+}
+
+/* Join literals a and b, keeping the head, or the tail if is_tail is set */
+static int join_literals(unsigned char *dst, const unsigned char *a,
+                         int a_len, const unsigned char *b, int b_len,
+                         int is_tail) {
+  unsigned char buf[2 * SLRE_MAX_PREFIX];
+  int len = a_len + b_len, skip = 0;
+
+  memcpy(buf, a, a_len);
+  memcpy(buf + a_len, b, b_len);
+  if (len > SLRE_MAX_PREFIX) {
+    skip = is_tail ? len - SLRE_MAX_PREFIX : 0;
+    len = SLRE_MAX_PREFIX;
+  }
+  memcpy(dst, buf + skip, len);
+
+  return len;
+}
+
+static void set_must(struct shape *sh, const unsigned char *lit, int len) {
+  if (len > sh->must_len) {
+    memcpy(sh->must, lit, len);
+    sh->must_len = len;
+  }
+}
+
+/* Shape of concatenation a b, stored into a */
+static void cat_shape(struct shape *a, const struct shape *b) {
+  unsigned char lit[SLRE_MAX_PREFIX];
+  int len;
+
+  a->ends_at_eol = b->ends_at_eol || (a->ends_at_eol && b->max_len == 0);
+  a->min_len = add_len(a->min_len, b->min_len);
+  a->max_len = a->max_len < 0 || b->max_len < 0 ||
+    add_len(a->max_len, b->max_len) == SHAPE_MAX_LEN ? -1 :
+    a->max_len + b->max_len;
+
+  len = join_literals(lit, a->suffix, a->suffix_len, b->prefix,
+                      b->prefix_len, 0);
+  set_must(a, lit, len);
+  set_must(a, b->must, b->must_len);
+
+  if (a->is_exact) {
+    a->prefix_len = join_literals(a->prefix, a->prefix, a->prefix_len,
+                                  b->prefix, b->prefix_len, 0);
+  }
+  if (b->is_exact) {
+    a->suffix_len = join_literals(a->suffix, a->suffix, a->suffix_len,
+                                  b->suffix, b->suffix_len, 1);
+  } else {
+    memcpy(a->suffix, b->suffix, b->suffix_len);
+    a->suffix_len = b->suffix_len;
+  }
+  a->is_exact = a->is_exact && b->is_exact &&
+    a->prefix_len == a->min_len && a->suffix_len == a->min_len;
+}
+
+/* Shape of alternation a|b, stored into a */
+static void alt_shape(struct shape *a, const struct shape *b) {
+  int i;
+
+  a->ends_at_eol = a->ends_at_eol && b->ends_at_eol;
+  a->is_exact = a->is_exact && b->is_exact && a->min_len == b->min_len &&
+    a->prefix_len == b->prefix_len &&
+    memcmp(a->prefix, b->prefix, a->prefix_len) == 0;
+  if (b->min_len < a->min_len) a->min_len = b->min_len;
+  a->max_len = a->max_len < 0 || b->max_len < 0 ? -1 :
+    a->max_len > b->max_len ? a->max_len : b->max_len;
+
+  for (i = 0; i < a->prefix_len && i < b->prefix_len &&
+       a->prefix[i] == b->prefix[i]; i++) {
+  }
+  a->prefix_len = i;
+  for (i = 0; i < a->suffix_len && i < b->suffix_len &&
+       a->suffix[a->suffix_len - i - 1] == b->suffix[b->suffix_len - i - 1];
+       i++) {
+  }
+  memmove(a->suffix, a->suffix + a->suffix_len - i, i);
+  a->suffix_len = i;
+
+  a->must_len = 0;
+  set_must(a, a->prefix, a->prefix_len);
+  set_must(a, a->suffix, a->suffix_len);
+}
+
+/* Compute shape of node i, see struct shape */
+static void get_shape(const struct compile_info *info, int i,
+                      struct shape *sh) {
+  const struct node *n = &info->nodes[i];
+  struct shape b;
+  int k;
+
+  switch (n->type) {
+    case N_CAT:
+      get_shape(info, n->a, sh);
+      get_shape(info, n->b, &b);
+      cat_shape(sh, &b);
+      return;
+    case N_ALT:
+      get_shape(info, n->a, sh);
+      get_shape(info, n->b, &b);
+      alt_shape(sh, &b);
+      return;
+    case N_GROUP: get_shape(info, n->a, sh); return;
+    case N_PLUS:
+      get_shape(info, n->a, sh);
+      sh->max_len = sh->max_len == 0 ? 0 : -1;
+      sh->is_exact = sh->max_len == 0;
+      return;
+    case N_STAR: case N_QUEST:
+      get_shape(info, n->a, sh);
+      sh->max_len = n->type == N_QUEST || sh->max_len == 0 ? sh->max_len : -1;
+      sh->min_len = sh->is_exact = sh->ends_at_eol = 0;
+      sh->prefix_len = sh->suffix_len = sh->must_len = 0;
+      return;
+    case N_REPEAT:
+      /* Required repetitions one by one, then optional ones as a whole */
+      get_shape(info, n->a, &b);
+      memset(sh, 0, sizeof(*sh));
+      sh->is_exact = 1;
+      for (k = 0; k < n->lo && sh->min_len < SHAPE_MAX_LEN; k++) {
+        cat_shape(sh, &b);
+      }
+      if (k < n->lo) sh->max_len = -1;
+      if (n->hi != n->lo) {
+        b.max_len = b.max_len == 0 ? 0 : n->hi < 0 || b.max_len < 0 ||
+          n->hi - n->lo > SHAPE_MAX_LEN / b.max_len ? -1 :
+          (n->hi - n->lo) * b.max_len;
+        b.min_len = b.is_exact = b.ends_at_eol = 0;
+        b.prefix_len = b.suffix_len = b.must_len = 0;
+        cat_shape(sh, &b);
+      }
+      return;
+    case N_UTF8:
+      memset(sh, 0, sizeof(*sh));
+      sh->min_len = n->a >= 0 ? 1 : 4;
+      for (k = n->b; k < n->b + n->lo; k++) {
+        if (info->seqs[k].len < sh->min_len) sh->min_len = info->seqs[k].len;
+        if (info->seqs[k].len > sh->max_len) sh->max_len = info->seqs[k].len;
+      }
+      return;
+    default:
+      break;
+  }
+
+  /* Zero-width assertion, or a single byte */
+  memset(sh, 0, sizeof(*sh));
+  sh->is_exact = 1;
+  sh->ends_at_eol = n->type == N_EOL;
+  if (is_single_byte(n)) {
+    sh->min_len = sh->max_len = 1;
+    if (n->type != N_CHAR) {
+      sh->is_exact = 0;
+    } else {
+      sh->prefix[0] = sh->suffix[0] = sh->must[0] = (unsigned char)
+        (info->prog->flags & SLRE_IGNORE_CASE ? to_lower_byte(n->a) : n->a);
+      sh->prefix_len = sh->suffix_len = sh->must_len = 1;
+    }
+  }
+}
+
+/*
+ * Store lengths and the required literal of the regex. Literal at the
+ * end of a regex ending with $ is checked at the end of the buffer only.
+ * Otherwise, a literal that is not longer than the prefix adds nothing,
+ * and one of an anchored regex could make a quick failure slow.
+ */
+static void set_shape(struct compile_info *info, int root) {
+  struct slre_compiled *prog = info->prog;
+  struct shape sh;
+
+  get_shape(info, root, &sh);
+  prog->min_len = sh.min_len;
+  prog->max_len = sh.max_len;
+  if (sh.ends_at_eol) {
+    prog->flags |= ENDS_AT_EOL;
+    if (sh.suffix_len > 0) {
+      prog->flags |= MUST_AT_END;
+      memcpy(prog->must, sh.suffix, sh.suffix_len);
+      prog->must_len = sh.suffix_len;
+    }
+  } else if (!(prog->flags & IS_ANCHORED) && sh.must_len > prog->prefix_len) {
+    memcpy(prog->must, sh.must, sh.must_len);
+    prog->must_len = sh.must_len;
+  }
+}
+
+static int emit(struct compile_info *info, int op, int c, int x, int y) {
+  struct slre_compiled *prog = info->prog;
+  struct slre_insn *insn;
+
+  FAIL_IF(prog->num_insns >= ARRAY_SIZE(prog->insns), static_error_too_long);
+  insn = &prog->insns[prog->num_insns];
+  insn->op = (unsigned char) op;
+  insn->c = (unsigned char) c;
+  insn->x = (unsigned short) x;
+  insn->y = (unsigned short) y;
+
+  return ++prog->num_insns;
+}
+
+static int gen(struct compile_info *info, int i);
+
+/*
+ * Alternatives of N_UTF8 node from k on, -1 being its ASCII class. Bytes
+ * of a sequence are reversed for a reversed regex.
+ */
+static int gen_utf8(struct compile_info *info, const struct node *n, int k) {
+  struct slre_insn *insns = info->prog->insns;
+  const struct utf8_seq *seq;
+  int i, byte, split = info->prog->num_insns, jmp;
+
+  if (k + 1 < n->lo && !emit(info, I_SPLIT, 0, split + 1, 0)) return 0;
+
+  if (k < 0) {
+    if (!emit(info, I_CLASS, 0, n->a, 0)) return 0;
+  } else {
+    seq = &info->seqs[n->b + k];
+    for (i = 0; i < seq->len; i++) {
+      byte = seq->bytes[info->reverse ? seq->len - 1 - i : i];
+      if (!(byte < 256 ? emit(info, I_CHAR, byte, 0, 0) :
+            emit(info, I_CLASS, 0, byte - 256, 0))) return 0;
+    }
+  }
+  if (k + 1 >= n->lo) return 1;
+
+  jmp = info->prog->num_insns;
+  if (!emit(info, I_JMP, 0, 0, 0)) return 0;
+  insns[split].y = (unsigned short) info->prog->num_insns;
+  if (!gen_utf8(info, n, k + 1)) return 0;
+  insns[jmp].x = (unsigned short) info->prog->num_insns;
+
+  return 1;
+}
+
+/* Simple loop over ASCII class of N_UTF8 node */
+static int gen_ascii_loop(struct compile_info *info, const struct node *n,
+                          int is_lazy) {
+  struct slre_insn *insns = info->prog->insns;
+  int split = info->prog->num_insns;
+
+  if (!emit(info, I_SPLIT, SPLIT_SIMPLE_LOOP, 0, 0) ||
+      !emit(info, I_CLASS, 0, n->a, 0) || !emit(info, I_JMP, 0, split, 0)) {
+    return 0;
+  }
+  insns[split].x = (unsigned short) (is_lazy ? split + 3 : split + 1);
+  insns[split].y = (unsigned short) (is_lazy ? split + 1 : split + 3);
+
+  return 1;
+}
+
+/*
+ * Loop over UTF-8 character, that has an ASCII class a and sequences b:
+ * (a|b)* is a*(ba*)*, so that runs of ASCII take a simple loop. As UTF-8
+ * is a prefix code, both try the same matches in the same order. For
+ * (a|b)+, the first character is a, or b that enters the outer loop.
+ */
+static int gen_utf8_loop(struct compile_info *info, const struct node *n,
+                         int is_plus) {
+  struct slre_insn *insns = info->prog->insns;
+  const struct node *c = &info->nodes[n->a];
+  int first = info->prog->num_insns, split;
+
+  if (is_plus && (!emit(info, I_SPLIT, 0, first + 1, 0) ||
+                  !emit(info, I_CLASS, 0, c->a, 0))) return 0;
+  if (!gen_ascii_loop(info, c, n->b)) return 0;
+
+  split = info->prog->num_insns;
+  if (is_plus) insns[first].y = (unsigned short) (split + 1);
+  if (!emit(info, I_SPLIT, 0, 0, 0) || !gen_utf8(info, c, 0) ||
+      !gen_ascii_loop(info, c, n->b) || !emit(info, I_JMP, 0, split, 0)) {
+    return 0;
+  }
+  insns[split].x = (unsigned short) (n->b ? info->prog->num_insns : split + 1);
+  insns[split].y = (unsigned short) (n->b ? split + 1 : info->prog->num_insns);
+
+  return 1;
+}
+
+/* Loop over node i, for '*' and '+' quantifiers that can repeat */
+static int gen_loop(struct compile_info *info, const struct node *n,
+                    int is_plus) {
+  struct slre_insn *insns = info->prog->insns;
+  int split, body, reg = -1;
+
+  if (info->nodes[n->a].type == N_UTF8 && info->nodes[n->a].a >= 0) {
+    return gen_utf8_loop(info, n, is_plus);
+  }
+  if (is_single_byte(&info->nodes[n->a])) {
+    if (is_plus && !gen(info, n->a)) return 0;
+    split = info->prog->num_insns;
+    if (!emit(info, I_SPLIT, SPLIT_SIMPLE_LOOP, 0, 0) || !gen(info, n->a) ||
+        !emit(info, I_JMP, 0, split, 0)) return 0;
+    insns[split].x = (unsigned short) (n->b ? split + 3 : split + 1);
+    insns[split].y = (unsigned short) (n->b ? split + 1 : split + 3);
+    return 1;
+  }
+
+  /*
+   * Iteration that matched nothing must not loop again, see I_CHECK.
+   * Not needed in reversed program: rev_add() adds a pc once per offset.
+   */
+  if (is_nullable(info, n->a) && !info->reverse) {
+    FAIL_IF(info->prog->num_regs >= SLRE_MAX_BRACKETS, static_error_too_long);
+    reg = info->prog->num_regs++;
+  }
+
+  if (is_plus) {
+    /* First iteration may be empty, so the register is reset to -1 */
+    if (reg >= 0 && !emit(info, I_MARK, 1, reg, 0)) return 0;
+    body = info->prog->num_insns;
+    if (!gen(info, n->a) || (reg >= 0 && !emit(info, I_CHECK, 0, reg, 0))) {
+      return 0;
+    }
+    split = info->prog->num_insns;
+    if (!emit(info, I_SPLIT, 0, 0, 0) ||
+        (reg >= 0 && !emit(info, I_MARK, 0, reg, 0)) ||
+        !emit(info, I_JMP, 0, body, 0)) return 0;
+    insns[split].x = (unsigned short)
+      (n->b ? info->prog->num_insns : split + 1);
+    insns[split].y = (unsigned short)
+      (n->b ? split + 1 : info->prog->num_insns);
+  } else {
+    split = info->prog->num_insns;
+    if (!emit(info, I_SPLIT, 0, 0, 0) ||
+        (reg >= 0 && !emit(info, I_MARK, 0, reg, 0)) || !gen(info, n->a) ||
+        (reg >= 0 && !emit(info, I_CHECK, 0, reg, 0)) ||
+        !emit(info, I_JMP, 0, split, 0)) return 0;
+    insns[split].x = (unsigned short)
+      (n->b ? info->prog->num_insns : split + 1);
+    insns[split].y = (unsigned short)
+      (n->b ? split + 1 : info->prog->num_insns);
+  }
+
+  return 1;
+}
+
+/* Node that may be skipped, for '?' quantifier */
+static int gen_quest(struct compile_info *info, const struct node *n) {
+  struct slre_insn *insns = info->prog->insns;
+  int split = info->prog->num_insns;
+
+  if (!emit(info, I_SPLIT, 0, 0, 0) || !gen(info, n->a)) return 0;
+  insns[split].x = (unsigned short) (n->b ? info->prog->num_insns : split + 1);
+  insns[split].y = (unsigned short) (n->b ? split + 1 : info->prog->num_insns);
+
+  return 1;
+}
+
+/* Node repeated lo to hi times, see REPEAT_LAZY. x{1} is x, x{0,1} is x? */
+static int gen_count(struct compile_info *info, const struct node *n,
+                     int lo, int hi) {
+  struct slre_compiled *prog = info->prog;
+  int repeat = prog->num_insns, counter = prog->num_counters;
+
+  if (hi == 0) return 1;
+  if (hi == 1) return lo == 1 ? gen(info, n->a) : gen_quest(info, n);
+
+  FAIL_IF(counter >= REPEAT_LAZY, static_error_too_long);
+  prog->num_counters++;
+  if (!emit(info, I_REPEAT, counter | (n->b ? REPEAT_LAZY : 0), lo, hi) ||
+      !emit(info, I_JMP, 0, 0, 0) || !gen(info, n->a) ||
+      !emit(info, I_INC, counter, repeat, 0)) return 0;
+  prog->insns[repeat + 1].x = (unsigned short) prog->num_insns;
+
+  return 1;
+}
+
+/*
+ * Counted loop for {lo,hi} quantifier. Without the upper bound, it is
+ * followed by a '*' loop, so that x{2,} is x{2}x*.
+ */
+static int gen_repeat(struct compile_info *info, const struct node *n) {
+  struct node loop;
+
+  if (n->hi >= 0) return gen_count(info, n, n->lo, n->hi);
+  if (!gen_count(info, n, n->lo, n->lo)) return 0;
+
+  loop = *n;
+  loop.type = N_STAR;
+  return gen_loop(info, &loop, 0);
+}
+
+/* Generate code for node i. Returns 0 on error */
+static int gen(struct compile_info *info, int i) {
+  const struct node *n = &info->nodes[i];
+  struct slre_insn *insns = info->prog->insns;
+  int split, jmp;
+
+  switch (n->type) {
+    case N_EMPTY: return 1;
+    case N_CHAR:
+      /* Case is folded here, so that matching a letter is one OR */
+      if ((info->prog->flags & SLRE_IGNORE_CASE) &&
+          to_lower_byte(n->a) != to_upper_byte(n->a)) {
+        return emit(info, I_CHAR, to_lower_byte(n->a), 0, 1);
+      }
+      return emit(info, I_CHAR, n->a, 0, 0);
+    case N_ANY: return emit(info, I_ANY, 0, 0, 0);
+    case N_CLASS: return emit(info, I_CLASS, 0, n->a, 0);
+    case N_BOL: return emit(info, I_BOL, 0, 0, 0);
+    case N_EOL: return emit(info, I_EOL, 0, 0, 0);
+    case N_CAT:
+      return info->reverse ? gen(info, n->b) && gen(info, n->a) :
+        gen(info, n->a) && gen(info, n->b);
+    case N_GROUP:
+      return emit(info, I_SAVE, 0, 2 * (n->b - 1), 0) && gen(info, n->a) &&
+        emit(info, I_SAVE, 0, 2 * (n->b - 1) + 1, 0);
+    case N_ALT:
+      split = info->prog->num_insns;
+      if (!emit(info, I_SPLIT, 0, split + 1, 0) || !gen(info, n->a)) return 0;
+      jmp = info->prog->num_insns;
+      if (!emit(info, I_JMP, 0, 0, 0)) return 0;
+      insns[split].y = (unsigned short) info->prog->num_insns;
+      if (!gen(info, n->b)) return 0;
+      insns[jmp].x = (unsigned short) info->prog->num_insns;
+      return 1;
+    case N_QUEST: return gen_quest(info, n);
+    case N_STAR: return gen_loop(info, n, 0);
+    case N_PLUS: return gen_loop(info, n, 1);
+    case N_REPEAT: return gen_repeat(info, n);
+    case N_UTF8: return gen_utf8(info, n, n->a >= 0 ? -1 : 0);
+    default:
+      info->error_msg = static_error_internal;
+      return 0;
+  }
+}
+
+/* Add bytes matched by single-byte instruction to the class */
+static void add_insn_bytes(const struct slre_compiled *prog,
+                           const struct slre_insn *insn, unsigned char *bits) {
+  int i;
+
+  switch (insn->op) {
+    case I_CHAR:
+      class_add_range(bits, insn->c, insn->c, insn->y ? SLRE_IGNORE_CASE : 0);
+      break;
+    case I_ANY: memset(bits, 0xff, 32); break;
+    default:
+      for (i = 0; i < 32; i++) bits[i] |= prog->classes[insn->x][i];
+      break;
+  }
+}
+
+/*
+ * Split bytes into classes, such that all bytes of a class are matched by
+ * the same instructions. The DFA keeps transitions per class, not per byte.
+ */
+static void set_byte_classes(struct slre_compiled *prog) {
+  unsigned char parts[256][32], bits[32], in[32], out[32], done[2][32];
+  unsigned char classes_done[SLRE_MAX_CLASSES], *map = prog->byte_classes;
+  int i, j, k, ch, n = 1, has_in, has_out, remap[256];
+
+  /* Every distinct byte set splits each part into bytes in and out of it */
+  memset(parts[0], 0xff, sizeof(parts[0]));
+  memset(done, 0, sizeof(done));
+  memset(classes_done, 0, sizeof(classes_done));
+  for (i = 0; i < prog->num_insns; i++) {
+    const struct slre_insn *insn = &prog->insns[i];
+
+    if (insn->op == I_CHAR) {
+      if (CLASS_HAS(done[insn->y != 0], insn->c)) continue;
+      CLASS_ADD(done[insn->y != 0], insn->c);
+    } else if (insn->op == I_CLASS) {
+      if (classes_done[insn->x]) continue;
+      classes_done[insn->x] = 1;
+    } else {
+      continue;
+    }
+    memset(bits, 0, sizeof(bits));
+    add_insn_bytes(prog, insn, bits);
+
+    for (k = n - 1; k >= 0; k--) {
+      for (has_in = has_out = j = 0; j < 32; j++) {
+        in[j] = parts[k][j] & bits[j];
+        out[j] = parts[k][j] & (unsigned char) ~bits[j];
+        has_in |= in[j];
+        has_out |= out[j];
+      }
+      if (has_in && has_out) {
+        memcpy(parts[k], in, sizeof(in));
+        memcpy(parts[n++], out, sizeof(out));
+      }
+    }
+  }
+
+  /* Number classes in the order of their lowest byte */
+  for (k = 0; k < n; k++) {
+    for (j = 0; j < 32; j++) {
+      if (parts[k][j] == 0) continue;
+      for (ch = j * 8; ch < j * 8 + 8; ch++) {
+        if (CLASS_HAS(parts[k], ch)) map[ch] = (unsigned char) k;
+      }
+    }
+  }
+  memset(remap, 0xff, sizeof(remap));
+  for (prog->num_byte_classes = ch = 0; ch < 256; ch++) {
+    if (remap[map[ch]] < 0) remap[map[ch]] = prog->num_byte_classes++;
+    map[ch] = (unsigned char) remap[map[ch]];
+  }
+}
+
+/* What get_first_bytes() can reach without consuming a byte */
+enum { REACH_MATCH = 1, REACH_BOL = 2, REACH_EOL = 4 };
+
+/*
+ * Collect bytes that the program can consume first, starting from pc.
+ * Returns REACH_* bitmask of what is reached without consuming a byte.
+ */
+static int get_first_bytes(const struct slre_compiled *prog, int pc,
+                           unsigned char *bits, unsigned char *seen) {
+  const struct slre_insn *insn = &prog->insns[pc];
+
+  if (seen[pc]) return 0;
+  seen[pc] = 1;
+
+  switch (insn->op) {
+    case I_CHAR: case I_ANY: case I_CLASS:
+      add_insn_bytes(prog, insn, bits);
+      return 0;
+    case I_SPLIT:
+      return get_first_bytes(prog, insn->x, bits, seen) |
+        get_first_bytes(prog, insn->y, bits, seen);
+    case I_JMP: case I_INC: return get_first_bytes(prog, insn->x, bits, seen);
+    case I_REPEAT:
+      return get_first_bytes(prog, pc + 1, bits, seen) |
+        get_first_bytes(prog, pc + 2, bits, seen);
+    case I_EOL: return REACH_EOL;  /* Nothing is consumed past the end */
+    case I_BOL: return REACH_BOL | get_first_bytes(prog, pc + 1, bits, seen);
+    case I_MATCH: return REACH_MATCH;
+    default: return get_first_bytes(prog, pc + 1, bits, seen);
+  }
+}
+
+/*
+ * Mark greedy loops over a byte that never need to give bytes back,
+ * because what follows can't start with such byte, e.g. \d+\s or a*$.
+ */
+static void set_possessive(struct slre_compiled *prog) {
+  unsigned char bits[32], next[32], seen[SLRE_MAX_INSNS];
+  int i, j, overlap;
+
+  for (i = 0; i + 3 < prog->num_insns; i++) {
+    if (prog->insns[i].op != I_SPLIT ||
+        !(prog->insns[i].c & SPLIT_SIMPLE_LOOP) ||
+        prog->insns[i].x != i + 1) continue;
+
+    memset(bits, 0, sizeof(bits));
+    memset(next, 0, sizeof(next));
+    memset(seen, 0, sizeof(seen));
+    add_insn_bytes(prog, &prog->insns[i + 1], bits);
+    if (get_first_bytes(prog, i + 3, next, seen) & (REACH_MATCH | REACH_BOL)) {
+      continue;
+    }
+    for (j = overlap = 0; j < 32; j++) overlap |= bits[j] & next[j];
+    if (!overlap) prog->insns[i].c |= SPLIT_POSSESSIVE;
+  }
+}
+
+/*
+ * Mark anchored program that never needs to go back: at every SPLIT, the
+ * next byte picks the way, because the two ways can't consume the same
+ * byte first and the preferred one can't match without consuming. Loop
+ * registers, loop counters and ^ past the start are not supported.
+ */
+static void set_one_pass(struct slre_compiled *prog) {
+  unsigned char bits[32], other[32], seen[SLRE_MAX_INSNS];
+  struct slre_insn *insn;
+  int i, j, reach;
+
+  if (!(prog->flags & IS_ANCHORED) || prog->num_regs > 0 ||
+      prog->num_counters > 0) {
+    return;
+  }
+  for (i = 0; i < prog->num_insns; i++) {
+    insn = &prog->insns[i];
+    if (insn->op != I_SPLIT) continue;
+
+    memset(bits, 0, sizeof(bits));
+    memset(other, 0, sizeof(other));
+    memset(seen, 0, sizeof(seen));
+    if (get_first_bytes(prog, insn->x, bits, seen)) return;
+    memset(seen, 0, sizeof(seen));
+    reach = get_first_bytes(prog, insn->y, other, seen);
+    if (reach & REACH_BOL) return;
+    for (j = 0; j < 32; j++) {
+      if (bits[j] & other[j]) return;
+    }
+    if (reach & REACH_MATCH) insn->c |= SPLIT_TO_MATCH;
+  }
+  prog->flags |= IS_ONE_PASS;
+}
+
+/*
+ * Rearrange class bitmaps for SIMD lookup by low nibble: byte lo of the
+ * first half has bit h set if byte (h << 4 | lo) is in the class, second
+ * half does the same for bytes with h + 8 in the high nibble.
+ */
+static void set_nibbles(struct slre_compiled *prog) {
+  int i, ch;
+
+  memset(prog->nibbles, 0, sizeof(prog->nibbles));
+  for (i = 0; i < prog->num_classes; i++) {
+    for (ch = 0; ch < 256; ch++) {
+      if (CLASS_HAS(prog->classes[i], ch)) {
+        prog->nibbles[i][(ch & 15) + (ch & 128 ? 16 : 0)] |=
+          (unsigned char) (1 << ((ch >> 4) & 7));
+      }
+    }
+  }
+}
+
+/* Compute data derived from the program, used to speed up matching */
+static void finish(struct compile_info *info) {
+  struct slre_compiled *prog = info->prog;
+  int i;
+
+  set_byte_classes(prog);
+  set_possessive(prog);
+  set_one_pass(prog);
+  for (i = 0; i < prog->num_insns; i++) {
+    if (prog->insns[i].op == I_EOL) prog->flags |= HAS_EOL;
+  }
+
+  /*
+   * Without a prefix, a match can still be skipped to when only some
+   * bytes can start it. If there is no room for one more class, don't.
+   */
+  prog->first_class = -1;
+  if (!(prog->flags & IS_ANCHORED) && prog->prefix_len == 0 &&
+      prog->num_classes < ARRAY_SIZE(prog->classes)) {
+    unsigned char bits[32], seen[SLRE_MAX_INSNS], all[32];
+
+    memset(bits, 0, sizeof(bits));
+    memset(seen, 0, sizeof(seen));
+    memset(all, 0xff, sizeof(all));
+    get_first_bytes(prog, 0, bits, seen);
+    if (memcmp(bits, all, sizeof(all)) != 0) {
+      prog->first_class = add_class(info, bits);
+    }
+  }
+  if (prog->prefix_len > 0 || prog->first_class >= 0) {
+    prog->flags |= CAN_SKIP;
+  }
+  set_nibbles(prog);
+}
+
+/*
+ * Regex that always matches up to the end of the buffer also gets its
+ * program reversed, stored after the forward one, see rev_search(). It
+ * is not larger. Reversed program has no loop registers, see gen_loop().
+ * Regex with loop counters is not reversed: rev_add() keeps no counters.
+ */
+static void gen_reversed(struct compile_info *info, int root) {
+  struct slre_compiled *prog = info->prog;
+  int num_insns = prog->num_insns;
+
+  if (!(prog->flags & ENDS_AT_EOL) || (prog->flags & IS_ANCHORED) ||
+      prog->num_counters > 0 || 2 * num_insns > ARRAY_SIZE(prog->insns)) {
+    return;
+  }
+
+  info->reverse = 1;
+  if (gen(info, root) && emit(info, I_MATCH, 0, 0, 0)) {
+    prog->num_rev_insns = prog->num_insns - num_insns;
+  }
+  info->reverse = 0;
+  prog->num_insns = num_insns;
+}
+
+static int compile(const char *re, int re_len, struct slre_compiled *prog,
+                   struct compile_info *info) {
+  int root;
+
+  info->re = re;
+  info->re_len = re_len;
+  info->pos = 0;
+  info->num_nodes = 1;
+  info->num_seqs = 0;
+  info->prog = prog;
+  info->reverse = 0;
+
+  prog->num_insns = prog->num_brackets = prog->num_regs = 0;
+  prog->num_counters = prog->num_classes = 0;
+  prog->prefix_len = prog->must_len = 0;
+  prog->num_rev_insns = prog->min_len = 0;
+  prog->max_len = -1;
+
+  root = parse_alt(info);
+  FAIL_IF(root == 0, info->error_msg);
+  FAIL_IF(info->pos < re_len, static_error_unbalanced_brackets);
+  root = optimize(info, root);
+
+  /* SLRE_ANCHORED and SLRE_FULL_MATCH add implicit ^ and $ around regex */
+  if (prog->flags & (SLRE_ANCHORED | SLRE_FULL_MATCH)) {
+    root = new_node(info, N_CAT, new_node(info, N_BOL, 0, 0), root);
+  }
+  if (root > 0 && (prog->flags & SLRE_FULL_MATCH)) {
+    root = new_node(info, N_CAT, root, new_node(info, N_EOL, 0, 0));
+  }
+  FAIL_IF(root == 0, info->error_msg);
+
+  /* Anchored regex is tried at offset 0 only, prefix is not needed */
+  if (is_anchored(info, root)) {
+    prog->flags |= IS_ANCHORED;
+  } else {
+    get_prefix(info, root);
+  }
+  set_shape(info, root);
+
+  if (!gen(info, root) || !emit(info, I_MATCH, 0, 0, 0)) return 0;
+  finish(info);
+  gen_reversed(info, root);
+
+  return 1;
+}
+
+/*
+ * Compile regexes one by one and join their programs into one, that
+ * starts with a chain of SPLITs trying every regex. MATCH of each regex
+ * keeps regex index in the set, base + i, in x. Captures and loop
+ * registers are not relocated: set matching does not use them. Loop
+ * counters are, as the NFA and DFA tell states apart by them.
+ */
+static int join(struct compile_info *info, const char **regexps, int n,
+                int base, int flags) {
+  struct slre_compiled *prog = info->prog, re;
+  struct slre_insn insn;
+  int i, j, start, cls;
+
+  prog->num_insns = prog->num_brackets = prog->num_regs = 0;
+  prog->num_counters = prog->num_classes = 0;
+  prog->prefix_len = prog->must_len = 0;
+  prog->num_rev_insns = prog->min_len = 0;
+  prog->max_len = -1;
+  prog->flags = IS_ANCHORED;
+
+  for (i = 0; i + 1 < n; i++) {
+    if (!emit(info, I_SPLIT, 0, 0, i + 1)) return 0;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (!slre_compile(regexps[i], flags, &re, &info->error_msg)) return 0;
+    start = prog->num_insns;
+    if (i + 1 < n) prog->insns[i].x = (unsigned short) start;
+    if (i > 0 && i + 1 == n) prog->insns[i - 1].y = (unsigned short) start;
+    if (!(re.flags & IS_ANCHORED)) prog->flags &= ~IS_ANCHORED;
+
+    for (j = 0; j < re.num_insns; j++) {
+      insn = re.insns[j];
+      switch (insn.op) {
+        case I_SPLIT:
+          insn.x = (unsigned short) (insn.x + start);
+          insn.y = (unsigned short) (insn.y + start);
+          break;
+        case I_JMP: insn.x = (unsigned short) (insn.x + start); break;
+        case I_REPEAT:
+          insn.c = (unsigned char) (insn.c + prog->num_counters);
+          break;
+        case I_INC:
+          insn.c = (unsigned char) (insn.c + prog->num_counters);
+          insn.x = (unsigned short) (insn.x + start);
+          break;
+        case I_CLASS:
+          if ((cls = add_class(info, re.classes[insn.x])) < 0) return 0;
+          insn.x = (unsigned short) cls;
+          break;
+        case I_MATCH: insn.x = (unsigned short) (base + i); break;
+        default: break;
+      }
+      if (!emit(info, insn.op, insn.c, insn.x, insn.y)) return 0;
+    }
+    prog->num_counters += re.num_counters;
+  }
+  finish(info);
+
+  return 1;
+}
+
+static int number_states(const struct slre_compiled *re, int *states,
+                         int *num_threads);
+
+/*
+ * Split regexes of a set into runs that fit SLRE_MAX_INSNS and
+ * SLRE_MAX_CLASSES together, and join every run into one program. Loop
+ * counters add NFA states, see number_states(), and a run has no more of
+ * them than SLRE_MAX_INSNS, so that set programs fit in scratch memory.
+ */
+static int join_set(struct compile_info *info, struct slre_set *set,
+                    const char **regexps, int n, int flags) {
+  struct slre_compiled re;
+  int i, first, num_insns, num_classes, num_counters, num_states, states;
+  int threads;
+
+  FAIL_IF(n <= 0, "Empty regex set");
+  set->num_programs = 0;
+  for (first = 0; first < n; first = i) {
+    FAIL_IF(set->num_programs >= SLRE_SET_PROGRAMS,
+            "Too many regexes in set. Increase SLRE_SET_PROGRAMS");
+
+    /* Every regex but the first one also takes a SPLIT of the chain */
+    num_insns = num_classes = num_counters = num_states = 0;
+    for (i = first; i < n; i++) {
+      if (!slre_compile(regexps[i], flags, &re, &info->error_msg)) return 0;
+      states = number_states(&re, NULL, &threads);
+      FAIL_IF(states == 0 || states > SLRE_MAX_INSNS,
+              static_error_set_states);
+      num_insns += re.num_insns + (i > first ? 1 : 0);
+      num_classes += re.num_classes;
+      num_counters += re.num_counters;
+      num_states += states + (i > first ? 1 : 0);
+      if (i > first && (num_insns > SLRE_MAX_INSNS ||
+                        num_classes > SLRE_MAX_CLASSES ||
+                        num_counters > REPEAT_LAZY ||
+                        num_states > SLRE_MAX_INSNS)) break;
+    }
+
+    info->prog = &set->progs[set->num_programs];
+    set->counts[set->num_programs++] = i - first;
+    if (!join(info, regexps + first, i - first, first, flags)) return 0;
+  }
+
+  return 1;
+}
+
+/******************************* Matching ***********************************/
+
+/* Size of n bytes in scratch memory, which keeps every array aligned */
+#define SCRATCH_ALIGN(n) (((n) + (int) sizeof(long) - 1) / \
+                          (int) sizeof(long) * (int) sizeof(long))
+
+/* Take n bytes from scratch memory. Returns NULL if they do not fit */
+static void *carve(struct scratch *mem, int n) {
+  char *p = mem->p;
+
+  n = SCRATCH_ALIGN(n);
+  if (n > mem->len) return NULL;
+  mem->p += n;
+  mem->len -= n;
+
+  return p;
+}
+
+/*
+ * Returns the number of leading bytes of s for which membership in the
+ * class is equal to in, testing 16 or 32 bytes at a time with SIMD.
+ * 8-bit bitmask of the byte's high nibble is looked up by the low one.
+ */
+static int class_span(const struct slre_compiled *re, int cls,
+                      const unsigned char *s, int len, int in) {
+  const unsigned char *bits = re->classes[cls];
+  int i = 0;
+
+#if defined(SLRE_AVX2)
+  const __m256i lo = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *) re->nibbles[cls]));
+  const __m256i hi = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *) (re->nibbles[cls] + 16)));
+  const __m256i bit = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                       1, 2, 4, 8, 16, 32, 64, -128,
+                                       1, 2, 4, 8, 16, 32, 64, -128,
+                                       1, 2, 4, 8, 16, 32, 64, -128);
+  const __m256i mask = _mm256_set1_epi8((char) 0x8f);
+  const __m256i top = _mm256_set1_epi8((char) 0x80);
+  const __m256i nib = _mm256_set1_epi8(0x0f);
+  __m256i x, idx, row;
+  unsigned out;
+
+  for (; i + 32 <= len; i += 32) {
+    x = _mm256_loadu_si256((const __m256i *) (s + i));
+    idx = _mm256_and_si256(x, mask);
+    row = _mm256_or_si256(_mm256_shuffle_epi8(lo, idx),
+                          _mm256_shuffle_epi8(hi, _mm256_xor_si256(idx, top)));
+    row = _mm256_and_si256(row, _mm256_shuffle_epi8(bit,
+        _mm256_and_si256(_mm256_srli_epi16(x, 4), nib)));
+    out = (unsigned) _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(row, _mm256_setzero_si256()));
+    if (!in) out = ~out;
+    if (out != 0) return i + __builtin_ctz(out);
+  }
+#elif defined(SLRE_SSSE3)
+  const __m128i lo = _mm_loadu_si128((const __m128i *) re->nibbles[cls]);
+  const __m128i hi = _mm_loadu_si128((const __m128i *) (re->nibbles[cls] + 16));
+  const __m128i bit = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                    1, 2, 4, 8, 16, 32, 64, -128);
+  const __m128i mask = _mm_set1_epi8((char) 0x8f);
+  const __m128i top = _mm_set1_epi8((char) 0x80);
+  const __m128i nib = _mm_set1_epi8(0x0f);
+  __m128i x, idx, row;
+  unsigned out;
+
+  for (; i + 16 <= len; i += 16) {
+    x = _mm_loadu_si128((const __m128i *) (s + i));
+    idx = _mm_and_si128(x, mask);
+    row = _mm_or_si128(_mm_shuffle_epi8(lo, idx),
+                       _mm_shuffle_epi8(hi, _mm_xor_si128(idx, top)));
+    row = _mm_and_si128(row, _mm_shuffle_epi8(bit,
+        _mm_and_si128(_mm_srli_epi16(x, 4), nib)));
+    out = (unsigned) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(row, _mm_setzero_si128()));
+    if (!in) out = ~out & 0xffff;
+    if (out != 0) return i + __builtin_ctz(out);
+  }
+#elif defined(SLRE_NEON)
+  /* Table lookup gives 0 for out of range index, like pshufb on x86 */
+  const uint8x16_t lo = vld1q_u8(re->nibbles[cls]);
+  const uint8x16_t hi = vld1q_u8(re->nibbles[cls] + 16);
+  static const unsigned char bit_tab[16] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+  };
+  const uint8x16_t bit = vld1q_u8(bit_tab);
+  uint8x16_t x, idx, row;
+  unsigned long long out;
+
+  for (; i + 16 <= len; i += 16) {
+    x = vld1q_u8(s + i);
+    idx = vandq_u8(x, vdupq_n_u8(0x8f));
+    row = vorrq_u8(vqtbl1q_u8(lo, idx),
+                   vqtbl1q_u8(hi, veorq_u8(idx, vdupq_n_u8(0x80))));
+    row = vandq_u8(row, vqtbl1q_u8(bit, vshrq_n_u8(x, 4)));
+    /* Narrow to 4 bits per byte, set for bytes not in the class */
+    out = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(
+        vreinterpretq_u16_u8(vceqzq_u8(row)), 4)), 0);
+    if (!in) out = ~out;
+    if (out != 0) return i + (__builtin_ctzll(out) >> 2);
+  }
+#else
+  /* Class of all ASCII bytes, taken by UTF-8 loops, is scanned by words */
+  unsigned long w, high = (unsigned long) -1 / 0xff * 0x80;
+  int k = 0;
+
+  while (k < 32 && bits[k] == (k < 16 ? 0xff : 0)) k++;
+  for (; in && k == 32 && i + (int) sizeof(w) <= len; i += (int) sizeof(w)) {
+    memcpy(&w, s + i, sizeof(w));
+    if (w & high) break;
+  }
+#endif
+
+  while (i < len && (CLASS_HAS(bits, s[i]) ? 1 : 0) == in) i++;
+
+  return i;
+}
+
+/*
+ * Same as memchr(), but if fold is set, lower-case letter c is found in
+ * either case. Setting bit 0x20 makes the upper-case letter c, so that
+ * one comparison tests 16 or 32 bytes at a time, or a word without SIMD.
+ */
+static const unsigned char *find_byte(const unsigned char *s, int len, int c,
+                                      int fold) {
+#if defined(SLRE_AVX2)
+  const __m256i want = _mm256_set1_epi8((char) c);
+  const __m256i bit = _mm256_set1_epi8(0x20);
+  unsigned out;
+#elif defined(SLRE_SSSE3) || defined(SLRE_SSE2)
+  const __m128i want = _mm_set1_epi8((char) c);
+  const __m128i bit = _mm_set1_epi8(0x20);
+  unsigned out;
+#elif defined(SLRE_NEON)
+  const uint8x16_t want = vdupq_n_u8((unsigned char) c);
+  const uint8x16_t bit = vdupq_n_u8(0x20);
+  unsigned long long out;
+#else
+  unsigned long w, ones = (unsigned long) -1 / 0xff;
+  unsigned long want = ones * (unsigned long) c;
+#endif
+  int i = 0;
+
+  if (!fold || c < 'a' || c > 'z') {
+    return (const unsigned char *) memchr(s, c, (size_t) len);
+  }
+
+#if defined(SLRE_AVX2)
+  for (; i + 32 <= len; i += 32) {
+    out = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_or_si256(
+        _mm256_loadu_si256((const __m256i *) (s + i)), bit), want));
+    if (out != 0) return s + i + __builtin_ctz(out);
+  }
+#elif defined(SLRE_SSSE3) || defined(SLRE_SSE2)
+  for (; i + 16 <= len; i += 16) {
+    out = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(
+        _mm_loadu_si128((const __m128i *) (s + i)), bit), want));
+    if (out != 0) return s + i + __builtin_ctz(out);
+  }
+#elif defined(SLRE_NEON)
+  for (; i + 16 <= len; i += 16) {
+    out = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(
+        vceqq_u8(vorrq_u8(vld1q_u8(s + i), bit), want)), 4)), 0);
+    if (out != 0) return s + i + (__builtin_ctzll(out) >> 2);
+  }
+#else
+  /* Word has a zero byte, i.e. a byte equal to c, if subtracting borrows */
+  for (; i + (int) sizeof(w) <= len; i += (int) sizeof(w)) {
+    memcpy(&w, s + i, sizeof(w));
+    w = (w | ones * 0x20) ^ want;
+    if ((w - ones) & ~w & ones * 0x80) break;
+  }
+#endif
+
+  for (; i < len; i++) {
+    if ((s[i] | 0x20) == c) return s + i;
+  }
+
+  return NULL;
+}
+
+/* Same as memcmp() == 0, with s in lower case if fold is set */
+static int same_bytes(const unsigned char *s, const unsigned char *lit,
+                      int len, int fold) {
+  int i;
+
+  if (!fold) return memcmp(s, lit, len) == 0;
+  for (i = 0; i < len && to_lower_byte(s[i]) == lit[i]; i++) {
+  }
+
+  return i == len;
+}
+
+static int match_byte(const struct slre_insn *insn, const unsigned char *s,
+                      struct regex_info *info) {
+  switch (insn->op) {
+    case I_CHAR:
+      return insn->y ? (*s | 0x20) == insn->c : *s == insn->c;
+    case I_ANY: return 1;
+    case I_CLASS: return CLASS_HAS(info->re->classes[insn->x], *s);
+    default: return 0;
+  }
+}
+
+static int backtrack(int pc, int sp, struct regex_info *info);
+
+/* Steps between checks of slre_limits::is_expired() */
+enum { LIMIT_INTERVAL = 4096 };
+
+/*
+ * Called when regex_info::steps_left is used up. Returns non-zero, with
+ * error set, if a limit is exceeded. Otherwise sets new steps_left.
+ */
+static int limit_exceeded(struct regex_info *info) {
+  const struct slre_limits *limits = info->limits;
+  long done = info->steps_done - info->steps_left, n = LIMIT_INTERVAL;
+
+  if (info->error_msg == static_error_limit) return 1;
+  if (limits == NULL) {
+    info->steps_left = LONG_MAX;
+    return 0;
+  }
+
+  if ((limits->max_steps > 0 && done > limits->max_steps) ||
+      (limits->is_expired != NULL && limits->is_expired(limits->arg))) {
+    info->error_msg = static_error_limit;
+    info->steps_left = -1;
+    return 1;
+  }
+
+  if (limits->max_steps > 0 && limits->max_steps - done + 1 < n) {
+    n = limits->max_steps - done + 1;
+  }
+  info->steps_done = done + n;
+  info->steps_left = n;
+
+  return 0;
+}
+
+/* Account n steps of work. Non-zero if a limit is exceeded */
+#define SPEND(info, n) \
+  (((info)->steps_left -= (n)) < 0 && limit_exceeded(info))
+
+/* Returns how many bytes from offset sp match single-byte instruction */
+static int loop_span(const struct slre_insn *op, int sp,
+                     struct regex_info *info) {
+  int n = 0;
+
+  if (op->op == I_ANY) {
+    n = info->s_len - sp;
+  } else if (op->op == I_CLASS) {
+    n = class_span(info->re, op->x, info->s + sp, info->s_len - sp, 1);
+  }
+  while (sp + n < info->s_len && match_byte(op, info->s + sp + n, info)) {
+    n++;
+  }
+  STAT(info, bytes, n);
+
+  return n;
+}
+
+/* Loop over single-byte instruction, see SPLIT_SIMPLE_LOOP */
+static int simple_loop(int pc, int sp, struct regex_info *info) {
+  const struct slre_insn *split = &info->re->insns[pc], *op = split + 1;
+  int n = 0, result;
+
+  if (split->x == pc + 1) {
+    /* Greedy: consume as much as possible, then give back byte by byte */
+    n = loop_span(op, sp, info);
+    if (SPEND(info, n)) return -1;
+    if (split->c & SPLIT_POSSESSIVE) return backtrack(pc + 3, sp + n, info);
+    for (; n >= 0; n--) {
+      if ((result = backtrack(pc + 3, sp + n, info)) >= 0) return result;
+      if (info->steps_left < 0) break;
+      STAT(info, backtracks, 1);
+    }
+  } else {
+    for (;; n++) {
+      if ((result = backtrack(pc + 3, sp + n, info)) >= 0) return result;
+      if (info->steps_left < 0 ||
+          sp + n >= info->s_len || !match_byte(op, info->s + sp + n, info)) {
+        break;
+      }
+      STAT(info, bytes, 1);
+      STAT(info, backtracks, 1);
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * Run the program from instruction pc at buffer offset sp, trying
+ * alternatives in order of preference. Returns the end offset of the match,
+ * or -1 if there is no match.
+ */
+static int backtrack_insns(int pc, int sp, struct regex_info *info) {
+  const struct slre_insn *insn;
+  int result, saved, *counter;
+
+  for (;;) {
+    insn = &info->re->insns[pc];
+    DBG(("%s pc=%d sp=%d op=%d\n", __func__, pc, sp, insn->op));
+    if (SPEND(info, 1)) return -1;
+
+    switch (insn->op) {
+      case I_CHAR: case I_ANY: case I_CLASS:
+        if (sp >= info->s_len) return -1;
+        STAT(info, bytes, 1);
+        if (!match_byte(insn, info->s + sp, info)) return -1;
+        pc++;
+        sp++;
+        break;
+      case I_BOL:
+        if (sp != 0) return -1;
+        pc++;
+        break;
+      case I_EOL:
+        if (sp != info->s_len) return -1;
+        pc++;
+        break;
+      case I_JMP:
+        pc = insn->x;
+        break;
+      case I_SPLIT:
+        if (insn->c & SPLIT_SIMPLE_LOOP) return simple_loop(pc, sp, info);
+        STAT(info, branches, 1);
+        if ((result = backtrack(insn->x, sp, info)) >= 0) return result;
+        STAT(info, backtracks, 1);
+        pc = insn->y;
+        break;
+      case I_SAVE:
+        if (insn->x >= info->num_slots) {
+          pc++;
+          break;
+        }
+        saved = info->slots[insn->x];
+        info->slots[insn->x] = sp;
+        if ((result = backtrack(pc + 1, sp, info)) < 0) {
+          info->slots[insn->x] = saved;
+        }
+        return result;
+      case I_MARK:
+        saved = info->regs[insn->x];
+        info->regs[insn->x] = insn->c ? -1 : sp;
+        if ((result = backtrack(pc + 1, sp, info)) < 0) {
+          info->regs[insn->x] = saved;
+        }
+        return result;
+      case I_CHECK:
+        if (info->regs[insn->x] == sp) return -1;
+        pc++;
+        break;
+      case I_REPEAT:
+        counter = &info->counters[insn->c & ~REPEAT_LAZY];
+        saved = *counter;
+        if (saved < insn->x) {
+          pc += 2;
+          break;
+        }
+        if (saved < insn->y) STAT(info, branches, 1);
+        if (saved < insn->y && !(insn->c & REPEAT_LAZY)) {
+          if ((result = backtrack(pc + 2, sp, info)) >= 0) return result;
+          STAT(info, backtracks, 1);
+        }
+        *counter = 0;
+        result = backtrack(pc + 1, sp, info);
+        *counter = saved;
+        if (result >= 0 || saved >= insn->y || !(insn->c & REPEAT_LAZY)) {
+          return result;
+        }
+        STAT(info, backtracks, 1);
+        pc += 2;
+        break;
+      case I_INC:
+        info->counters[insn->c]++;
+        if ((result = backtrack(insn->x, sp, info)) < 0) {
+          info->counters[insn->c]--;
+        }
+        return result;
+      case I_MATCH:
+        /* Empty match is not reported, try other alternatives */
+        return sp > info->start ? sp : -1;
+      default:
+        info->error_msg = static_error_internal;
+        return -1;
+    }
+  }
+}
+
+/* Same as backtrack_insns(), with limited depth of recursion */
+static int backtrack(int pc, int sp, struct regex_info *info) {
+  int result;
+
+  if (info->depth >= info->max_depth) {
+    info->error_msg = static_error_limit;
+    info->steps_left = -1;
+    return -1;
+  }
+  info->depth++;
+  STAT(info, recursions, 1);
+  result = backtrack_insns(pc, sp, info);
+  info->depth--;
+
+  return result;
+}
+
+/*
+ * Returns the first offset from i on where a match can start, or
+ * regex_info::to if there is none: offset of the regex prefix, or of any
+ * byte in slre_compiled::first_class.
+ */
+static int find_start(const struct regex_info *info, int i) {
+  const struct slre_compiled *re = info->re;
+  const unsigned char *p;
+  int end = info->s_len - re->prefix_len + 1;
+  int fold = re->flags & SLRE_IGNORE_CASE;
+
+  if (i >= info->to) return info->to;
+  if (re->prefix_len == 0) {
+    return i + class_span(re, re->first_class, info->s + i, info->to - i, 0);
+  }
+
+  if (end > info->to) end = info->to;
+  while (i < end) {
+    p = find_byte(info->s + i, end - i, re->prefix[0], fold);
+    if (p == NULL) break;
+    if (same_bytes(p + 1, re->prefix + 1, re->prefix_len - 1, fold)) {
+      return (int) (p - info->s);
+    }
+    i = (int) (p - info->s) + 1;
+  }
+
+  return info->to;
+}
+
+/* Same as find_start(), counting skipped bytes in slre_stats */
+static int skip_to_start(const struct regex_info *info, int i) {
+  int start = find_start(info, i);
+
+  STAT(info, bytes_skipped, start > i ? start - i : 0);
+
+  return start;
+}
+
+/* Find leftmost match by running backtrack() at every offset */
+static int backtrack_search(struct regex_info *info) {
+  int i, result = -1;
+
+  for (i = info->from; i < info->to; i++) {
+    if ((info->re->flags & CAN_SKIP) &&
+        (i = skip_to_start(info, i)) >= info->to) break;
+    info->start = i;
+    STAT(info, starts, 1);
+    result = backtrack(0, i, info);
+    DBG(("   (iter %d) -> %d\n", i, result));
+    if (result > 0 || (info->re->flags & IS_ANCHORED) ||
+        info->steps_left < 0) {
+      break;
+    }
+  }
+  info->match_start = info->start;
+
+  return result;
+}
+
+/* Non-zero if the way from pc can consume byte *s, see set_one_pass() */
+static int one_pass_takes(int pc, const unsigned char *s,
+                          struct regex_info *info) {
+  const struct slre_insn *insn;
+
+  for (;;) {
+    insn = &info->re->insns[pc];
+    switch (insn->op) {
+      case I_CHAR: case I_ANY: case I_CLASS: return match_byte(insn, s, info);
+      case I_SPLIT:
+        if (one_pass_takes(insn->x, s, info)) return 1;
+        pc = insn->y;
+        break;
+      case I_JMP: pc = insn->x; break;
+      case I_SAVE: pc++; break;
+      default: return 0;
+    }
+  }
+}
+
+/*
+ * Run one-pass program at regex_info::from, see set_one_pass(). A single
+ * thread picks the way by the next byte and stores captures as it goes.
+ * If a picked way fails, the match ends where the last SPLIT_TO_MATCH way
+ * not taken is. Returns -2 if there is no scratch memory to remember it.
+ */
+static int one_pass_search(struct regex_info *info) {
+  const struct slre_insn *insn;
+  int pc = 0, sp = info->from, j, last_pc = -1, last_sp = 0, *last;
+
+  last = (int *) carve(&info->mem, info->num_slots * (int) sizeof(last[0]));
+  if (last == NULL && info->num_slots > 0) return -2;
+  info->start = info->match_start = sp;
+  if (sp >= info->to) return -1;
+  STAT(info, starts, 1);
+
+  for (;;) {
+    insn = &info->re->insns[pc];
+    if (SPEND(info, 1)) return -1;
+
+    switch (insn->op) {
+      case I_CHAR: case I_ANY: case I_CLASS:
+        if (sp < info->s_len && match_byte(insn, info->s + sp, info)) {
+          STAT(info, bytes, 1);
+          pc++;
+          sp++;
+          continue;
+        }
+        break;
+      case I_BOL:
+        if (sp == 0) {
+          pc++;
+          continue;
+        }
+        break;
+      case I_EOL:
+        if (sp == info->s_len) {
+          pc++;
+          continue;
+        }
+        break;
+      case I_JMP:
+        pc = insn->x;
+        continue;
+      case I_SAVE:
+        if (insn->x < info->num_slots) info->slots[insn->x] = sp;
+        pc++;
+        continue;
+      case I_SPLIT:
+        if ((insn->c & SPLIT_SIMPLE_LOOP) && insn->x == pc + 1) {
+          /* What follows a greedy loop can't take its bytes */
+          j = loop_span(insn + 1, sp, info);
+          if (SPEND(info, j)) return -1;
+          sp += j;
+          pc += 3;
+          continue;
+        }
+        STAT(info, branches, 1);
+        if (sp < info->s_len && one_pass_takes(insn->x, info->s + sp, info)) {
+          if ((insn->c & SPLIT_TO_MATCH) && sp > info->start) {
+            last_pc = insn->y;
+            last_sp = sp;
+            for (j = 0; j < info->num_slots; j++) last[j] = info->slots[j];
+          }
+          pc = insn->x;
+        } else {
+          pc = insn->y;
+        }
+        continue;
+      case I_MATCH:
+        if (sp > info->start) return sp;
+        break;
+      default:
+        info->error_msg = static_error_internal;
+        return -1;
+    }
+
+    /* Way fails, take the one to MATCH instead. Nothing else can match */
+    if (last_pc < 0) return -1;
+    STAT(info, backtracks, 1);
+    pc = last_pc;
+    sp = last_sp;
+    last_pc = -1;
+    for (j = 0; j < info->num_slots; j++) info->slots[j] = last[j];
+  }
+}
+
+/* Mark regex as matched by slre_set_exec(). Returns 1 when all are */
+static int set_matched(struct regex_info *info, int i) {
+  if (!(info->matched[i >> 3] & (1 << (i & 7)))) {
+    info->matched[i >> 3] |= (unsigned char) (1 << (i & 7));
+    info->num_matched++;
+  }
+  return info->num_matched == info->num_regexps;
+}
+
+/*
+ * Number states of NFA threads and DFA items. A state is a pc, and
+ * values of the counters of loops that pc is in: states of pc are from
+ * states[pc] on, one for every combination of values. The REPEAT of
+ * counter c is at states[num_insns + 1 + c]. Without loop counters, a
+ * state is a pc. Returns the number of states, or 0 if it is over
+ * SHRT_MAX, and sets *num_threads to states of instructions that wait
+ * for input or $, and MATCH. With NULL states, only counts.
+ */
+static int number_states(const struct slre_compiled *re, int *states,
+                         int *num_threads) {
+  const struct slre_insn *insn;
+  int ends[REPEAT_LAZY], sizes[REPEAT_LAZY];
+  int pc, depth = 0, size = 1, n = 0;
+
+  *num_threads = 0;
+  for (pc = 0; pc < re->num_insns; pc++) {
+    insn = &re->insns[pc];
+    while (depth > 0 && pc >= ends[depth - 1]) size = sizes[--depth];
+    if (insn->op == I_REPEAT) {
+      /* Loop ends past the INC, where its JMP at pc + 1 exits to */
+      if (states != NULL) {
+        states[re->num_insns + 1 + (insn->c & ~REPEAT_LAZY)] = pc;
+      }
+      sizes[depth] = size;
+      ends[depth++] = insn[1].x;
+      size *= insn->y + 1;
+    }
+    if (states != NULL) states[pc] = n;
+    if ((n += size) > SHRT_MAX) return 0;
+    if (insn->op <= I_CLASS || insn->op == I_EOL || insn->op == I_MATCH) {
+      *num_threads += size;
+    }
+  }
+  if (states != NULL) states[pc] = n;
+
+  return n;
+}
+
+/* State of pc with loop counters, see number_states() */
+static int state_id(const struct slre_compiled *re, const int *states,
+                    int pc, const int *counters) {
+  const int *loops;
+  int c, id, radix = 1;
+
+  if (states == NULL) return pc;
+  loops = states + re->num_insns + 1;
+  for (id = states[pc], c = 0; c < re->num_counters; c++) {
+    if (loops[c] <= pc && pc < re->insns[loops[c] + 1].x) {
+      id += counters[c] * radix;
+      radix *= re->insns[loops[c]].y + 1;
+    }
+  }
+
+  return id;
+}
+
+/* Pc of the state, storing values of loop counters in counters */
+static int state_pc(const struct slre_compiled *re, const int *states,
+                    int id, int *counters) {
+  const int *loops;
+  int c, pc = 0, hi = re->num_insns - 1, mid, radix;
+
+  if (states == NULL) return id;
+  loops = states + re->num_insns + 1;
+  while (pc < hi) {
+    mid = (pc + hi + 1) / 2;
+    if (states[mid] > id) {
+      hi = mid - 1;
+    } else {
+      pc = mid;
+    }
+  }
+
+  for (id -= states[pc], c = 0; c < re->num_counters; c++) {
+    counters[c] = 0;
+    if (loops[c] <= pc && pc < re->insns[loops[c] + 1].x) {
+      radix = re->insns[loops[c]].y + 1;
+      counters[c] = id % radix;
+      id /= radix;
+    }
+  }
+
+  return pc;
+}
+
+/*
+ * Take numbering of states, and loop counters, from scratch memory for
+ * a program that has loop counters. Returns 0 if they do not fit.
+ */
+static int init_states(const struct slre_compiled *re, struct scratch *mem,
+                       int **states, int **counters) {
+  int n;
+
+  *states = *counters = NULL;
+  if (re->num_counters == 0) return 1;
+  *states = (int *) carve(mem, (re->num_insns + 1 + re->num_counters) *
+                          (int) sizeof(int));
+  *counters = (int *) carve(mem, re->num_counters * (int) sizeof(int));
+  if (*states == NULL || *counters == NULL) return 0;
+  number_states(re, *states, &n);
+  memset(*counters, 0, re->num_counters * sizeof(int));
+
+  return 1;
+}
+
+/* Scratch memory taken by init_states() */
+static int states_size(const struct slre_compiled *re) {
+  return re->num_counters == 0 ? 0 :
+    SCRATCH_ALIGN((re->num_insns + 1 + re->num_counters) * (int) sizeof(int))
+    + SCRATCH_ALIGN(re->num_counters * (int) sizeof(int));
+}
+
+/*
+ * Follow empty transitions from pc at offset sp, appending threads that
+ * wait for input (or match) to the list. Loop registers are not needed
+ * here, because a state that is already in the list is never added
+ * again. Loop counters are in nfa::counters, restored on return.
+ */
+static void nfa_add(struct slre_nfa *nfa, struct slre_nfa_list *l, int pc,
+                    int sp, int *slots, struct regex_info *info) {
+  const struct slre_insn *insn;
+  int saved, id, *counter;
+
+  /* Last way out of an instruction is followed in the loop */
+  for (;;) {
+    id = state_id(info->re, nfa->states, pc, nfa->counters);
+    if (l->mark[id] == nfa->generation) return;
+    l->mark[id] = nfa->generation;
+    insn = &info->re->insns[pc];
+
+    switch (insn->op) {
+      case I_JMP:
+        pc = insn->x;
+        break;
+      case I_SPLIT:
+        nfa_add(nfa, l, insn->x, sp, slots, info);
+        pc = insn->y;
+        break;
+      case I_SAVE:
+        /* Slots of captures that are not asked for are not kept */
+        if (insn->x + 1 < nfa->stride) {
+          saved = slots[insn->x + 1];
+          slots[insn->x + 1] = sp;
+          nfa_add(nfa, l, pc + 1, sp, slots, info);
+          slots[insn->x + 1] = saved;
+          return;
+        }
+        pc++;
+        break;
+      case I_MARK: case I_CHECK:
+        pc++;
+        break;
+      case I_BOL:
+        if (sp != 0) return;
+        pc++;
+        break;
+      case I_EOL:
+        if (sp != info->s_len) return;
+        pc++;
+        break;
+      case I_REPEAT:
+        counter = &nfa->counters[insn->c & ~REPEAT_LAZY];
+        saved = *counter;
+        if (saved < insn->x) {
+          pc += 2;
+          break;
+        }
+        if (saved < insn->y && !(insn->c & REPEAT_LAZY)) {
+          nfa_add(nfa, l, pc + 2, sp, slots, info);
+        }
+        *counter = 0;
+        nfa_add(nfa, l, pc + 1, sp, slots, info);
+        *counter = saved;
+        if (saved >= insn->y || !(insn->c & REPEAT_LAZY)) return;
+        pc += 2;
+        break;
+      case I_INC:
+        nfa->counters[insn->c]++;
+        nfa_add(nfa, l, insn->x, sp, slots, info);
+        nfa->counters[insn->c]--;
+        return;
+      default:
+        l->pc[l->num_threads] = (short) id;
+        if (nfa->stride == 1) {
+          l->slots[l->num_threads] = slots[0];
+        } else {
+          memcpy(l->slots + l->num_threads * nfa->stride, slots,
+                 nfa->stride * sizeof(slots[0]));
+        }
+        l->num_threads++;
+        return;
+    }
+  }
+}
+
+/* Scratch memory taken by nfa_init(), 0 if there are too many states */
+static int nfa_size(const struct slre_compiled *re, int stride) {
+  int n, num_states = number_states(re, NULL, &n);
+
+  if (num_states == 0) return 0;
+  return 2 * (SCRATCH_ALIGN(n * (int) sizeof(short)) +
+              SCRATCH_ALIGN(n * stride * (int) sizeof(int)) +
+              SCRATCH_ALIGN(num_states * (int) sizeof(int))) +
+    SCRATCH_ALIGN(stride * (int) sizeof(int)) + states_size(re);
+}
+
+/*
+ * Prepare NFA to run with num_caps captures, taking its arrays from
+ * scratch memory. Returns 0 if they do not fit.
+ */
+static int nfa_init(struct slre_nfa *nfa, int num_caps, struct scratch *mem,
+                    struct regex_info *info) {
+  struct slre_nfa_list *l;
+  int i, n, num_states = number_states(info->re, NULL, &n);
+
+  nfa->stride = 1 + 2 * (num_caps < info->re->num_brackets ?
+                         num_caps : info->re->num_brackets);
+
+  /* States that do not fit in short are not kept in scratch either */
+  FAIL_IF(num_states == 0 ||
+          !init_states(info->re, mem, &nfa->states, &nfa->counters),
+          static_error_scratch);
+  for (i = 0; i < 2; i++) {
+    l = &nfa->lists[i];
+    l->pc = (short *) carve(mem, n * (int) sizeof(short));
+    l->slots = (int *) carve(mem, n * nfa->stride * (int) sizeof(int));
+    l->mark = (int *) carve(mem, num_states * (int) sizeof(int));
+    FAIL_IF(l->pc == NULL || l->slots == NULL || l->mark == NULL,
+            static_error_scratch);
+    memset(l->mark, 0, num_states * sizeof(l->mark[0]));
+  }
+  nfa->match = (int *) carve(mem, nfa->stride * (int) sizeof(nfa->match[0]));
+  FAIL_IF(nfa->match == NULL, static_error_scratch);
+
+  nfa->lists[0].num_threads = 0;
+  nfa->cur = 0;
+  nfa->generation = 1;
+  nfa->result = -1;
+
+  return 1;
+}
+
+/*
+ * Run threads over the byte s at offset sp, or over the end of buffer if
+ * s is NULL, starting a new thread first. Returns non-zero when no thread
+ * is left, so that the result is known.
+ */
+static int nfa_step(struct slre_nfa *nfa, int sp, const unsigned char *s,
+                    struct regex_info *info) {
+  struct slre_nfa_list *clist = &nfa->lists[nfa->cur];
+  struct slre_nfa_list *nlist = &nfa->lists[!nfa->cur];
+  const struct slre_insn *insn;
+  int i, j, pc, *t;
+
+  /*
+   * Start new thread at this offset, unless match is already found.
+   * Until then, the match array is free to hold the thread's slots.
+   */
+  if (nfa->result < 0 && s != NULL && sp < info->to &&
+      (sp == 0 || !(info->re->flags & IS_ANCHORED))) {
+    nfa->match[0] = sp;
+    for (j = 1; j < nfa->stride; j++) nfa->match[j] = -1;
+    if (nfa->counters != NULL) {
+      memset(nfa->counters, 0, info->re->num_counters * sizeof(int));
+    }
+    nfa_add(nfa, clist, 0, sp, nfa->match, info);
+    STAT(info, starts, 1);
+  }
+  if (clist->num_threads == 0 || SPEND(info, clist->num_threads)) return 1;
+  STAT(info, threads, clist->num_threads);
+  STAT(info, bytes, s != NULL);
+
+  nfa->generation++;
+  nlist->num_threads = 0;
+
+  for (i = 0; i < clist->num_threads; i++) {
+    pc = state_pc(info->re, nfa->states, clist->pc[i], nfa->counters);
+    insn = &info->re->insns[pc];
+    t = clist->slots + i * nfa->stride;
+
+    if (insn->op == I_MATCH) {
+      /* Empty match is not reported, try other alternatives */
+      if (t[0] == sp) continue;
+      /* Regex set: all threads run to the end, unless all have matched */
+      if (info->matched != NULL) {
+        if (set_matched(info, insn->x)) return 1;
+        continue;
+      }
+      nfa->result = sp;
+      memcpy(nfa->match, t, nfa->stride * sizeof(t[0]));
+      /* Threads that follow are less preferred, drop them */
+      break;
+    } else if (s != NULL && match_byte(insn, s, info)) {
+      nfa_add(nfa, nlist, pc + 1, sp + 1, t, info);
+    }
+  }
+  nfa->cur = !nfa->cur;
+
+  return 0;
+}
+
+/*
+ * Pike VM: run all threads in lockstep over the buffer, so that time is
+ * proportional to program size times buffer length. Thread order gives
+ * the same match as backtracking would.
+ */
+static int nfa_search(struct regex_info *info) {
+  struct slre_nfa nfa;
+  struct scratch mem = info->mem;
+  int j, sp;
+
+  if (!nfa_init(&nfa, info->caps == NULL ? 0 : info->num_caps, &mem, info)) {
+    return 0;
+  }
+
+  for (sp = info->from; sp <= info->s_len; sp++) {
+    /* When no threads are left, jump to where the next match can start */
+    if (nfa.result < 0 && nfa.lists[nfa.cur].num_threads == 0 &&
+        (sp >= info->to || ((info->re->flags & CAN_SKIP) &&
+                            (sp = skip_to_start(info, sp)) >= info->to))) {
+      break;
+    }
+    if (nfa_step(&nfa, sp, sp < info->s_len ? info->s + sp : NULL, info)) {
+      break;
+    }
+  }
+
+  if (info->steps_left < 0) return -1;
+  if (nfa.result > 0) {
+    info->match_start = nfa.match[0];
+    for (j = 1; j < nfa.stride; j++) info->slots[j - 1] = nfa.match[j];
+  }
+
+  return nfa.result;
+}
+
+/*
+ * Threads of reversed program, see gen_reversed(). Only pcs are kept:
+ * which of the threads gets to MATCH, and how, does not matter.
+ */
+struct rev_list {
+  int num_threads;
+  short *pc;
+  int *mark;  /* Generation when pc was added, indexed from reversed start */
+};
+
+/* Scratch memory taken by rev_search() */
+static int rev_size(const struct slre_compiled *re) {
+  return 2 * (SCRATCH_ALIGN(re->num_rev_insns * (int) sizeof(short)) +
+              SCRATCH_ALIGN(re->num_rev_insns * (int) sizeof(int)));
+}
+
+static void rev_add(struct rev_list *l, int generation, int pc, int sp,
+                    const struct regex_info *info) {
+  const struct slre_insn *insn = &info->re->insns[pc];
+
+  if (l->mark[pc - info->re->num_insns] == generation) return;
+  l->mark[pc - info->re->num_insns] = generation;
+
+  switch (insn->op) {
+    case I_JMP: rev_add(l, generation, insn->x, sp, info); break;
+    case I_SPLIT:
+      rev_add(l, generation, insn->x, sp, info);
+      rev_add(l, generation, insn->y, sp, info);
+      break;
+    case I_BOL: if (sp == 0) rev_add(l, generation, pc + 1, sp, info); break;
+    case I_EOL:
+      if (sp == info->s_len) rev_add(l, generation, pc + 1, sp, info);
+      break;
+    case I_SAVE: case I_MARK: case I_CHECK:
+      rev_add(l, generation, pc + 1, sp, info);
+      break;
+    default: l->pc[l->num_threads++] = (short) pc; break;
+  }
+}
+
+/*
+ * Run reversed program from the end of the buffer back to regex_info::from,
+ * for a regex that always matches up to the end. Returns the leftmost
+ * offset below regex_info::to where a match starts, -1 if there is none,
+ * or -2 if there is no memory for the threads.
+ */
+static int rev_search(struct regex_info *info) {
+  struct rev_list lists[2], *l;
+  struct scratch mem = info->mem;
+  const struct slre_insn *insn;
+  int i, sp, cur = 0, start = -1, n = info->re->num_rev_insns;
+
+  for (i = 0; i < 2; i++) {
+    lists[i].pc = (short *) carve(&mem, n * (int) sizeof(short));
+    lists[i].mark = (int *) carve(&mem, n * (int) sizeof(int));
+    if (lists[i].pc == NULL || lists[i].mark == NULL) return -2;
+    memset(lists[i].mark, 0, n * sizeof(lists[i].mark[0]));
+    lists[i].num_threads = 0;
+  }
+
+  rev_add(&lists[0], 1, info->re->num_insns, info->s_len, info);
+  for (sp = info->s_len; lists[cur].num_threads > 0; sp--) {
+    l = &lists[cur];
+    if (SPEND(info, l->num_threads)) return -1;
+    STAT(info, threads, l->num_threads);
+    for (i = 0; i < l->num_threads; i++) {
+      if (info->re->insns[l->pc[i]].op == I_MATCH && sp < info->to &&
+          sp < info->s_len) {
+        start = sp;
+      }
+    }
+    if (sp <= info->from) break;
+
+    /* Step back over the byte before sp */
+    STAT(info, bytes, 1);
+    lists[!cur].num_threads = 0;
+    for (i = 0; i < l->num_threads; i++) {
+      insn = &info->re->insns[l->pc[i]];
+      if (insn->op != I_MATCH && match_byte(insn, info->s + sp - 1, info)) {
+        rev_add(&lists[!cur], info->s_len - sp + 2, l->pc[i] + 1, sp - 1,
+                info);
+      }
+    }
+    cur = !cur;
+  }
+
+  return start;
+}
+
+/*
+ * DFA state: list of instructions, in order of preference, that wait for
+ * input at some offset. Items from seed_start on belong to the match
+ * attempt that starts at this very offset, so reaching MATCH from them
+ * gives an empty match. Special item SEED (equal to the number of states
+ * of the program, see number_states()) starts a new attempt at the next
+ * offset.
+ */
+struct dfa_state {
+  int items;          /* Offset of the first item in dfa::items */
+  int num_items;
+  int seed_start;
+  int is_match;       /* Non-empty match ends at this offset */
+  unsigned hash;
+};
+
+/*
+ * Lazily built DFA. Transitions are computed when first needed. Arrays
+ * are in scratch memory, see dfa_size().
+ */
+struct dfa {
+  struct dfa_state *states;
+  int num_states, max_states, num_classes;
+  short *items;                     /* SLRE_DFA_ITEMS of them */
+  int num_items;
+  short *trans;                     /* Next state per state and byte class */
+  int *mark;
+  int generation;
+  short *work;                      /* Items of the state being built */
+  int num_work;
+  int seed;                         /* SEED item */
+  int *ids, *counters;              /* Same as slre_nfa::states and counters */
+  long scanned;                     /* Bytes of earlier buffers of a batch */
+  long last_flush;                  /* Offset of the last cache flush */
+};
+
+enum { DFA_UNKNOWN = -1, DFA_DEAD = -2, DFA_GIVE_UP = -3 };
+enum { DFA_AT_BOL = 1, DFA_AT_EOL = 2, DFA_SEED = 4 };
+
+/*
+ * Follow empty transitions from pc, appending items to dfa::work.
+ * Returns non-zero when a non-empty match is reached: less preferred items
+ * must be dropped then, as in nfa_search(). Regex set keeps them all.
+ */
+static int dfa_add(struct dfa *dfa, int pc, int flags,
+                   struct regex_info *info) {
+  const struct slre_insn *insn = &info->re->insns[pc];
+  int id = state_id(info->re, dfa->ids, pc, dfa->counters), *counter;
+  int saved, result;
+
+  if (dfa->mark[id] == dfa->generation) return 0;
+  dfa->mark[id] = dfa->generation;
+
+  switch (insn->op) {
+    case I_JMP:
+      return dfa_add(dfa, insn->x, flags, info);
+    case I_SPLIT:
+      return dfa_add(dfa, insn->x, flags, info) ||
+        dfa_add(dfa, insn->y, flags, info);
+    case I_SAVE: case I_MARK: case I_CHECK:
+      return dfa_add(dfa, pc + 1, flags, info);
+    case I_BOL:
+      return flags & DFA_AT_BOL ? dfa_add(dfa, pc + 1, flags, info) : 0;
+    case I_EOL:
+      if (flags & DFA_AT_EOL) return dfa_add(dfa, pc + 1, flags, info);
+      break;
+    case I_REPEAT:
+      /* Same ways as nfa_add() takes */
+      counter = &dfa->counters[insn->c & ~REPEAT_LAZY];
+      saved = *counter;
+      if (saved < insn->x) return dfa_add(dfa, pc + 2, flags, info);
+      if (saved < insn->y && !(insn->c & REPEAT_LAZY) &&
+          dfa_add(dfa, pc + 2, flags, info)) return 1;
+      *counter = 0;
+      result = dfa_add(dfa, pc + 1, flags, info);
+      *counter = saved;
+      return result || (saved < insn->y && (insn->c & REPEAT_LAZY) &&
+                        dfa_add(dfa, pc + 2, flags, info));
+    case I_INC:
+      dfa->counters[insn->c]++;
+      result = dfa_add(dfa, insn->x, flags, info);
+      dfa->counters[insn->c]--;
+      return result;
+    case I_MATCH:
+      if (flags & DFA_SEED) return 0;
+      dfa->work[dfa->num_work++] = (short) id;
+      return info->matched == NULL;
+    default:
+      break;
+  }
+  dfa->work[dfa->num_work++] = (short) id;
+
+  return 0;
+}
+
+/* Instruction of item, storing values of its loop counters */
+static const struct slre_insn *dfa_insn(struct dfa *dfa, int item,
+                                        const struct regex_info *info) {
+  return &info->re->insns[state_pc(info->re, dfa->ids, item,
+                                   dfa->counters)];
+}
+
+static void dfa_flush(struct dfa *dfa) {
+  int i;
+
+  dfa->num_states = dfa->num_items = 0;
+  for (i = 0; i < dfa->max_states * dfa->num_classes; i++) {
+    dfa->trans[i] = DFA_UNKNOWN;
+  }
+}
+
+/* Find or create state from dfa::work. Sets *flushed if cache was reset */
+static int dfa_state(struct dfa *dfa, int seed_start, int sp, int *flushed,
+                     struct regex_info *info) {
+  struct dfa_state *st;
+  unsigned hash = (unsigned) seed_start;
+  int i, is_match = 0;
+
+  if (dfa->num_work == 0) return DFA_DEAD;
+
+  for (i = 0; i < dfa->num_work; i++) {
+    hash = hash * 31 + (unsigned) dfa->work[i];
+    if (dfa->work[i] != dfa->seed &&
+        dfa_insn(dfa, dfa->work[i], info)->op == I_MATCH) {
+      is_match = 1;
+    }
+  }
+
+  for (i = 0; i < dfa->num_states; i++) {
+    st = &dfa->states[i];
+    if (st->hash == hash && st->num_items == dfa->num_work &&
+        st->seed_start == seed_start &&
+        memcmp(dfa->items + st->items, dfa->work,
+               dfa->num_work * sizeof(dfa->work[0])) == 0) {
+      return i;
+    }
+  }
+
+  if (dfa->num_states >= dfa->max_states ||
+      dfa->num_items + dfa->num_work > SLRE_DFA_ITEMS) {
+    /* Cache is full. Give up if it gets full too often */
+    if (dfa->scanned + sp - dfa->last_flush < 10 * dfa->max_states) {
+      return DFA_GIVE_UP;
+    }
+    dfa_flush(dfa);
+    dfa->last_flush = dfa->scanned + sp;
+    *flushed = 1;
+  }
+
+  st = &dfa->states[dfa->num_states];
+  st->items = dfa->num_items;
+  st->num_items = dfa->num_work;
+  st->seed_start = seed_start;
+  st->is_match = is_match;
+  st->hash = hash;
+  memcpy(dfa->items + dfa->num_items, dfa->work,
+         dfa->num_work * sizeof(dfa->work[0]));
+  dfa->num_items += dfa->num_work;
+  STAT(info, dfa_states, 1);
+
+  return dfa->num_states++;
+}
+
+/* Compute transition from state on byte at offset sp - 1 */
+static int dfa_step(struct dfa *dfa, int state, int sp,
+                    struct regex_info *info) {
+  const struct dfa_state *st = &dfa->states[state];
+  const short *items = dfa->items + st->items;
+  const unsigned char *s = info->s + sp - 1;
+  const struct slre_insn *insn;
+  int i, next, seed_start = -1, flushed = 0, seed = dfa->seed;
+
+  dfa->generation++;
+  dfa->num_work = 0;
+
+  for (i = 0; i < st->num_items; i++) {
+    if (items[i] == seed) {
+      seed_start = dfa->num_work;
+      if (dfa->counters != NULL) {
+        memset(dfa->counters, 0, info->re->num_counters * sizeof(int));
+      }
+      dfa_add(dfa, 0, DFA_SEED, info);
+      dfa->mark[seed] = dfa->generation;
+      dfa->work[dfa->num_work++] = (short) seed;
+      break;
+    }
+    insn = dfa_insn(dfa, items[i], info);
+    if (match_byte(insn, s, info) &&
+        dfa_add(dfa, (int) (insn - info->re->insns) + 1, 0, info)) {
+      break;
+    }
+  }
+
+  next = dfa_state(dfa, seed_start < 0 ? dfa->num_work : seed_start, sp,
+                   &flushed, info);
+  if (!flushed && next != DFA_GIVE_UP) {
+    dfa->trans[state * dfa->num_classes + info->re->byte_classes[*s]] =
+      (short) next;
+  }
+
+  return next;
+}
+
+/* Mark regexes whose MATCH is in the list. Returns 1 if all have matched */
+static int dfa_set_matched(struct dfa *dfa, const short *items, int n,
+                           struct regex_info *info) {
+  const struct slre_insn *insn;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (items[i] == dfa->seed) continue;
+    insn = dfa_insn(dfa, items[i], info);
+    if (insn->op == I_MATCH && set_matched(info, insn->x)) return 1;
+  }
+
+  return 0;
+}
+
+/* Returns non-zero if state matches at the end of the buffer */
+static int dfa_matches_at_end(struct dfa *dfa, int state,
+                              struct regex_info *info) {
+  const struct dfa_state *st = &dfa->states[state];
+  const short *items = dfa->items + st->items;
+  const struct slre_insn *insn;
+  int i;
+
+  dfa->generation++;
+  dfa->num_work = 0;
+
+  for (i = 0; i < st->seed_start; i++) {
+    insn = dfa_insn(dfa, items[i], info);
+    if ((insn->op == I_MATCH && info->matched == NULL) ||
+        (insn->op == I_EOL &&
+         dfa_add(dfa, (int) (insn - info->re->insns) + 1, DFA_AT_EOL, info))) {
+      return 1;
+    }
+  }
+
+  /* Regex set: dfa_add() collected items of all matches that need $ */
+  if (info->matched != NULL) {
+    dfa_set_matched(dfa, dfa->work, dfa->num_work, info);
+  }
+
+  return 0;
+}
+
+/*
+ * Same state without the attempt that starts at its offset, sp. Used
+ * when matches may not start at sp or later.
+ */
+static int dfa_drop_seed(struct dfa *dfa, int state, int sp,
+                         struct regex_info *info) {
+  const struct dfa_state *st = &dfa->states[state];
+  int flushed = 0;
+
+  dfa->num_work = st->seed_start;
+  memcpy(dfa->work, dfa->items + st->items,
+         st->seed_start * sizeof(dfa->work[0]));
+
+  return dfa_state(dfa, st->seed_start, sp, &flushed, info);
+}
+
+/* Returns the number of DFA states that fit in the transition table */
+static int dfa_max_states(const struct slre_compiled *re) {
+  int n = SLRE_DFA_TRANS / re->num_byte_classes;
+  return n > SLRE_DFA_STATES ? SLRE_DFA_STATES : n;
+}
+
+/* Scratch memory taken by dfa_search(), 0 if there are too many states */
+static int dfa_size(const struct slre_compiled *re) {
+  int n = dfa_max_states(re), threads, items;
+
+  items = number_states(re, NULL, &threads);
+
+  if (items == 0) return 0;
+  return SCRATCH_ALIGN(n * (int) sizeof(struct dfa_state)) +
+    SCRATCH_ALIGN(SLRE_DFA_ITEMS * (int) sizeof(short)) +
+    SCRATCH_ALIGN(n * re->num_byte_classes * (int) sizeof(short)) +
+    SCRATCH_ALIGN((items + 1) * (int) sizeof(int)) +
+    SCRATCH_ALIGN((items + 1) * (int) sizeof(short)) + states_size(re);
+}
+
+/*
+ * Set up an empty DFA cache in scratch memory. Returns 0 if it does not
+ * fit, or if the regex has too many byte classes for the cache.
+ */
+static int dfa_init(struct dfa *dfa, struct scratch *mem,
+                    const struct slre_compiled *re) {
+  int n, threads;
+
+  dfa->seed = number_states(re, NULL, &threads);
+  dfa->num_classes = re->num_byte_classes;
+  dfa->max_states = dfa_max_states(re);
+  if (dfa->max_states < 2 || dfa->seed == 0 ||
+      !init_states(re, mem, &dfa->ids, &dfa->counters)) return 0;
+  n = dfa->seed + 1;
+
+  dfa->states = (struct dfa_state *)
+    carve(mem, dfa->max_states * (int) sizeof(dfa->states[0]));
+  dfa->items = (short *) carve(mem, SLRE_DFA_ITEMS * (int) sizeof(short));
+  dfa->trans = (short *)
+    carve(mem, dfa->max_states * dfa->num_classes * (int) sizeof(short));
+  dfa->mark = (int *) carve(mem, n * (int) sizeof(dfa->mark[0]));
+  dfa->work = (short *) carve(mem, n * (int) sizeof(dfa->work[0]));
+  if (dfa->states == NULL || dfa->items == NULL || dfa->trans == NULL ||
+      dfa->mark == NULL || dfa->work == NULL) {
+    return 0;
+  }
+
+  memset(dfa->mark, 0, n * sizeof(dfa->mark[0]));
+  dfa->generation = 1;
+  dfa->num_work = 0;
+  dfa->scanned = dfa->last_flush = 0;
+  dfa_flush(dfa);
+
+  return 1;
+}
+
+/*
+ * Find the end of leftmost match, without captures. Gives the same result
+ * as nfa_search(), but visits every set of threads only once. States
+ * do not depend on the buffer, so the cache can be used for many buffers.
+ */
+static int dfa_run(struct dfa *dfa, struct regex_info *info) {
+  int sp, state, next, flushed = 0, result = -1;
+
+  sp = info->re->flags & CAN_SKIP ? skip_to_start(info, info->from) :
+    info->from;
+  if (sp >= info->to) return -1;
+
+  dfa->generation++;
+  dfa->num_work = 0;
+  if (dfa->counters != NULL) {
+    memset(dfa->counters, 0, info->re->num_counters * sizeof(int));
+  }
+  dfa_add(dfa, 0, sp == 0 ? DFA_AT_BOL | DFA_SEED : DFA_SEED, info);
+  if (!(info->re->flags & IS_ANCHORED)) {
+    dfa->work[dfa->num_work++] = (short) dfa->seed;
+  }
+  state = dfa_state(dfa, 0, sp, &flushed, info);
+
+  for (; sp < info->s_len && state >= 0; sp++) {
+    if (SPEND(info, 1)) return -1;
+    STAT(info, bytes, 1);
+    if (sp == info->to) {
+      state = dfa_drop_seed(dfa, state, sp, info);
+      if (state < 0) break;
+    }
+
+    /* Only a new attempt is in progress: jump to where it can start */
+    if (result < 0 && (info->re->flags & CAN_SKIP) &&
+        dfa->states[state].seed_start == 0 &&
+        (sp = skip_to_start(info, sp)) >= info->to) {
+      break;
+    }
+
+    next = dfa->trans[state * dfa->num_classes +
+                      info->re->byte_classes[info->s[sp]]];
+    if (next == DFA_UNKNOWN) next = dfa_step(dfa, state, sp + 1, info);
+    state = next;
+    if (state >= 0 && dfa->states[state].is_match) {
+      if (info->matched == NULL) {
+        result = sp + 1;
+      } else if (dfa_set_matched(dfa, dfa->items + dfa->states[state].items,
+                                 dfa->states[state].seed_start, info)) {
+        return 0;
+      }
+    }
+  }
+  if (state == DFA_GIVE_UP) return DFA_GIVE_UP;
+
+  if (state >= 0 && sp == info->s_len &&
+      dfa_matches_at_end(dfa, state, info)) {
+    result = info->s_len;
+  }
+
+  return result;
+}
+
+static int dfa_search(struct regex_info *info) {
+  struct dfa dfa;
+  struct scratch mem = info->mem;
+
+  /* Without memory for the cache, NFA engine does the search */
+  return dfa_init(&dfa, &mem, info->re) ? dfa_run(&dfa, info) : DFA_GIVE_UP;
+}
+
+/*
+ * Returns non-zero if DFA finds the same matches as the engine of re.
+ * Backtracking differs from NFA only for loops over empty matches.
+ */
+static int is_dfa_exact(const struct slre_compiled *re) {
+  return (re->flags & SLRE_NFA) || re->num_regs == 0;
+}
+
+/*
+ * Returns non-zero if the buffer has literal lit at offset from or later.
+ * With fold set, lit is in lower case and matches in any case.
+ */
+static int has_literal(const unsigned char *s, int s_len, int from,
+                       const unsigned char *lit, int lit_len, int fold) {
+  const unsigned char *p, *end = s + s_len - lit_len + 1;
+
+  for (s += from; s < end; s = p + 1) {
+    p = find_byte(s, (int) (end - s), lit[0], fold);
+    if (p == NULL) return 0;
+    if (same_bytes(p + 1, lit + 1, lit_len - 1, fold)) return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Narrow down offsets where a match can start, using match lengths and
+ * the required literal of the regex. Returns 0 if there can be no match.
+ */
+static int narrow_starts(struct regex_info *info) {
+  const struct slre_compiled *re = info->re;
+  int last = info->s_len - re->min_len + 1;
+
+  if (info->to > last) info->to = last;
+  if ((re->flags & ENDS_AT_EOL) && re->max_len >= 0 &&
+      info->from < info->s_len - re->max_len) {
+    info->from = info->s_len - re->max_len;
+  }
+  if (info->from >= info->to) return 0;
+
+  if (re->must_len == 0) return 1;
+  if (re->flags & MUST_AT_END) {
+    return same_bytes(info->s + info->s_len - re->must_len, re->must,
+                      re->must_len, re->flags & SLRE_IGNORE_CASE);
+  }
+  return has_literal(info->s, info->s_len, info->from, re->must,
+                     re->must_len, re->flags & SLRE_IGNORE_CASE);
+}
+
+static int foo(const char *s, int s_len, struct regex_info *info) {
+  const struct slre_compiled *re = info->re;
+  int j, result, engine;
+
+  FAIL_IF(info->num_caps > 0 && re->num_brackets > info->num_caps,
+          static_error_more_caps);
+
+  info->s = (const unsigned char *) s;
+  info->s_len = s_len;
+  if (info->to > s_len) info->to = s_len;
+  info->slots = (int *)
+    carve(&info->mem, 2 * re->num_brackets * (int) sizeof(info->slots[0]));
+  info->regs = (int *)
+    carve(&info->mem, re->num_regs * (int) sizeof(info->regs[0]));
+  info->counters = (int *)
+    carve(&info->mem, re->num_counters * (int) sizeof(info->counters[0]));
+  FAIL_IF(info->slots == NULL || info->regs == NULL ||
+          info->counters == NULL, static_error_scratch);
+  for (j = 0; j < 2 * re->num_brackets; j++) {
+    info->slots[j] = -1;
+  }
+  memset(info->counters, 0, re->num_counters * sizeof(info->counters[0]));
+  info->num_slots = info->caps == NULL || info->num_caps <= 0 ? 0 :
+    2 * re->num_brackets;
+  FAIL_IF(!narrow_starts(info), static_error_no_match);
+
+  /*
+   * Scan the string from left to right, applying the regex. Stop on match.
+   * If captures are not needed, use DFA when it gives the same result.
+   * DFA does not know where the match starts. One-pass program gives the
+   * same result as backtracking, in a single scan.
+   */
+  if ((info->caps == NULL || info->num_caps <= 0) && !info->need_start &&
+      is_dfa_exact(re)) {
+    engine = SLRE_ENGINE_DFA;
+    result = dfa_search(info);
+    if (result == DFA_GIVE_UP) {
+      engine = SLRE_ENGINE_NFA;
+      result = nfa_search(info);
+    }
+  } else if ((re->flags & IS_ONE_PASS) &&
+             (result = one_pass_search(info)) != -2) {
+    engine = SLRE_ENGINE_ONE_PASS;
+  } else {
+    engine = re->flags & SLRE_NFA ? SLRE_ENGINE_NFA : SLRE_ENGINE_BACKTRACK;
+
+    /*
+     * Match that ends at the end of the buffer: find its start scanning
+     * backwards, then match forward from there for captures. Backtracking
+     * may still reject it for loops over empty matches, then goes on.
+     */
+    j = re->num_rev_insns > 0 ? rev_search(info) : -2;
+    if (j >= 0) {
+      info->from = j;
+      if (engine == SLRE_ENGINE_NFA) info->to = j + 1;
+    }
+    result = j == -1 ? -1 : engine == SLRE_ENGINE_NFA ? nfa_search(info) :
+      backtrack_search(info);
+  }
+
+  /* Backtracking needs no scratch for threads, so gives the match instead */
+  if (engine == SLRE_ENGINE_NFA && result == 0 &&
+      info->error_msg == static_error_scratch) {
+    info->error_msg = "";
+    engine = SLRE_ENGINE_BACKTRACK;
+    result = backtrack_search(info);
+  }
+  if (info->stats != NULL) info->stats->engine = engine;
+
+  FAIL_IF(result <= 0, info->error_msg[0] == '\0' ?
+          static_error_no_match : info->error_msg);
+  info->error_msg = "";
+
+  if (info->caps != NULL) {
+    for (j = 0; j < re->num_brackets && j < info->num_caps; j++) {
+      if (info->slots[2 * j] < 0 || info->slots[2 * j + 1] < 0) {
+        info->caps[j].ptr = NULL;
+        info->caps[j].len = 0;
+      } else {
+        info->caps[j].ptr = s + info->slots[2 * j];
+        info->caps[j].len = info->slots[2 * j + 1] - info->slots[2 * j];
+      }
+    }
+  }
+
+  return result;
+}
+
+/* Set up info to match re with scratch memory of mem_len bytes */
+static void init_info(struct regex_info *info, const struct slre_compiled *re,
+                      void *mem, int mem_len) {
+  int pad = (int) ((size_t) mem % sizeof(long));
+
+  /* Arrays in scratch memory are aligned for any integer type */
+  pad = pad == 0 ? 0 : (int) sizeof(long) - pad;
+  info->mem.p = (char *) mem + pad;
+  info->mem.len = mem_len - pad;
+
+  info->re = re;
+  info->flags = re->flags;
+  info->error_msg = "";
+  info->caps = NULL;
+  info->num_caps = info->num_slots = 0;
+  info->matched = NULL;
+  info->from = info->need_start = 0;
+  info->to = INT_MAX;
+  info->limits = NULL;
+  info->stats = NULL;
+  info->steps_left = LONG_MAX;
+  info->steps_done = info->depth = 0;
+  info->max_depth = INT_MAX;
+}
+
+int slre_compile(const char *regexp, int flags, struct slre_compiled *re,
+                 const char **error_msg) {
+  struct compile_info info;
+  int result;
+
+  info.error_msg = "";
+  re->flags = flags & (SLRE_IGNORE_CASE | SLRE_NFA | SLRE_ANCHORED |
+                       SLRE_FULL_MATCH | SLRE_UTF8);
+
+  /* Handle regexp flags. At the moment, only 'i' is supported */
+  if (strncmp(regexp, "(?i)", 4) == 0) {
+    re->flags |= SLRE_IGNORE_CASE;
+    regexp += 4;
+  }
+
+  result = compile(regexp, strlen(regexp), re, &info) ? 1 : 0;
+
+  if (error_msg != NULL) {
+    *error_msg = info.error_msg;
+  }
+
+  return result;
+}
+
+int slre_scratch_size(const struct slre_compiled *re) {
+  int nfa = nfa_size(re, 1 + 2 * re->num_brackets), dfa = dfa_size(re);
+  int rev = rev_size(re);
+
+  /* Same arrays as foo() takes, then the larger of the engines */
+  if (dfa > nfa) nfa = dfa;
+  return (int) sizeof(long) - 1 +
+    SCRATCH_ALIGN(2 * re->num_brackets * (int) sizeof(int)) +
+    SCRATCH_ALIGN(re->num_regs * (int) sizeof(int)) +
+    SCRATCH_ALIGN(re->num_counters * (int) sizeof(int)) +
+    (rev > nfa ? rev : nfa);
+}
+
+int slre_exec_scratch(const struct slre_compiled *re, const char *s,
+                      int s_len, struct slre_cap *caps, int num_caps,
+                      void *scratch, int scratch_size,
+                      const char **error_msg) {
+  struct regex_info info;
+  int result;
+
+  /* Initialize info structure */
+  init_info(&info, re, scratch, scratch_size);
+  info.num_caps = num_caps;
+  info.caps = caps;
+
+  DBG(("========================> [%.*s]\n", s_len, s));
+
+  result = foo(s, s_len, &info);
+
+  if (error_msg != NULL) {
+    *error_msg = info.error_msg;
+  }
+
+  return result;
+}
+
+int slre_exec(const struct slre_compiled *re, const char *s, int s_len,
+              struct slre_cap *caps, int num_caps, const char **error_msg) {
+  long scratch[SLRE_SCRATCH_SIZE / sizeof(long)];
+
+  return slre_exec_scratch(re, s, s_len, caps, num_caps, scratch,
+                           (int) sizeof(scratch), error_msg);
+}
+
+int slre_exec_batch(const struct slre_compiled *re,
+                    const struct slre_cap *bufs, int num_bufs, int *results,
+                    struct slre_cap *caps, int num_caps,
+                    void *scratch, int scratch_size,
+                    const char **error_msg) {
+  struct regex_info info;
+  struct scratch mem;
+  struct dfa dfa;
+  long stack[SLRE_SCRATCH_SIZE / sizeof(long)];
+  int i, use_dfa, num_matched = 0;
+
+  if (scratch == NULL) {
+    scratch = stack;
+    scratch_size = (int) sizeof(stack);
+  }
+  init_info(&info, re, scratch, scratch_size);
+  mem = info.mem;
+
+  /* Without captures, all buffers share one DFA cache */
+  use_dfa = (caps == NULL || num_caps <= 0) && is_dfa_exact(re) &&
+    dfa_init(&dfa, &mem, re);
+  mem = info.mem;
+
+  for (i = 0; i < num_bufs; i++) {
+    info.s = (const unsigned char *) bufs[i].ptr;
+    info.s_len = info.to = bufs[i].len;
+    info.from = 0;
+    results[i] = DFA_GIVE_UP;
+    if (use_dfa) {
+      results[i] = narrow_starts(&info) ? dfa_run(&dfa, &info) : -1;
+      dfa.scanned += bufs[i].len;
+    }
+
+    if (results[i] == DFA_GIVE_UP) {
+      /* Cache thrashes, or is not used. Its memory is free for foo() */
+      use_dfa = 0;
+      info.mem = mem;
+      info.error_msg = "";
+      info.caps = caps == NULL ? NULL : caps + i * num_caps;
+      info.num_caps = num_caps;
+      results[i] = foo(bufs[i].ptr, bufs[i].len, &info);
+      if (results[i] <= 0 && info.error_msg != static_error_no_match) break;
+    }
+    if (results[i] > 0) {
+      num_matched++;
+    } else {
+      results[i] = 0;
+    }
+  }
+
+  if (i < num_bufs) {
+    num_matched = -1;
+  } else {
+    info.error_msg = num_matched > 0 ? "" : static_error_no_match;
+  }
+  if (error_msg != NULL) {
+    *error_msg = info.error_msg;
+  }
+
+  return num_matched;
+}
+
+int slre_exec_limited(const struct slre_compiled *re, const char *s,
+                      int s_len, struct slre_cap *caps, int num_caps,
+                      const struct slre_limits *limits,
+                      const char **error_msg) {
+  struct regex_info info;
+  long scratch[SLRE_SCRATCH_SIZE / sizeof(long)];
+  int result;
+
+  init_info(&info, re, scratch, (int) sizeof(scratch));
+  info.num_caps = num_caps;
+  info.caps = caps;
+  if (limits != NULL) {
+    info.limits = limits;
+    info.steps_left = 0;
+    if (limits->max_depth > 0) info.max_depth = limits->max_depth;
+  }
+
+  result = foo(s, s_len, &info);
+
+  if (error_msg != NULL) {
+    *error_msg = info.error_msg;
+  }
+
+  return info.error_msg == static_error_limit ? -1 : result;
+}
+
+int slre_exec_stats(const struct slre_compiled *re, const char *s, int s_len,
+                    struct slre_cap *caps, int num_caps,
+                    struct slre_stats *stats, const char **error_msg) {
+  struct regex_info info;
+  long scratch[SLRE_SCRATCH_SIZE / sizeof(long)];
+  int result;
+
+  init_info(&info, re, scratch, (int) sizeof(scratch));
+  info.num_caps = num_caps;
+  info.caps = caps;
+  info.stats = stats;
+  if (stats != NULL) memset(stats, 0, sizeof(*stats));
+
+  result = foo(s, s_len, &info);
+
+  if (error_msg != NULL) {
+    *error_msg = info.error_msg;
+  }
+
+  return result;
+}
+
+void slre_iter_init(struct slre_iter *it, const struct slre_compiled *re,
+                    const char *buf, int buf_len) {
+  it->re = re;
+  it->buf = buf;
+  it->buf_len = buf_len;
+  it->match_start = it->match_end = 0;
+}
+
+int slre_iter_next(struct slre_iter *it, struct slre_cap *caps, int num_caps,
+                   const char **error_msg) {
+  struct regex_info info;
+  long scratch[SLRE_SCRATCH_SIZE / sizeof(long)];
+  int result = 0;
+
+  init_info(&info, it->re, scratch, (int) sizeof(scratch));
+  info.error_msg = static_error_no_match;
+  info.num_caps = num_caps;
+  info.caps = caps;
+  info.from = it->match_end;
+  info.need_start = 1;
+
+  /* Matches are never empty, so the search always moves forward */
+  if (it->match_end < it->buf_len) {
+    info.error_msg = "";
+    result = foo(it->buf, it->buf_len, &info);
+  }
+  if (result > 0) {
+    it->match_start = info.match_start;
+    it->match_end = result;
+  } else {
+    it->match_start = it->match_end = it->buf_len;
+  }
+
+  if (error_msg != NULL) {
+    *error_msg = info.error_msg;
+  }
+
+  return result;
+}
+
+/*
+ * Find the first match that starts at offset from to to - 1. If span is
+ * not NULL, store its offsets there. Returns the end of the match, 0 if
+ * there is none, or -1 on error.
+ */
+static int find_span(const struct slre_compiled *re, const char *buf,
+                     int buf_len, int from, int to, struct slre_span *span,
+                     const char **error_msg) {
+  struct regex_info info;
+  long scratch[SLRE_SCRATCH_SIZE / sizeof(long)];
+  int result = 0;
+
+  init_info(&info, re, scratch, (int) sizeof(scratch));
+  info.error_msg = static_error_no_match;
+  info.from = from;
+  info.to = to;
+  info.need_start = span != NULL;
+
+  if (from < to) {
+    info.error_msg = "";
+    result = foo(buf, buf_len, &info);
+  }
+  if (result > 0 && span != NULL) {
+    span->start = info.match_start;
+    span->end = result;
+  }
+  *error_msg = info.error_msg;
+
+  return result > 0 ? result : info.error_msg == static_error_no_match ? 0 : -1;
+}
+
+int slre_chunk_exec(const struct slre_compiled *re, const char *buf,
+                    int buf_len, struct slre_chunk *chunk,
+                    const char **error_msg) {
+  const char *msg = "";
+  int result, from = chunk->start;
+
+  /* Large buffers often have few matches. DFA finds them fastest */
+  chunk->num_spans = 0;
+  result = is_dfa_exact(re) ?
+    find_span(re, buf, buf_len, from, chunk->end, NULL, &msg) : 1;
+
+  while (result > 0 && chunk->num_spans < chunk->max_spans &&
+         (result = find_span(re, buf, buf_len, from, chunk->end,
+                             &chunk->spans[chunk->num_spans], &msg)) > 0) {
+    from = chunk->spans[chunk->num_spans++].end;
+  }
+  chunk->is_complete = result == 0;
+
+  if (result < 0) {
+    chunk->num_spans = -1;
+  } else if (msg == static_error_no_match) {
+    msg = "";
+  }
+  if (error_msg != NULL) {
+    *error_msg = msg;
+  }
+
+  return chunk->num_spans;
+}
+
+/* Store span in spans, if it fits. Returns new number of spans */
+static int add_span(struct slre_span *spans, int max_spans, int n,
+                    const struct slre_span *span) {
+  if (n < max_spans) spans[n] = *span;
+  return n + 1;
+}
+
+int slre_chunk_merge(const struct slre_compiled *re, const char *buf,
+                     int buf_len, const struct slre_chunk *chunks,
+                     int num_chunks, struct slre_span *spans, int max_spans,
+                     const char **error_msg) {
+  const struct slre_chunk *c;
+  struct slre_span span;
+  const char *msg = "";
+  int i, k, n = 0, end = 0, num_spans, result = 1;
+
+  for (k = 0; k < num_chunks && result >= 0; k++) {
+    c = &chunks[k];
+    num_spans = c->num_spans > 0 ? c->num_spans : 0;
+    result = 1;
+    if (k > 0 && c->start != chunks[k - 1].end) {
+      msg = "Chunks do not follow each other";
+      result = -1;
+      break;
+    }
+
+    /*
+     * Matches of the chunk are right if the search continues from its
+     * start. If the last match crosses into the chunk, continue from its
+     * end until a match is the same as one of the chunk.
+     */
+    for (i = 0; end > c->start; ) {
+      if ((result = find_span(re, buf, buf_len, end, c->end, &span,
+                              &msg)) <= 0) {
+        i = num_spans;
+        break;
+      }
+      while (i < num_spans && c->spans[i].start < span.start) i++;
+      if (i < num_spans && c->spans[i].start == span.start) break;
+      n = add_span(spans, max_spans, n, &span);
+      end = span.end;
+    }
+
+    for (; i < num_spans; i++) {
+      n = add_span(spans, max_spans, n, &c->spans[i]);
+      end = c->spans[i].end;
+    }
+
+    /* Matches that did not fit into the chunk, or were not searched for */
+    while (result > 0 && (c->num_spans < 0 || !c->is_complete) &&
+           (result = find_span(re, buf, buf_len, end > c->start ? end :
+                               c->start, c->end, &span, &msg)) > 0) {
+      n = add_span(spans, max_spans, n, &span);
+      end = span.end;
+    }
+  }
+
+  if (msg == static_error_no_match) msg = "";
+  if (error_msg != NULL) {
+    *error_msg = msg;
+  }
+
+  return result < 0 ? -1 : n;
+}
+
+/* Returns non-zero if template has $$ or $0 .. $9 reference at p */
+static int is_reference(const char *p) {
+  return p[0] == '$' && (p[1] == '$' || (p[1] >= '0' && p[1] <= '9'));
+}
+
+/* Copy len bytes to out at offset n, as much as fits. Returns new offset */
+static int append(char *out, int out_len, int n, const char *s, int len) {
+  if (n < out_len - 1) {
+    memcpy(out + n, s, n + len < out_len - 1 ? len : out_len - 1 - n);
+  }
+  return n + len;
+}
+
+int slre_replace(const struct slre_compiled *re, const char *buf, int buf_len,
+                 const char *sub, char *out, int out_len,
+                 const char **error_msg) {
+  struct slre_iter it;
+  struct slre_cap caps[SLRE_MAX_BRACKETS];
+  const char *msg = "", *p, *q;
+  int i, n = 0, end = 0;
+
+  /* Check references first, not to fail half way */
+  for (p = sub; *p != '\0'; p++) {
+    if (is_reference(p)) {
+      if (p[1] != '$' && p[1] - '0' > re->num_brackets) {
+        msg = "Invalid $ reference";
+      }
+      p++;
+    }
+  }
+
+  slre_iter_init(&it, re, buf, buf_len);
+  while (msg[0] == '\0' &&
+         slre_iter_next(&it, caps, re->num_brackets, &msg) > 0) {
+    n = append(out, out_len, n, buf + end, it.match_start - end);
+    end = it.match_end;
+
+    for (p = q = sub; *p != '\0'; p++) {
+      if (!is_reference(p)) continue;
+      /* Flush template text up to $, then substitute */
+      n = append(out, out_len, n, q, p - q);
+      if (p[1] == '$') {
+        n = append(out, out_len, n, "$", 1);
+      } else if (p[1] == '0') {
+        n = append(out, out_len, n, buf + it.match_start,
+                   it.match_end - it.match_start);
+      } else if ((i = p[1] - '1') < re->num_brackets && caps[i].ptr != NULL) {
+        n = append(out, out_len, n, caps[i].ptr, caps[i].len);
+      }
+      q = p + 2;
+      p++;
+    }
+    n = append(out, out_len, n, q, p - q);
+  }
+
+  if (msg == static_error_no_match) msg = "";
+  n = append(out, out_len, n, buf + end, buf_len - end);
+  if (out_len > 0) out[n < out_len - 1 ? n : out_len - 1] = '\0';
+
+  if (error_msg != NULL) {
+    *error_msg = msg;
+  }
+
+  return msg[0] == '\0' ? n : -1;
+}
+
+#if SLRE_CACHE_SIZE > 0
+#ifndef SLRE_CACHE_LOCK
+#if defined(__GNUC__)
+#define SLRE_CACHE_LOCK(lock) while (__sync_lock_test_and_set(lock, 1))
+#define SLRE_CACHE_UNLOCK(lock) __sync_lock_release(lock)
+#else
+#error "Define SLRE_CACHE_LOCK and SLRE_CACHE_UNLOCK to use SLRE_CACHE_SIZE"
+#endif
+#endif
+
+#define CACHE_WAYS ((SLRE_CACHE_SIZE + SLRE_CACHE_SHARDS - 1) / \
+                    SLRE_CACHE_SHARDS)
+
+struct cache_entry {
+  char regexp[SLRE_CACHE_KEY];    /* Key, empty if entry is not used */
+  unsigned hash;
+  unsigned long used;             /* Shard clock at the last lookup  */
+  struct slre_compiled re;
+};
+
+/* Lock is held only to copy the compiled regex in or out */
+struct cache_shard {
+  int lock;
+  unsigned long clock;
+  struct cache_entry entries[CACHE_WAYS];
+};
+
+static struct cache_shard static_cache[SLRE_CACHE_SHARDS];
+
+static unsigned cache_hash(const char *regexp) {
+  unsigned hash = 0;
+  while (*regexp != '\0') hash = hash * 31 + (unsigned char) *regexp++;
+  return hash;
+}
+
+/* Returns cached entry of regexp, or NULL. Shard must be locked */
+static struct cache_entry *cache_find(struct cache_shard *sh,
+                                      const char *regexp, unsigned hash) {
+  int i;
+
+  for (i = 0; i < CACHE_WAYS; i++) {
+    if (sh->entries[i].hash == hash && sh->entries[i].regexp[0] != '\0' &&
+        strcmp(sh->entries[i].regexp, regexp) == 0) {
+      return &sh->entries[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Copy compiled regexp from the cache to re. Returns 0 if it is not there.
+ * Regexes are spread over shards by hash, so that threads matching
+ * different regexes rarely wait for each other.
+ */
+static int cache_get(const char *regexp, struct slre_compiled *re) {
+  unsigned hash = cache_hash(regexp);
+  struct cache_shard *sh = &static_cache[hash % SLRE_CACHE_SHARDS];
+  struct cache_entry *e;
+
+  SLRE_CACHE_LOCK(&sh->lock);
+  if ((e = cache_find(sh, regexp, hash)) != NULL) {
+    e->used = ++sh->clock;
+    memcpy(re, &e->re, sizeof(*re));
+  }
+  SLRE_CACHE_UNLOCK(&sh->lock);
+
+  return e != NULL;
+}
+
+/* Store compiled regexp, in place of the least recently used one */
+static void cache_put(const char *regexp, const struct slre_compiled *re) {
+  unsigned hash = cache_hash(regexp);
+  struct cache_shard *sh = &static_cache[hash % SLRE_CACHE_SHARDS];
+  struct cache_entry *e;
+  int i;
+
+  if (regexp[0] == '\0' || strlen(regexp) >= sizeof(e->regexp)) return;
+
+  SLRE_CACHE_LOCK(&sh->lock);
+  /* Another thread may have compiled the same regexp meanwhile */
+  if (cache_find(sh, regexp, hash) == NULL) {
+    for (e = &sh->entries[0], i = 1; i < CACHE_WAYS; i++) {
+      if (sh->entries[i].used < e->used) e = &sh->entries[i];
+    }
+    strcpy(e->regexp, regexp);
+    e->hash = hash;
+    e->used = ++sh->clock;
+    memcpy(&e->re, re, sizeof(*re));
+  }
+  SLRE_CACHE_UNLOCK(&sh->lock);
+}
+#endif
+
+int slre_match(const char *regexp, const char *s, int s_len,
+               struct slre_cap *caps, int num_caps, const char **error_msg) {
+  struct slre_compiled re;
+
+#if SLRE_CACHE_SIZE > 0
+  if (!cache_get(regexp, &re)) {
+    if (!slre_compile(regexp, 0, &re, error_msg)) return 0;
+    cache_put(regexp, &re);
+  }
+#else
+  if (!slre_compile(regexp, 0, &re, error_msg)) {
+    return 0;
+  }
+#endif
+
+  return slre_exec(&re, s, s_len, caps, num_caps, error_msg);
+}
+
+
+/*
+ * Stream never has the whole buffer, so the match runs on NFA engine,
+ * one offset at a time. If regex has $, the last byte is kept and run
+ * only when it is known whether it ends the stream.
+ * Returns non-zero when the result is known.
+ */
+static int stream_feed(struct slre_stream *st, const unsigned char *s,
+                       int s_len, int is_last, struct regex_info *info) {
+  struct slre_nfa *nfa = &st->nfa;
+  const struct slre_nfa_list *clist;
+  const unsigned char *p;
+  unsigned char ch;
+  int pc, sp = st->pending >= 0 ? st->offset - 1 : st->offset;
+  int end = st->offset + s_len;
+  int last = is_last || !(st->re->flags & HAS_EOL) ? end : end - 1;
+
+  info->s_len = end;
+
+  while (sp < last) {
+    /* When no threads are left, skip to a byte that can start a match */
+    if (nfa->result < 0 && nfa->lists[nfa->cur].num_threads == 0 &&
+        (st->re->flags & CAN_SKIP) && sp >= st->offset) {
+      if (st->re->prefix_len > 0) {
+        p = find_byte(s + sp - st->offset, end - sp, st->re->prefix[0],
+                      st->re->flags & SLRE_IGNORE_CASE);
+        sp = p == NULL ? end : st->offset + (int) (p - s);
+      } else {
+        sp += class_span(st->re, st->re->first_class, s + sp - st->offset,
+                         end - sp, 0);
+      }
+      if (sp >= last) break;
+    }
+    ch = sp < st->offset ? (unsigned char) st->pending : s[sp - st->offset];
+    if (nfa_step(nfa, sp, &ch, info)) return 1;
+    sp++;
+  }
+
+  if (sp >= end) {
+    st->pending = -1;
+  } else if (sp >= st->offset) {
+    st->pending = s[sp - st->offset];
+  }
+  st->offset = end;
+
+  if (is_last) {
+    nfa_step(nfa, end, NULL, info);
+    return 1;
+  }
+
+  /* Match preferred to all other threads can be reported right away */
+  clist = &nfa->lists[nfa->cur];
+  pc = clist->num_threads == 0 ? 0 :
+    state_pc(st->re, nfa->states, clist->pc[0], nfa->counters);
+  if (clist->num_threads > 0 && st->re->insns[pc].op == I_MATCH &&
+      clist->slots[0] != sp) {
+    nfa_step(nfa, sp, NULL, info);
+    return 1;
+  }
+
+  /* Without threads, only a new attempt can change the result */
+  return clist->num_threads == 0 && (nfa->result >= 0 ||
+    (sp > 0 && (st->re->flags & IS_ANCHORED)));
+}
+
+int slre_stream_init(struct slre_stream *st, const struct slre_compiled *re,
+                     int num_caps, const char **error_msg) {
+  struct regex_info info;
+
+  st->re = re;
+  st->offset = 0;
+  st->pending = -1;
+  st->result = 0;
+  init_info(&info, re, st->mem, (int) sizeof(st->mem));
+  if (!nfa_init(&st->nfa, num_caps, &info.mem, &info)) {
+    st->result = -1;
+  }
+
+  if (error_msg != NULL) {
+    *error_msg = info.error_msg;
+  }
+
+  return st->result == 0 ? 1 : 0;
+}
+
+int slre_stream_feed(struct slre_stream *st, const char *buf, int buf_len,
+                     int is_last, const char **error_msg) {
+  struct regex_info info;
+  int j;
+
+  init_info(&info, st->re, NULL, 0);
+
+  if (st->result == 0 &&
+      stream_feed(st, (const unsigned char *) buf, buf_len, is_last, &info)) {
+    st->result = st->nfa.result > 0 ? st->nfa.result : -1;
+    for (j = 0; j < 2 * SLRE_MAX_BRACKETS; j++) {
+      st->caps[j] = j + 1 < st->nfa.stride && st->result > 0 ?
+        st->nfa.match[j + 1] : -1;
+    }
+    st->match_start = st->result > 0 ? st->nfa.match[0] : -1;
+  }
+
+  if (st->result < 0 && info.error_msg[0] == '\0') {
+    info.error_msg = static_error_no_match;
+  }
+  if (error_msg != NULL) {
+    *error_msg = info.error_msg;
+  }
+
+  return st->result;
+}
+
+int slre_set_compile(const char **regexps, int num_regexps, int flags,
+                     struct slre_set *set, const char **error_msg) {
+  struct compile_info info;
+  int result;
+
+  info.error_msg = "";
+  set->num_regexps = num_regexps;
+  result = join_set(&info, set, regexps, num_regexps, flags) ? 1 : 0;
+
+  if (error_msg != NULL) {
+    *error_msg = info.error_msg;
+  }
+
+  return result;
+}
+
+int slre_set_exec(const struct slre_set *set, const char *s, int s_len,
+                  unsigned char *matched, const char **error_msg) {
+  struct regex_info info;
+  long scratch[SLRE_SCRATCH_SIZE / sizeof(long)];
+  const char *msg = "";
+  int i, num_matched = 0;
+
+  memset(matched, 0, (set->num_regexps + 7) / 8);
+
+  /* Both engines run all regexes of a program in one pass over the buffer */
+  for (i = 0; i < set->num_programs && msg[0] == '\0'; i++) {
+    init_info(&info, &set->progs[i], scratch, (int) sizeof(scratch));
+    info.s = (const unsigned char *) s;
+    info.s_len = info.to = s_len;
+    info.matched = matched;
+    info.num_matched = 0;
+    info.num_regexps = set->counts[i];
+    if (dfa_search(&info) == DFA_GIVE_UP) {
+      nfa_search(&info);
+    }
+    num_matched += info.num_matched;
+    msg = info.error_msg;
+  }
+
+  if (msg[0] != '\0') {
+    num_matched = 0;
+  } else if (num_matched == 0) {
+    msg = static_error_no_match;
+  }
+
+  if (error_msg != NULL) {
+    *error_msg = msg;
+  }
+
+  return num_matched;
+}
+
+
+/*
+ * Saved regex is this header followed by struct slre_compiled as is, so
+ * that it is used in place. The header tells what the layout depends on.
+ */
+struct saved_header {
+  char magic[4];        /* "SLRE"                                        */
+  int version;          /* SAVED_VERSION, changed with program format    */
+  int byte_order;       /* SAVED_BYTE_ORDER as written by the machine    */
+  int size;             /* sizeof(struct slre_compiled)                  */
+  int max_insns, max_classes, max_prefix, max_brackets;
+};
+
+enum { SAVED_VERSION = 3, SAVED_BYTE_ORDER = 0x01020304 };
+
+/* Non-zero if pc jumps or falls through into [lo, hi] */
+static int goes_into(const struct slre_insn *insns, int pc, int lo, int hi) {
+  const struct slre_insn *insn = &insns[pc];
+
+  switch (insn->op) {
+    case I_SPLIT:
+      return (insn->x >= lo && insn->x <= hi) ||
+        (insn->y >= lo && insn->y <= hi);
+    case I_JMP: case I_INC: return insn->x >= lo && insn->x <= hi;
+    case I_REPEAT: return pc + 2 >= lo && pc + 1 <= hi;
+    case I_MATCH: return 0;
+    default: return pc + 1 >= lo && pc + 1 <= hi;
+  }
+}
+
+/*
+ * Check that every loop counter has one loop laid out the way
+ * gen_count() does it, that loops nest, and that code outside a loop
+ * goes into it only by its REPEAT. Then the counter only grows inside
+ * the loop and the engines never see it over its y.
+ */
+static int is_valid_counters(const struct slre_compiled *re) {
+  const struct slre_insn *insns = re->insns;
+  int repeats[REPEAT_LAZY], i, j, c, r, end, n = re->num_insns;
+
+  for (c = 0; c < re->num_counters; c++) repeats[c] = -1;
+  for (i = 0; i < n; i++) {
+    if (insns[i].op != I_REPEAT) continue;
+    c = insns[i].c & ~REPEAT_LAZY;
+    end = insns[i + 1].x;
+    if (repeats[c] >= 0 || insns[i + 1].op != I_JMP || end < i + 3 ||
+        insns[end - 1].op != I_INC || insns[end - 1].c != c ||
+        insns[end - 1].x != i) {
+      return 0;
+    }
+    repeats[c] = i;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (insns[i].op != I_INC) continue;
+    r = repeats[insns[i].c];
+    if (r < 0 || insns[r + 1].x != i + 1) return 0;
+  }
+
+  for (c = 0; c < re->num_counters; c++) {
+    if ((r = repeats[c]) < 0) return 0;
+    end = insns[r + 1].x;
+    for (i = 0; i < re->num_counters; i++) {
+      if (repeats[i] < r && r < insns[repeats[i] + 1].x &&
+          insns[repeats[i] + 1].x < end) return 0;
+    }
+    for (j = 0; j < n; j++) {
+      if (j != r && goes_into(insns, j, r + 1, j < r || j >= end ? end - 1 :
+                              r + 1)) return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Check that every loop register is used the way gen_loop() uses it, so
+ * that an iteration that consumes nothing stops at its I_CHECK, and mark
+ * the JMP back of each such loop in back[]. A star loop is SPLIT to
+ * MARK, body, CHECK and JMP back to the SPLIT. A plus loop is MARK -1,
+ * body, CHECK, then SPLIT to MARK and JMP back to the body. Only the body
+ * jumps into a loop, and only within itself.
+ */
+static int is_valid_loop_regs(const struct slre_compiled *re,
+                              unsigned char *back) {
+  const struct slre_insn *insns = re->insns;
+  unsigned char used[SLRE_MAX_BRACKETS], marks[SLRE_MAX_INSNS];
+  int i, j, r, split, body, end, n = re->num_insns;
+
+  memset(used, 0, sizeof(used));
+  memset(marks, 0, sizeof(marks));
+  memset(back, 0, n);
+  for (i = 0; i < n; i++) {
+    if (insns[i].op != I_CHECK) continue;
+    r = insns[i].x;
+    if (used[r] || i + 1 >= n) return 0;
+    used[r] = 1;
+
+    if (insns[i + 1].op == I_JMP) {
+      /* Star: SPLIT, MARK, body, CHECK at i, JMP back at end */
+      split = insns[i + 1].x;
+      body = split + 2;
+      end = i + 1;
+      if (split + 1 >= i || insns[split].op != I_SPLIT ||
+          (insns[split].c & SPLIT_SIMPLE_LOOP) ||
+          insns[split + 1].op != I_MARK ||
+          insns[split + 1].c != 0 || insns[split + 1].x != r ||
+          !((insns[split].x == split + 1 && insns[split].y == end + 1) ||
+            (insns[split].y == split + 1 && insns[split].x == end + 1))) {
+        return 0;
+      }
+      marks[split + 1] = 1;
+    } else if (insns[i + 1].op == I_SPLIT && i + 3 < n) {
+      /* Plus: MARK -1, body, CHECK at i, SPLIT, MARK, JMP back at end */
+      split = i + 1;
+      end = i + 3;
+      body = insns[end].x;
+      if (body < 1 || body > i || insns[body - 1].op != I_MARK ||
+          insns[body - 1].c != 1 || insns[body - 1].x != r ||
+          (insns[split].c & SPLIT_SIMPLE_LOOP) ||
+          insns[split + 1].op != I_MARK ||
+          insns[split + 1].c != 0 || insns[split + 1].x != r ||
+          insns[end].op != I_JMP ||
+          !((insns[split].x == split + 1 && insns[split].y == end + 1) ||
+            (insns[split].y == split + 1 && insns[split].x == end + 1))) {
+        return 0;
+      }
+      marks[body - 1] = marks[split + 1] = 1;
+      split = body - 1;
+    } else {
+      return 0;
+    }
+    back[end] = 1;
+
+    /* Insns from split to end other than the body are checked above */
+    for (j = 0; j < n; j++) {
+      if (j >= body && j < i) {
+        if (goes_into(insns, j, split, body - 1) ||
+            goes_into(insns, j, i + 1, end)) return 0;
+      } else if ((j < split || j > end) &&
+                 goes_into(insns, j, split + 1, end)) {
+        return 0;
+      }
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    if (insns[i].op == I_MARK && !marks[i]) return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Non-zero if the program can get back to pc without consuming a byte,
+ * other than by a loop that stops at its I_CHECK. The engines would run
+ * such cycle forever.
+ */
+static int has_empty_cycle(const struct slre_compiled *re, int pc,
+                           unsigned char *state, const unsigned char *back) {
+  const struct slre_insn *insn = &re->insns[pc];
+  int result = 0;
+
+  if (state[pc] != 0) return state[pc] == 1;
+  state[pc] = 1;
+  switch (insn->op) {
+    case I_CHAR: case I_ANY: case I_CLASS: case I_MATCH: break;
+    case I_INC: break;  /* Counter grows to its y, see is_valid_counters() */
+    case I_JMP:
+      result = !back[pc] && has_empty_cycle(re, insn->x, state, back);
+      break;
+    case I_REPEAT:
+      result = has_empty_cycle(re, pc + 1, state, back) ||
+        has_empty_cycle(re, pc + 2, state, back);
+      break;
+    case I_SPLIT:
+      result = has_empty_cycle(re, insn->x, state, back) ||
+        has_empty_cycle(re, insn->y, state, back);
+      break;
+    default:
+      result = has_empty_cycle(re, pc + 1, state, back);
+      break;
+  }
+  state[pc] = 2;
+
+  return result;
+}
+
+/*
+ * Non-zero if the hints that the engines trust are what slre_compile()
+ * derives from the program: possessive loops, one-pass program, byte
+ * classes of the DFA, SIMD nibbles, first bytes and skipping.
+ */
+static int is_valid_hints(const struct slre_compiled *re) {
+  struct slre_compiled copy;
+  unsigned char bits[32], seen[SLRE_MAX_INSNS];
+  int i;
+
+  memcpy(&copy, re, sizeof(copy));
+  copy.flags &= ~(IS_ONE_PASS | HAS_EOL | CAN_SKIP);
+  for (i = 0; i < copy.num_insns; i++) {
+    if (copy.insns[i].op == I_SPLIT) copy.insns[i].c &= SPLIT_SIMPLE_LOOP;
+  }
+
+  /* Same as finish(), with the first class already in place */
+  set_byte_classes(&copy);
+  set_possessive(&copy);
+  set_one_pass(&copy);
+  for (i = 0; i < copy.num_insns; i++) {
+    if (copy.insns[i].op == I_EOL) copy.flags |= HAS_EOL;
+  }
+  if (copy.prefix_len > 0 || copy.first_class >= 0) copy.flags |= CAN_SKIP;
+  set_nibbles(&copy);
+
+  if (re->first_class >= 0) {
+    memset(bits, 0, sizeof(bits));
+    memset(seen, 0, sizeof(seen));
+    get_first_bytes(&copy, 0, bits, seen);
+    if ((re->flags & IS_ANCHORED) || re->prefix_len > 0 ||
+        memcmp(bits, re->classes[re->first_class], sizeof(bits)) != 0) {
+      return 0;
+    }
+  }
+
+  return copy.flags == re->flags &&
+    copy.num_byte_classes == re->num_byte_classes &&
+    memcmp(copy.byte_classes, re->byte_classes, sizeof(re->byte_classes)) == 0
+    && memcmp(copy.insns, re->insns, re->num_insns * sizeof(re->insns[0])) == 0
+    && memcmp(copy.nibbles, re->nibbles,
+              re->num_classes * sizeof(re->nibbles[0])) == 0;
+}
+
+/*
+ * Non-zero if the program refers only to what it has, see slre_load(),
+ * and can't make the engines loop forever or trust a wrong hint
+ */
+static int is_valid_program(const struct slre_compiled *re) {
+  const struct slre_insn *insn;
+  unsigned char back[SLRE_MAX_INSNS], state[SLRE_MAX_INSNS];
+  int i, lo, hi, n = re->num_insns + re->num_rev_insns;
+  int flags = SLRE_IGNORE_CASE | SLRE_NFA | SLRE_ANCHORED | SLRE_FULL_MATCH |
+    SLRE_UTF8 | IS_ANCHORED | CAN_SKIP | HAS_EOL | ENDS_AT_EOL | MUST_AT_END |
+    IS_ONE_PASS;
+
+  if (re->num_insns <= 0 || re->num_rev_insns < 0 || n > SLRE_MAX_INSNS ||
+      re->num_brackets < 0 || re->num_brackets > SLRE_MAX_BRACKETS ||
+      re->num_regs < 0 || re->num_regs > SLRE_MAX_BRACKETS ||
+      re->num_counters < 0 || re->num_counters > REPEAT_LAZY ||
+      re->num_classes < 0 || re->num_classes > SLRE_MAX_CLASSES ||
+      re->first_class < -1 || re->first_class >= re->num_classes ||
+      re->num_byte_classes < 1 || re->num_byte_classes > 256 ||
+      re->prefix_len < 0 || re->prefix_len > SLRE_MAX_PREFIX ||
+      re->must_len < 0 || re->must_len > SLRE_MAX_PREFIX ||
+      re->min_len < 0 || re->max_len < -1 || (re->flags & ~flags) != 0 ||
+      re->prefix_len > re->min_len || re->must_len > re->min_len ||
+      (re->max_len >= 0 && re->max_len < re->min_len)) {
+    return 0;
+  }
+  for (i = 0; i < 256; i++) {
+    if (re->byte_classes[i] >= re->num_byte_classes) return 0;
+  }
+
+  for (i = 0; i < n; i++) {
+    insn = &re->insns[i];
+    /* Forward and reversed programs never jump into each other */
+    lo = i < re->num_insns ? 0 : re->num_insns;
+    hi = i < re->num_insns ? re->num_insns : n;
+    switch (insn->op) {
+      case I_CHAR: case I_ANY: case I_BOL: case I_EOL: break;
+      case I_CLASS:
+        if (insn->x >= re->num_classes) return 0;
+        break;
+      case I_SAVE:
+        if (insn->x >= 2 * re->num_brackets) return 0;
+        break;
+      case I_MARK: case I_CHECK:
+        /* Reversed program has no loop registers, see gen_loop() */
+        if (insn->x >= re->num_regs || i >= re->num_insns) return 0;
+        break;
+      case I_SPLIT:
+        if (insn->x < lo || insn->x >= hi || insn->y < lo || insn->y >= hi ||
+            (insn->c & ~(i < re->num_insns ? SPLIT_SIMPLE_LOOP |
+                         SPLIT_POSSESSIVE | SPLIT_TO_MATCH :
+                         SPLIT_SIMPLE_LOOP)) != 0) {
+          return 0;
+        }
+        if ((insn->c & SPLIT_SIMPLE_LOOP) &&
+            (i + 3 >= hi || insn[1].op > I_CLASS || insn[2].op != I_JMP ||
+             insn[2].x != i ||
+             !((insn->x == i + 1 && insn->y == i + 3) ||
+               (insn->y == i + 1 && insn->x == i + 3)))) {
+          return 0;
+        }
+        continue;
+      case I_JMP:
+        if (insn->x < lo || insn->x >= hi) return 0;
+        continue;
+      case I_REPEAT:
+        /* Loop counters are in the forward program only, see gen_count() */
+        if ((insn->c & ~REPEAT_LAZY) >= re->num_counters ||
+            insn->x > insn->y || insn->y < 2 || insn->y > SHRT_MAX ||
+            i >= re->num_insns) {
+          return 0;
+        }
+        break;
+      case I_INC:
+        if (insn->c >= re->num_counters || i >= re->num_insns) return 0;
+        continue;
+      case I_MATCH: continue;
+      default: return 0;
+    }
+    if (i + 1 >= hi) return 0;  /* Runs past the end of the program */
+  }
+
+  /* Reversed program is run by rev_add(), that adds a pc once per offset */
+  memset(state, 0, sizeof(state));
+  return is_valid_counters(re) && is_valid_loop_regs(re, back) &&
+    !has_empty_cycle(re, 0, state, back) && is_valid_hints(re);
+}
+
+int slre_save(const struct slre_compiled *re, void *buf, int buf_len) {
+  struct saved_header *h = (struct saved_header *) buf;
+  struct slre_compiled *dst = (struct slre_compiled *) (h + 1);
+  int size = (int) (sizeof(*h) + sizeof(*dst)), n;
+
+  if (buf == NULL || buf_len < size) return size;
+
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, "SLRE", 4);
+  h->version = SAVED_VERSION;
+  h->byte_order = SAVED_BYTE_ORDER;
+  h->size = (int) sizeof(*dst);
+  h->max_insns = SLRE_MAX_INSNS;
+  h->max_classes = SLRE_MAX_CLASSES;
+  h->max_prefix = SLRE_MAX_PREFIX;
+  h->max_brackets = SLRE_MAX_BRACKETS;
+
+  /* Unused parts are zeroed, so that a regex is always saved the same */
+  memcpy(dst, re, sizeof(*dst));
+  n = re->num_insns + re->num_rev_insns;
+  memset(dst->insns + n, 0, (SLRE_MAX_INSNS - n) * sizeof(dst->insns[0]));
+  memset(dst->classes + re->num_classes, 0,
+         (SLRE_MAX_CLASSES - re->num_classes) * sizeof(dst->classes[0]));
+  memset(dst->nibbles + re->num_classes, 0,
+         (SLRE_MAX_CLASSES - re->num_classes) * sizeof(dst->nibbles[0]));
+  memset(dst->prefix + re->prefix_len, 0, SLRE_MAX_PREFIX - re->prefix_len);
+  memset(dst->must + re->must_len, 0, SLRE_MAX_PREFIX - re->must_len);
+
+  return size;
+}
+
+const struct slre_compiled *slre_load(const void *buf, int buf_len,
+                                      const char **error_msg) {
+  const struct saved_header *h = (const struct saved_header *) buf;
+  const struct slre_compiled *re = (const struct slre_compiled *) (h + 1);
+  const char *msg = "";
+
+  if (buf_len < (int) (sizeof(*h) + sizeof(*re)) ||
+      (size_t) buf % sizeof(int) != 0 || memcmp(h->magic, "SLRE", 4) != 0 ||
+      h->version != SAVED_VERSION || h->byte_order != SAVED_BYTE_ORDER ||
+      h->size != (int) sizeof(*re) || h->max_insns != SLRE_MAX_INSNS ||
+      h->max_classes != SLRE_MAX_CLASSES || h->max_prefix != SLRE_MAX_PREFIX ||
+      h->max_brackets != SLRE_MAX_BRACKETS) {
+    msg = static_error_saved_build;
+  } else if (!is_valid_program(re)) {
+    msg = static_error_saved_invalid;
+  }
+
+  if (error_msg != NULL) {
+    *error_msg = msg;
+  }
+
+  return msg[0] == '\0' ? re : NULL;
+}
+
+/*****************************************************************************/
+/********************************** UNIT TEST ********************************/
+/*****************************************************************************/
+#ifdef SLRE_UNIT_TEST
+static int static_total_tests = 0;
+static int static_failed_tests = 0;
+
+#define FAIL(str, line) do {                      \
+  printf("Fail on line %d: [%s]\n", line, str);   \
+  static_failed_tests++;                          \
+} while (0)
+
+#define ASSERT(expr) do {               \
+  static_total_tests++;                 \
+  if (!(expr)) FAIL(#expr, __LINE__);   \
+} while (0)
+
+/* Deadline for slre_limits that expires on the third call */
+static int count_calls(void *arg) {
+  return ++*(int *) arg >= 3;
+}
+
+/* Check that backtracking, NFA and DFA engines give the same match */
+static int engines_agree(const char *regex, const char *buf) {
+  struct slre_compiled re1, re2;
+  struct slre_cap caps1[10], caps2[10];
+  int i, n1, n2, len = strlen(buf);
+
+  memset(caps1, 0, sizeof(caps1));
+  memset(caps2, 0, sizeof(caps2));
+  if (!slre_compile(regex, 0, &re1, NULL) ||
+      !slre_compile(regex, SLRE_NFA, &re2, NULL)) return 0;
+  n1 = slre_exec(&re1, buf, len, caps1, 10, NULL);
+  n2 = slre_exec(&re2, buf, len, caps2, 10, NULL);
+  if (slre_exec(&re1, buf, len, NULL, 0, NULL) != n1 ||
+      slre_exec(&re2, buf, len, NULL, 0, NULL) != n2) return 0;
+  for (i = 0; i < re1.num_brackets && n1 > 0; i++) {
+    if (caps1[i].ptr != caps2[i].ptr || caps1[i].len != caps2[i].len) return 0;
+  }
+
+  return n1 == n2;
+}
+
+#ifdef SLRE_THREAD_TEST
+/*
+ * Stress test of compiled regexes shared by many threads, built with
+ * -DSLRE_THREAD_TEST -pthread. Regexes are compiled once, then every
+ * thread matches them with its own scratch memory and compares results
+ * with ones computed before the threads started. With SLRE_CACHE_SIZE,
+ * slre_match() calls also share the cache.
+ */
+#include <pthread.h>
+
+#define NUM_THREADS 16
+
+static const char *thread_regexps[] = {
+  "(\\d+)-(\\d+)", "(?i)(https?://)([^\\s/]+)", "^\\s*(\\S+)\\s+(\\S+)",
+  "(a|b)*abb", "(x+x+)+y", "(\\d)?([a-c]+?)c$"
+};
+#define NUM_RE (int) (sizeof(thread_regexps) / sizeof(thread_regexps[0]))
+
+static const char *thread_words[] = {
+  " GET ", "HTTP://x.org/a ", "12-345 ", "abbab", "xxxxxxxxxxxx", "xy ", "\n"
+};
+#define NUM_WORDS (int) (sizeof(thread_words) / sizeof(thread_words[0]))
+
+static struct slre_compiled thread_re[2 * NUM_RE];
+static struct slre_set thread_set;
+static char thread_buf[2000];
+#define NUM_RESULTS 7
+#define NUM_CHUNKS 5
+static int thread_expected[2 * NUM_RE][NUM_RESULTS];
+
+/* Match every regex in all ways, storing results in r */
+static void thread_match(int i, long *scratch, int *r) {
+  struct slre_cap caps[10];
+  struct slre_iter it;
+  struct slre_chunk chunks[NUM_CHUNKS];
+  struct slre_span spans[NUM_CHUNKS][8];
+  unsigned char matched[2];
+  int j, len = (int) strlen(thread_buf);
+
+  caps[0].len = caps[1].len = -1;
+  r[0] = slre_exec_scratch(&thread_re[i], thread_buf, len, caps, 10,
+                           scratch, slre_scratch_size(&thread_re[i]), NULL);
+  r[1] = caps[0].len * 1000 + caps[1].len;
+  r[2] = slre_exec(&thread_re[i], thread_buf, len, NULL, 0, NULL);
+  slre_iter_init(&it, &thread_re[i], thread_buf, len);
+  for (r[3] = 0; slre_iter_next(&it, caps, 10, NULL) > 0; r[3]++) {
+  }
+  r[4] = slre_set_exec(&thread_set, thread_buf, len, matched, NULL) * 1000 +
+    matched[0];
+  r[5] = slre_match(thread_regexps[i % NUM_RE], thread_buf, len, NULL, 0, NULL);
+
+  for (j = 0; j < NUM_CHUNKS; j++) {
+    chunks[j].start = j * len / NUM_CHUNKS;
+    chunks[j].end = (j + 1) * len / NUM_CHUNKS;
+    chunks[j].spans = spans[j];
+    chunks[j].max_spans = 8;
+    slre_chunk_exec(&thread_re[i], thread_buf, len, &chunks[j], NULL);
+  }
+  r[6] = slre_chunk_merge(&thread_re[i], thread_buf, len, chunks, NUM_CHUNKS,
+                          NULL, 0, NULL);
 }
 
+static void *thread_main(void *arg) {
+  long scratch[SLRE_SCRATCH_SIZE / sizeof(long)];
+  int i, j, n, r[NUM_RESULTS], *failed = (int *) arg;
 
-/*****************************************************************************/
-/********************************** UNIT TEST ********************************/
-/*****************************************************************************/
-#ifdef SLRE_UNIT_TEST
-static int static_total_tests = 0;
-static int static_failed_tests = 0;
+  for (n = 0; n < 50; n++) {
+    for (i = 0; i < 2 * NUM_RE; i++) {
+      thread_match(i, scratch, r);
+      for (j = 0; j < NUM_RESULTS; j++) {
+        if (r[j] != thread_expected[i][j]) (*failed)++;
+      }
+    }
+  }
 
-#define FAIL(str, line) do {                      \
-  printf("Fail on line %d: [%s]\n", line, str);   \
-  static_failed_tests++;                          \
-} while (0)
+  return NULL;
+}
 
-#define ASSERT(expr) do {               \
-  static_total_tests++;                 \
-  if (!(expr)) FAIL(#expr, __LINE__);   \
-} while (0)
+static int thread_test(void) {
+  pthread_t threads[NUM_THREADS];
+  long scratch[SLRE_SCRATCH_SIZE / sizeof(long)];
+  int i, failed[NUM_THREADS], total = 0;
 
-/* Regex must have exactly one bracket pair */
-static char *slre_replace(const char *regex, const char *buf,
-                          const char *sub) {
-  char *s = NULL;
-  int n, n1, n2, n3, s_len, len = strlen(buf);
-  struct slre_cap cap = { NULL, 0 };
-
-  do {
-    s_len = s == NULL ? 0 : strlen(s);
-    if ((n = slre_match(regex, buf, len, &cap, 1, NULL)) > 0) {
-      n1 = cap.ptr - buf, n2 = strlen(sub),
-         n3 = &buf[n] - &cap.ptr[cap.len];
-    } else {
-      n1 = len, n2 = 0, n3 = 0;
+  for (i = 0; strlen(thread_buf) + 20 < sizeof(thread_buf); i++) {
+    strcat(thread_buf, thread_words[(i * 5 + i / 7) % NUM_WORDS]);
+  }
+  strcat(thread_buf, "1abcc");
+  if (!slre_set_compile(thread_regexps, NUM_RE, 0, &thread_set, NULL)) {
+    return 0;
+  }
+  for (i = 0; i < NUM_RE; i++) {
+    if (!slre_compile(thread_regexps[i], 0, &thread_re[i], NULL) ||
+        !slre_compile(thread_regexps[i], SLRE_NFA, &thread_re[NUM_RE + i],
+                      NULL)) {
+      return 0;
     }
-    s = (char *) realloc(s, s_len + n1 + n2 + n3 + 1);
-    memcpy(s + s_len, buf, n1);
-    memcpy(s + s_len + n1, sub, n2);
-    memcpy(s + s_len + n1 + n2, cap.ptr + cap.len, n3);
-    s[s_len + n1 + n2 + n3] = '\0';
+  }
+  for (i = 0; i < 2 * NUM_RE; i++) {
+    thread_match(i, scratch, thread_expected[i]);
+  }
 
-    buf += n > 0 ? n : len;
-    len -= n > 0 ? n : len;
-  } while (len > 0);
+  for (i = 0; i < NUM_THREADS; i++) {
+    failed[i] = 0;
+    if (pthread_create(&threads[i], NULL, thread_main, &failed[i]) != 0) {
+      return 0;
+    }
+  }
+  for (i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    total += failed[i];
+  }
 
-  return s;
+  return total == 0;
 }
+#endif
 
+/* Regex must have exactly one bracket pair */
 int main(void) {
   const char *msg = "";
   struct slre_cap caps[10];
@@ -501,6 +4677,28 @@ int main(void) {
   ASSERT(slre_match("[^\\s]+", "abc def", 7, NULL, 0, &msg) == 3);
   ASSERT(slre_match("[^fc]+", "abc def", 7, NULL, 0, &msg) == 2);
   ASSERT(slre_match("[^d\\sf]+", "abc def", 7, NULL, 0, &msg) == 3);
+  ASSERT(slre_match("[A-C]+", "abc", 3, NULL, 0, &msg) == 0);
+  ASSERT(slre_match("(?i)[a-c]+", "xABCd", 5, NULL, 0, &msg) == 4);
+  ASSERT(slre_match("(?i)[^a-c]+", "ABCdE", 5, NULL, 0, &msg) == 5);
+  ASSERT(slre_match("[$|]+", "a$|", 3, NULL, 0, &msg) == 3);
+  ASSERT(slre_match("[\\x41-]+", "-A", 2, NULL, 0, &msg) == 2);
+  ASSERT(slre_match("\\s", "\xa0\x85", 2, NULL, 0, &msg) == 0);
+  ASSERT(slre_match("\\S\\s\\d", "a\v1", 3, NULL, 0, &msg) == 3);
+  {
+    /* Escapes in classes give the same bytes as on their own */
+    char buf[1];
+    int ch;
+
+    for (ch = 0; ch < 256; ch++) {
+      buf[0] = (char) ch;
+      ASSERT(slre_match("[\\s]", buf, 1, NULL, 0, &msg) ==
+             (ch == ' ' || (ch >= '\t' && ch <= '\r')));
+      ASSERT(slre_match("[\\S]", buf, 1, NULL, 0, &msg) ==
+             !slre_match("\\s", buf, 1, NULL, 0, &msg));
+      ASSERT(slre_match("[\\d]", buf, 1, NULL, 0, &msg) ==
+             (ch >= '0' && ch <= '9'));
+    }
+  }
 
   /* Flags - case sensitivity */
   ASSERT(slre_match("FO", "foo", 3, NULL, 0, &msg) == 0);
@@ -539,6 +4737,10 @@ int main(void) {
   ASSERT(slre_match("\\x20", "_ J", 3, NULL, 0, &msg) == 2);
   ASSERT(slre_match("\\x4A", "_ J", 3, NULL, 0, &msg) == 3);
   ASSERT(slre_match("\\d+", "abc123def", 9, NULL, 0, &msg) == 6);
+  ASSERT(slre_match("[abc", "abc", 3, NULL, 0, &msg) == 0);
+  ASSERT(strcmp(msg, static_error_invalid_set) == 0);
+  ASSERT(slre_match("[\\_]", "_", 1, NULL, 0, &msg) == 0);
+  ASSERT(strcmp(msg, static_error_invalid_metacharacter) == 0);
 
   /* Balancing brackets */
   ASSERT(slre_match("(x))", "fooklmn", 7, NULL, 0, &msg) == 0);
@@ -592,6 +4794,1052 @@ int main(void) {
   ASSERT(slre_match("(|.c)", "abc", 3, caps, 10, &msg) == 3);
   ASSERT(caps[0].len == 2);
   ASSERT(memcmp(caps[0].ptr, "bc", 2) == 0);
+  ASSERT(slre_match("a|b", "a", 1, NULL, 0, &msg) == 1);
+  ASSERT(slre_match("(a|b)+", "abab", 4, caps, 10, &msg) == 4);
+  ASSERT(caps[0].len == 1);
+  ASSERT(caps[0].ptr[0] == 'b');
+  ASSERT(slre_match("(a|ab)c", "abc", 3, caps, 10, &msg) == 3);
+  ASSERT(caps[0].len == 2);
+  ASSERT(slre_match("a(x)?b", "ab", 2, caps, 10, &msg) == 2);
+  ASSERT(caps[0].ptr == NULL);
+
+  /* Backtracking into quantifiers, loops that match empty string */
+  ASSERT(slre_match("a?a", "a", 1, NULL, 0, &msg) == 1);
+  ASSERT(slre_match("a??b", "ab", 2, NULL, 0, &msg) == 2);
+  ASSERT(slre_match("(a*)+b", "b", 1, caps, 10, &msg) == 1);
+  ASSERT(caps[0].len == 0);
+  ASSERT(slre_match("(a*)*b", "aab", 3, NULL, 0, &msg) == 3);
+  ASSERT(slre_match("(a|)*b", "aab", 3, NULL, 0, &msg) == 3);
+  ASSERT(slre_match("(a+)+b", "aaab", 4, NULL, 0, &msg) == 4);
+
+  {
+    /* Alternations and loops rewritten by the optimizer */
+    struct slre_compiled re;
+
+    ASSERT(slre_compile("x|y|b", 0, &re, &msg) == 1);
+    ASSERT(re.num_insns == 2 && re.insns[0].op == I_CLASS);
+    ASSERT(slre_compile("abc|abd", 0, &re, &msg) == 1);
+    ASSERT(re.prefix_len == 2 && memcmp(re.prefix, "ab", 2) == 0);
+    ASSERT(slre_compile("\\d+\\s", 0, &re, &msg) == 1);
+    ASSERT(re.insns[1].c & SPLIT_POSSESSIVE);
+    ASSERT(slre_compile("\\d+\\d", 0, &re, &msg) == 1);
+    ASSERT(!(re.insns[1].c & SPLIT_POSSESSIVE));
+    ASSERT(slre_compile("a*^", 0, &re, &msg) == 1);
+    ASSERT(!(re.insns[0].c & SPLIT_POSSESSIVE));
+  }
+  {
+    /* Match lengths and required literals */
+    struct slre_compiled re;
+
+    ASSERT(slre_compile(".+/\\d+\\.\\d+\\.jpg$", 0, &re, &msg) == 1);
+    ASSERT(re.min_len == 9 && re.max_len == -1);
+    ASSERT(re.must_len == 4 && memcmp(re.must, ".jpg", 4) == 0);
+    ASSERT((re.flags & ENDS_AT_EOL) && (re.flags & MUST_AT_END));
+    ASSERT(slre_exec(&re, "x/1.23.jpg", 10, NULL, 0, &msg) == 10);
+    ASSERT(slre_exec(&re, "x/1.23.jpgx", 11, NULL, 0, &msg) == 0);
+    ASSERT(slre_compile("(ab|cb)d?[0-9]", 0, &re, &msg) == 1);
+    ASSERT(re.min_len == 3 && re.max_len == 4 && re.must_len == 1);
+    ASSERT(slre_exec(&re, "xxcb1", 5, NULL, 0, &msg) == 5);
+    ASSERT(slre_exec(&re, "xxcb", 4, NULL, 0, &msg) == 0);
+    ASSERT(slre_compile("x(abc|abd)+yz|wabcyz", 0, &re, &msg) == 1);
+    ASSERT(re.must_len == 2 && memcmp(re.must, "yz", 2) == 0);
+    ASSERT(slre_exec(&re, "xabdabcyz", 9, NULL, 0, &msg) == 9);
+    ASSERT(slre_exec(&re, "xabdabcy", 8, NULL, 0, &msg) == 0);
+    ASSERT(slre_compile("(?i)[a-z]+Foo", 0, &re, &msg) == 1);
+    ASSERT(re.must_len == 3 && memcmp(re.must, "foo", 3) == 0);
+    ASSERT(slre_exec(&re, "xFOO", 4, NULL, 0, &msg) == 4);
+    ASSERT(slre_exec(&re, "xFO", 3, NULL, 0, &msg) == 0);
+    ASSERT(slre_compile("\\d\\d?-$", SLRE_ANCHORED, &re, &msg) == 1);
+    ASSERT(re.min_len == 2 && re.max_len == 3 && (re.flags & ENDS_AT_EOL));
+    ASSERT(slre_exec(&re, "12-", 3, NULL, 0, &msg) == 3);
+    ASSERT(slre_exec(&re, "1-", 2, NULL, 0, &msg) == 2);
+    ASSERT(slre_exec(&re, "x12-", 4, NULL, 0, &msg) == 0);
+  }
+  {
+    /* Regex ending with $ is matched backwards first */
+    struct slre_compiled re;
+    struct slre_limits limits;
+    static char buf[4001];
+    int i, flags;
+
+    for (i = 0; i < (int) sizeof(buf) - 1; i++) buf[i] = "ab/"[i % 3];
+    memcpy(buf + sizeof(buf) - 10, "/x.tar.gz", 9);
+    memset(&limits, 0, sizeof(limits));
+    limits.max_steps = 2000;
+    for (flags = 0; flags <= SLRE_NFA; flags += SLRE_NFA) {
+      ASSERT(slre_compile("/([^/]+)\\.(gz|zst)$", flags, &re, &msg) == 1);
+      ASSERT(re.num_rev_insns == re.num_insns);
+      ASSERT(slre_exec_limited(&re, buf, sizeof(buf) - 1, caps, 10, &limits,
+                               &msg) == (int) sizeof(buf) - 1);
+      ASSERT(caps[0].len == 5 && memcmp(caps[0].ptr, "x.tar", 5) == 0);
+      ASSERT(caps[1].len == 2);
+      ASSERT(slre_exec_limited(&re, buf, sizeof(buf) - 2, caps, 10, &limits,
+                               &msg) == 0);
+      ASSERT(slre_compile("(a|b|)+c?$", flags, &re, &msg) == 1);
+      ASSERT(slre_exec(&re, "xabab", 5, caps, 10, &msg) == 5);
+      ASSERT(caps[0].ptr != NULL);
+      ASSERT(slre_compile("^a|b$", flags, &re, &msg) == 1);
+      ASSERT(re.num_rev_insns == 0);
+    }
+  }
+  {
+    /* Anchored regex where the next byte picks the way runs in one pass */
+    struct slre_compiled re;
+    struct slre_stats stats;
+    long mem[4];
+    int flags;
+
+    for (flags = 0; flags <= SLRE_NFA; flags += SLRE_NFA) {
+      ASSERT(slre_compile("^\\s*(GET|POST)\\s+(\\S+)\\s+HTTP/(\\d)\\.(\\d)",
+                          flags, &re, &msg) == 1);
+      ASSERT(re.flags & IS_ONE_PASS);
+      ASSERT(slre_exec_stats(&re, " POST /x HTTP/1.1\r\n", 19, caps, 10, &stats,
+                             &msg) == 17);
+      ASSERT(stats.engine == SLRE_ENGINE_ONE_PASS);
+      ASSERT(caps[0].len == 4 && caps[1].len == 2 && caps[3].ptr[0] == '1');
+      ASSERT(slre_compile("x(abc)?", flags | SLRE_ANCHORED, &re, &msg) == 1);
+      ASSERT(re.flags & IS_ONE_PASS);
+      ASSERT(slre_exec(&re, "xabd", 4, caps, 10, &msg) == 1);
+      ASSERT(caps[0].ptr == NULL);
+      ASSERT(slre_exec(&re, "xabc", 4, caps, 10, &msg) == 4);
+      ASSERT(caps[0].len == 3);
+      ASSERT(slre_exec(&re, "abc", 3, caps, 10, &msg) == 0);
+      ASSERT(slre_compile("(a|b)*?b", flags | SLRE_FULL_MATCH, &re,
+                          &msg) == 1);
+      ASSERT(!(re.flags & IS_ONE_PASS));
+      ASSERT(slre_compile("^(a*)a", flags, &re, &msg) == 1);
+      ASSERT(!(re.flags & IS_ONE_PASS));
+      ASSERT(slre_compile("^ab??", flags, &re, &msg) == 1);
+      ASSERT(!(re.flags & IS_ONE_PASS));
+      ASSERT(slre_compile("a|b", flags, &re, &msg) == 1);
+      ASSERT(!(re.flags & IS_ONE_PASS));
+    }
+
+    /* Without memory for fallback captures, other engines are used */
+    ASSERT(slre_compile("^(a)b", 0, &re, &msg) == 1);
+    ASSERT(re.flags & IS_ONE_PASS);
+    ASSERT(slre_exec_scratch(&re, "ab", 2, caps, 10, mem, 8, &msg) == 2);
+    ASSERT(caps[0].len == 1);
+  }
+  {
+    /* Counted repetition is a loop with a counter, see gen_count() */
+    static char buf[40001];
+    static struct slre_compiled re;
+    int i, flags;
+
+    for (flags = 0; flags <= SLRE_NFA; flags += SLRE_NFA) {
+      ASSERT(slre_compile("a{3}", flags, &re, &msg) == 1);
+      ASSERT(slre_exec(&re, "aaaa", 4, NULL, 0, &msg) == 3);
+      ASSERT(slre_exec(&re, "aab", 3, NULL, 0, &msg) == 0);
+      ASSERT(slre_compile("a{2,3}b", flags, &re, &msg) == 1);
+      ASSERT(slre_exec(&re, "aaaab", 5, NULL, 0, &msg) == 5);
+      ASSERT(slre_exec(&re, "xab", 3, NULL, 0, &msg) == 0);
+      ASSERT(slre_compile("(a|bc){2,}$", flags, &re, &msg) == 1);
+      ASSERT(slre_exec(&re, "xabcaa", 6, caps, 10, &msg) == 6);
+      ASSERT(caps[0].len == 1 && caps[0].ptr[0] == 'a');
+      ASSERT(slre_compile("(\\d{1,3})\\.\\d{1,3}?", flags, &re, &msg) == 1);
+      ASSERT(slre_exec(&re, "1234.567", 8, caps, 10, &msg) == 6);
+      ASSERT(caps[0].len == 3);
+      ASSERT(slre_compile("x{0}y", flags, &re, &msg) == 1);
+      ASSERT(slre_exec(&re, "xy", 2, NULL, 0, &msg) == 2);
+
+      /* Count does not take instructions, and works for every engine */
+      for (i = 0; i < 300; i++) buf[i] = "abc"[i % 3];
+      ASSERT(slre_compile("(abc){100}", flags, &re, &msg) == 1);
+      ASSERT(re.num_insns < 12 && re.num_counters == 1);
+      ASSERT(slre_exec(&re, buf, 300, caps, 10, &msg) == 300);
+      ASSERT(caps[0].ptr == buf + 297 && caps[0].len == 3);
+      ASSERT(slre_exec(&re, buf, 300, NULL, 0, &msg) == 300);
+      ASSERT(slre_exec(&re, buf + 3, 297, caps, 10, &msg) == 0);
+      ASSERT(slre_exec(&re, buf + 3, 297, NULL, 0, &msg) == 0);
+      ASSERT(slre_compile("c{3,200}", flags, &re, &msg) == 1);
+      ASSERT(re.num_insns < 8 && re.min_len == 3 && re.max_len == 200);
+
+      /* Too many states for NFA and DFA fall back to backtracking */
+      memset(buf, 'a', sizeof(buf) - 1);
+      ASSERT(slre_compile("(a{200}){200}", flags, &re, &msg) == 1);
+      ASSERT(slre_exec(&re, buf, 40000, NULL, 0, &msg) == 40000);
+      ASSERT(slre_exec(&re, buf, 40000, caps, 10, &msg) == 40000);
+      ASSERT(caps[0].ptr == buf + 39800 && caps[0].len == 200);
+      ASSERT(slre_exec(&re, buf, 39999, NULL, 0, &msg) == 0);
+    }
+
+    ASSERT(engines_agree("(a|ab){2,3}c", "abababc"));
+    ASSERT(engines_agree("(a|ab){2,3}?(c?)", "aababc"));
+    ASSERT(engines_agree("((ab){2}c){2}", "xababcababcc"));
+    ASSERT(engines_agree("(a*){3}b", "aab"));
+    ASSERT(engines_agree("(a?){2,4}?b", "aaab"));
+    ASSERT(engines_agree("(x{1,2}|y){2,}?z", "xxxyxz"));
+    ASSERT(engines_agree("^(\\d{1,3}\\.){3}(\\d{1,3})$", "10.0.200.1"));
+    ASSERT(slre_compile("((((((a{2}){2}){2}){2}){2}){2}){2}", 0, &re,
+                        &msg) == 1);
+    ASSERT(slre_exec(&re, buf, 200, NULL, 0, &msg) == 128);
+    ASSERT(slre_compile("((a{30000}){30000}){30000}", 0, &re, &msg) == 1);
+    ASSERT(re.min_len > 40000 && re.max_len == -1);
+    ASSERT(slre_exec(&re, buf, 40000, NULL, 0, &msg) == 0);
+
+    ASSERT(slre_compile("\\d{3}-\\d{2,4}", 0, &re, &msg) == 1);
+    ASSERT(re.min_len == 6 && re.max_len == 8);
+    ASSERT(slre_compile("(ab){3}c", 0, &re, &msg) == 1);
+    ASSERT(re.prefix_len == 7 && memcmp(re.prefix, "abababc", 7) == 0);
+    ASSERT(slre_compile("[a-z]+(-xy){2,}", 0, &re, &msg) == 1);
+    ASSERT(re.min_len == 7 && re.max_len == -1);
+    ASSERT(re.must_len == 6 && memcmp(re.must, "-xy-xy", 6) == 0);
+
+    /* Braces that do not make a count are literal */
+    ASSERT(slre_match("a{,2}", "a{,2}", 5, NULL, 0, &msg) == 5);
+    ASSERT(slre_match("{{.+?}}", "x{{a}}", 6, NULL, 0, &msg) == 6);
+    ASSERT(slre_match("\\{1\\}", "{1}", 3, NULL, 0, &msg) == 3);
+    ASSERT(slre_match("{2}", "a", 1, NULL, 0, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_unexpected_quantifier) == 0);
+    ASSERT(slre_match("a{3,2}", "a", 1, NULL, 0, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_invalid_count) == 0);
+    ASSERT(slre_match("a{99999}", "a", 1, NULL, 0, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_invalid_count) == 0);
+    ASSERT(slre_match("a{32767}", "a", 1, NULL, 0, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_no_match) == 0);
+  }
+  {
+    /* UTF-8 characters are compiled into byte sequences */
+    struct slre_compiled re;
+    int flags;
+
+    for (flags = 0; flags <= SLRE_NFA; flags += SLRE_NFA) {
+      ASSERT(slre_compile("^(.)(.)$", flags | SLRE_UTF8, &re, &msg) == 1);
+      ASSERT(re.min_len == 2 && re.max_len == 8);
+      ASSERT(slre_exec(&re, "a\xc3\xa9", 3, caps, 10, &msg) == 3);
+      ASSERT(caps[0].len == 1 && caps[1].len == 2);
+      ASSERT(slre_exec(&re, "\xf0\x9f\x98\x80\xe2\x82\xac", 7, NULL, 0,
+                       &msg) == 7);
+      ASSERT(slre_exec(&re, "a\xff", 2, caps, 10, &msg) == 0);
+      ASSERT(slre_exec(&re, "a\xed\xa0\x80", 4, NULL, 0, &msg) == 0);
+      ASSERT(slre_compile("([\xd0\xb0-\xd1\x8f]+)", flags | SLRE_UTF8, &re,
+                          &msg) == 1);
+      ASSERT(slre_exec(&re, "\xd0\x9f\xd1\x80\xd0\xb8!", 7, caps, 10,
+                       &msg) == 6);
+      ASSERT(caps[0].len == 4);
+      ASSERT(slre_compile("^\xc3\xa9+\\xe9", flags | SLRE_UTF8, &re,
+                          &msg) == 1);
+      ASSERT(slre_exec(&re, "\xc3\xa9\xc3\xa9\xc3\xa9", 6, NULL, 0,
+                       &msg) == 6);
+      ASSERT(slre_compile("\"([^\"]*)\"", flags | SLRE_UTF8, &re, &msg) == 1);
+      ASSERT(slre_exec(&re, "x=\"caf\xc3\xa9 au lait\"", 17, caps, 10,
+                       &msg) == 17);
+      ASSERT(caps[0].len == 13);
+      ASSERT(slre_compile("(?i)(\\S+) [^A]", flags | SLRE_UTF8, &re,
+                          &msg) == 1);
+      ASSERT(slre_exec(&re, "na\xc3\xafve b", 8, caps, 10, &msg) == 8);
+      ASSERT(caps[0].len == 6);
+      ASSERT(slre_exec(&re, "na\xc3\xafve a", 8, caps, 10, &msg) == 0);
+    }
+
+    /* ASCII part of a character is a simple loop of its own */
+    ASSERT(slre_compile(".*", SLRE_UTF8, &re, &msg) == 1);
+    ASSERT(re.insns[0].op == I_SPLIT && (re.insns[0].c & SPLIT_SIMPLE_LOOP));
+    ASSERT(re.insns[1].op == I_CLASS);
+    ASSERT(slre_compile("[a-z]+", SLRE_UTF8, &re, &msg) == 1);
+    ASSERT(re.num_insns == 5);
+    ASSERT(slre_compile("\xc3", SLRE_UTF8, &re, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_invalid_utf8) == 0);
+    ASSERT(slre_compile("[a\xe2\x82]", SLRE_UTF8, &re, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_invalid_utf8) == 0);
+  }
+  ASSERT(slre_match("(?i)k|x|Y", "y", 1, NULL, 0, &msg) == 1);
+  ASSERT(slre_match("a.b|a.c|ad", "xadad", 5, caps, 10, &msg) == 3);
+  ASSERT(slre_match("(ab|a)(bc|c)", "abc", 3, caps, 10, &msg) == 3);
+  ASSERT(caps[0].len == 2 && caps[1].len == 1);
+  ASSERT(slre_match("(a|ab)(c|bcd)", "abcd", 4, caps, 10, &msg) == 4);
+  ASSERT(caps[0].len == 1 && caps[1].len == 3);
+  ASSERT(slre_match("ab|a|abc", "abc", 3, NULL, 0, &msg) == 2);
+  ASSERT(slre_match("\\d+\\s", "12 34", 5, caps, 10, &msg) == 3);
+  ASSERT(slre_match("(a*)$", "baa", 3, caps, 10, &msg) == 3);
+  ASSERT(caps[0].len == 2);
+
+  /* Compile once, execute many times */
+  {
+    struct slre_compiled re;
+
+    ASSERT(slre_compile("(?i)(b+)c", 0, &re, &msg) == 1);
+    ASSERT(slre_exec(&re, "aBbc", 4, caps, 10, &msg) == 4);
+    ASSERT(caps[0].len == 2);
+    ASSERT(memcmp(caps[0].ptr, "Bb", 2) == 0);
+    ASSERT(slre_exec(&re, "bcbbc", 5, NULL, 0, &msg) == 2);
+    ASSERT(slre_exec(&re, "xyz", 3, NULL, 0, &msg) == 0);
+    ASSERT(slre_compile("(x))", 0, &re, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_unbalanced_brackets) == 0);
+  }
+
+  {
+    /* Anchored and full-buffer matching without ^ and $ in the regex */
+    struct slre_compiled re;
+    int flags;
+
+    for (flags = 0; flags <= SLRE_NFA; flags += SLRE_NFA) {
+      ASSERT(slre_compile("b+|c", flags | SLRE_ANCHORED, &re, &msg) == 1);
+      ASSERT(slre_exec(&re, "bbc", 3, NULL, 0, &msg) == 2);
+      ASSERT(slre_exec(&re, "cb", 2, NULL, 0, &msg) == 1);
+      ASSERT(slre_exec(&re, "abb", 3, NULL, 0, &msg) == 0);
+      ASSERT(slre_compile("(b+|c)", flags | SLRE_FULL_MATCH, &re,
+                          &msg) == 1);
+      ASSERT(slre_exec(&re, "bbb", 3, caps, 10, &msg) == 3);
+      ASSERT(caps[0].len == 3);
+      ASSERT(slre_exec(&re, "c", 1, NULL, 0, &msg) == 1);
+      ASSERT(slre_exec(&re, "bbc", 3, NULL, 0, &msg) == 0);
+      ASSERT(slre_exec(&re, "abb", 3, NULL, 0, &msg) == 0);
+      ASSERT(slre_compile("(?i)a|b", flags | SLRE_FULL_MATCH, &re,
+                          &msg) == 1);
+      ASSERT(slre_exec(&re, "A", 1, NULL, 0, &msg) == 1);
+      ASSERT(slre_exec(&re, "ab", 2, NULL, 0, &msg) == 0);
+    }
+  }
+
+  {
+    /* Scratch memory supplied by the caller */
+    struct slre_compiled re;
+    struct slre_stats stats;
+    long mem[1024], *big;
+    int n;
+
+    ASSERT(slre_compile("(a+)(b|c)*d", SLRE_NFA, &re, &msg) == 1);
+    n = slre_scratch_size(&re);
+    ASSERT(n > 0 && n < (int) sizeof(mem) && n < SLRE_SCRATCH_SIZE);
+    ASSERT(slre_exec_scratch(&re, "xaacbd", 6, caps, 10, mem, n, &msg) == 6);
+    ASSERT(caps[0].len == 2 && caps[1].len == 1 && caps[1].ptr[0] == 'b');
+    ASSERT(slre_exec_scratch(&re, "xaacbd", 6, NULL, 0, (char *) mem + 1, n,
+                             &msg) == 6);
+
+    /* Backtracking needs memory only for capture slots, so runs instead */
+    ASSERT(slre_exec_scratch(&re, "xaacbd", 6, caps, 10, mem, 16, &msg) == 6);
+    ASSERT(caps[0].len == 2 && caps[1].len == 1 && caps[1].ptr[0] == 'b');
+    ASSERT(slre_compile("(a)b", 0, &re, &msg) == 1);
+    ASSERT(slre_exec_scratch(&re, "ab", 2, caps, 10, mem, 16, &msg) == 2);
+    ASSERT(slre_exec_scratch(&re, "ab", 2, caps, 10, mem, 0, &msg) == 0);
+
+    /* Default stack scratch is sized for typical regexes, see slre.h */
+    ASSERT(slre_compile("^(\\S+) (\\S+) \\[([^]]+)\\] \"(\\S+) (\\S+)\" "
+                        "(\\d+) (\\d+)$", SLRE_NFA, &re, &msg) == 1);
+    ASSERT(slre_scratch_size(&re) <= SLRE_SCRATCH_SIZE);
+    ASSERT(slre_compile("\"([^\"]*)\"", SLRE_UTF8 | SLRE_NFA, &re, &msg) == 1);
+    ASSERT(slre_scratch_size(&re) <= SLRE_SCRATCH_SIZE);
+
+    /* Longer program needs the caller's memory for NFA with captures */
+    ASSERT(slre_compile("(.)+ (.)(.)(.)$", SLRE_UTF8 | SLRE_NFA, &re,
+                        &msg) == 1);
+    ASSERT(slre_scratch_size(&re) > SLRE_SCRATCH_SIZE);
+    ASSERT(slre_exec_stats(&re, "ab cde", 6, caps, 10, &stats, &msg) == 6);
+    ASSERT(stats.engine == SLRE_ENGINE_BACKTRACK);
+    ASSERT(caps[0].len == 1 && caps[0].ptr[0] == 'b');
+    ASSERT(slre_exec(&re, "ab cde", 6, NULL, 0, &msg) == 6);
+    n = slre_scratch_size(&re);
+    ASSERT((big = (long *) malloc(n)) != NULL);
+    ASSERT(slre_exec_scratch(&re, "ab cde", 6, caps, 10, big, n, &msg) == 6);
+    ASSERT(caps[0].len == 1 && caps[0].ptr[0] == 'b');
+    free(big);
+  }
+
+  {
+    /* Saved regex is used in place */
+    static struct slre_compiled re, re2;
+    static long buf[1024], buf2[1024];
+    const struct slre_compiled *loaded;
+    struct saved_header *header;
+    struct slre_compiled *prog;
+    int i, n;
+
+    n = slre_save(&re, NULL, 0);
+    ASSERT(n > (int) sizeof(re) && n < (int) sizeof(buf));
+    memset(&re2, 0xff, sizeof(re2));
+    ASSERT(slre_compile("/([^/]+)\\.(gz|zst)$", 0, &re, &msg) == 1);
+    ASSERT(slre_compile("/([^/]+)\\.(gz|zst)$", 0, &re2, &msg) == 1);
+    ASSERT(slre_save(&re, buf, n - 1) == n);
+    ASSERT(slre_save(&re, buf, n) == n && slre_save(&re2, buf2, n) == n);
+    ASSERT(memcmp(buf, buf2, n) == 0);
+    ASSERT((loaded = slre_load(buf, n, &msg)) != NULL);
+    ASSERT((const char *) loaded > (const char *) buf &&
+           (const char *) loaded < (const char *) buf + n);
+    ASSERT(slre_exec(loaded, "a/x.tar.gz", 10, caps, 10, &msg) == 10);
+    ASSERT(caps[0].len == 5 && caps[1].len == 2);
+
+    ASSERT(slre_load(buf, n - 1, &msg) == NULL);
+    ASSERT(strcmp(msg, static_error_saved_build) == 0);
+    ASSERT(slre_load((char *) buf2 + 1, n, &msg) == NULL);
+    header = (struct saved_header *) (void *) buf2;
+    header->version++;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    header->version--;
+    prog = (struct slre_compiled *) (header + 1);
+    prog->num_classes = 0;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    ASSERT(strcmp(msg, static_error_saved_invalid) == 0);
+
+    /* Forward and reversed programs must not jump into each other */
+    memcpy(buf2, buf, n);
+    ASSERT(prog->num_rev_insns > 0);
+    for (i = prog->num_insns; prog->insns[i].op != I_SPLIT; i++) {
+    }
+    prog->insns[i].y = 0;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    ASSERT(strcmp(msg, static_error_saved_invalid) == 0);
+    memcpy(buf2, buf, n);
+    for (i = 0; prog->insns[i].op != I_SPLIT; i++) {
+    }
+    prog->insns[i].x = (unsigned short) prog->num_insns;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    ASSERT(strcmp(msg, static_error_saved_invalid) == 0);
+    memcpy(buf2, buf, n);
+    for (i = 0; prog->insns[i].op != I_MATCH; i++) {
+    }
+    prog->insns[i].op = I_ANY;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    ASSERT(strcmp(msg, static_error_saved_invalid) == 0);
+
+    /* Flags and hints must be what slre_compile() gives */
+    memcpy(buf2, buf, n);
+    prog->flags |= IS_ONE_PASS << 1;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    ASSERT(strcmp(msg, static_error_saved_invalid) == 0);
+    memcpy(buf2, buf, n);
+    prog->flags ^= IS_ONE_PASS;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    memcpy(buf2, buf, n);
+    prog->flags ^= CAN_SKIP;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    memcpy(buf2, buf, n);
+    for (i = 0; prog->insns[i].op != I_SPLIT; i++) {
+    }
+    prog->insns[i].c ^= SPLIT_POSSESSIVE;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    ASSERT(strcmp(msg, static_error_saved_invalid) == 0);
+    memcpy(buf2, buf, n);
+    prog->byte_classes['/'] = prog->byte_classes['.'];
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+
+    /* Nor may it loop without consuming a byte */
+    memcpy(buf2, buf, n);
+    for (i = 0; prog->insns[i].op != I_JMP; i++) {
+    }
+    prog->insns[i].x = (unsigned short) i;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    ASSERT(strcmp(msg, static_error_saved_invalid) == 0);
+    memcpy(buf2, buf, n);
+    for (i = 0; prog->insns[i].op != I_JMP; i++) {
+    }
+    prog->insns[i].x = 0;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    memcpy(buf2, buf, n);
+    ASSERT(slre_load(buf2, n, &msg) != NULL);
+  }
+
+  {
+    /* Loop that may match nothing must keep its I_CHECK */
+    static struct slre_compiled re;
+    static long buf[1024], buf2[1024];
+    struct slre_compiled *prog;
+    int i, n;
+
+    ASSERT(slre_compile("(a|)+b", 0, &re, &msg) == 1);
+    n = slre_save(&re, buf, sizeof(buf));
+    prog = (struct slre_compiled *) (void *) ((struct saved_header *)
+                                              (void *) buf2 + 1);
+    memcpy(buf2, buf, n);
+    ASSERT(slre_load(buf2, n, &msg) != NULL);
+    for (i = 0; prog->insns[i].op != I_CHECK; i++) {
+    }
+    prog->insns[i].op = I_JMP;
+    prog->insns[i].x = (unsigned short) (i + 1);
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    ASSERT(strcmp(msg, static_error_saved_invalid) == 0);
+    memcpy(buf2, buf, n);
+    for (i = 0; prog->insns[i].op != I_MARK || prog->insns[i].c != 0; i++) {
+    }
+    prog->insns[i].op = I_JMP;
+    prog->insns[i].x = 0;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    memcpy(buf2, buf, n);
+    for (i = 0; prog->insns[i].op != I_MARK || prog->insns[i].c != 0; i++) {
+    }
+    prog->insns[i + 1].x = (unsigned short) i;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+  }
+
+  {
+    /* Loop counter must be used the way gen_count() lays it out */
+    static struct slre_compiled re;
+    static long buf[1024], buf2[1024];
+    const struct slre_compiled *loaded;
+    struct slre_compiled *prog;
+    int i, n;
+
+    ASSERT(slre_compile("x(ab){2,3}?y", 0, &re, &msg) == 1);
+    n = slre_save(&re, buf, sizeof(buf));
+    ASSERT((loaded = slre_load(buf, n, &msg)) != NULL);
+    ASSERT(slre_exec(loaded, "xabababy", 8, caps, 10, &msg) == 8);
+    ASSERT(caps[0].ptr[0] == 'a' && caps[0].len == 2);
+    prog = (struct slre_compiled *) (void *) ((struct saved_header *)
+                                              (void *) buf2 + 1);
+    for (i = 0; re.insns[i].op != I_REPEAT; i++) {
+    }
+
+    memcpy(buf2, buf, n);
+    prog->insns[i].x = 4;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    ASSERT(strcmp(msg, static_error_saved_invalid) == 0);
+    memcpy(buf2, buf, n);
+    prog->insns[i].c = 1;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    memcpy(buf2, buf, n);
+    prog->num_counters = 0;
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    memcpy(buf2, buf, n);
+    prog->insns[i + 1].x = (unsigned short) (i + 3);
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    memcpy(buf2, buf, n);
+    prog->insns[re.insns[i + 1].x - 1].x = (unsigned short) (i + 2);
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+
+    /* Getting into the loop past its REPEAT would skip the reset */
+    memcpy(buf2, buf, n);
+    prog->insns[i - 1].op = I_JMP;
+    prog->insns[i - 1].x = (unsigned short) (i + 2);
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+    memcpy(buf2, buf, n);
+    prog->insns[i + 3].op = I_JMP;
+    prog->insns[i + 3].x = (unsigned short) (i + 1);
+    ASSERT(slre_load(buf2, n, &msg) == NULL);
+  }
+
+  {
+    /* Reversed program of a nullable loop uses no loop registers */
+    static const char *regexes[] = {"(a?)*$", "x(\\d*)+\\.gz$", "(a|)+b$"};
+    static const char *bufs[] = {"baa", "ax12x3.gz", "aab", "b.gz"};
+    static struct slre_compiled re;
+    static long buf[1024];
+    const struct slre_compiled *loaded;
+    struct slre_cap caps2[10];
+    int i, j, k, n, flags;
+
+    for (i = 0; i < (int) ARRAY_SIZE(regexes); i++) {
+      for (flags = 0; flags <= SLRE_NFA; flags += SLRE_NFA) {
+        ASSERT(slre_compile(regexes[i], flags, &re, &msg) == 1);
+        ASSERT(re.num_rev_insns > 0);
+        for (k = re.num_insns; k < re.num_insns + re.num_rev_insns; k++) {
+          ASSERT(re.insns[k].op != I_MARK && re.insns[k].op != I_CHECK);
+        }
+        n = slre_save(&re, buf, sizeof(buf));
+        ASSERT((loaded = slre_load(buf, n, &msg)) != NULL);
+        for (j = 0; j < (int) ARRAY_SIZE(bufs); j++) {
+          k = (int) strlen(bufs[j]);
+          ASSERT(slre_exec(loaded, bufs[j], k, caps, 10, &msg) ==
+                 slre_exec(&re, bufs[j], k, caps2, 10, &msg));
+          ASSERT(caps[0].ptr == caps2[0].ptr && caps[0].len == caps2[0].len);
+        }
+      }
+    }
+    ASSERT(slre_compile("x(\\d*)+\\.gz$", 0, &re, &msg) == 1);
+    ASSERT(slre_exec(&re, "ax12x3.gz", 9, caps, 10, &msg) == 9);
+    ASSERT(caps[0].len == 1 && caps[0].ptr[0] == '3');
+  }
+
+  {
+    /* Limits of work: steps, recursion depth and deadline */
+    static char buf[3000];
+    struct slre_compiled re;
+    struct slre_limits limits;
+    int i, calls = 0;
+
+    for (i = 0; i < (int) sizeof(buf) - 1; i++) buf[i] = "ab"[i % 3 % 2];
+    memset(&limits, 0, sizeof(limits));
+    ASSERT(slre_compile("(a|b)*[cd]", 0, &re, &msg) == 1);
+    ASSERT(slre_exec_limited(&re, buf, 100, caps, 10, &limits, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_no_match) == 0);
+    limits.max_steps = 1000;
+    ASSERT(slre_exec_limited(&re, buf, 100, caps, 10, &limits, &msg) == -1);
+    ASSERT(strcmp(msg, static_error_limit) == 0);
+    ASSERT(slre_exec_limited(&re, "abc", 3, caps, 10, &limits, &msg) == 3);
+    limits.max_steps = 0;
+    limits.max_depth = 50;
+    ASSERT(slre_exec_limited(&re, buf, 100, caps, 10, &limits, &msg) == -1);
+    ASSERT(strcmp(msg, static_error_limit) == 0);
+    ASSERT(slre_exec_limited(&re, "abc", 3, caps, 10, &limits, &msg) == 3);
+
+    /* Without captures, groups are not tracked and need no recursion */
+    limits.max_depth = 6;
+    ASSERT(slre_compile("(x*)*(a)(b)(c)(d)", 0, &re, &msg) == 1);
+    ASSERT(slre_exec_limited(&re, "zabcd", 5, NULL, 0, &limits, &msg) == 5);
+    ASSERT(slre_exec_limited(&re, "zabcd", 5, caps, 10, &limits, &msg) == -1);
+
+    /* NFA and DFA engines count steps too */
+    limits.max_depth = 0;
+    limits.is_expired = count_calls;
+    limits.arg = &calls;
+    ASSERT(slre_compile("(a|b|ab)*[cd]", SLRE_NFA, &re, &msg) == 1);
+    ASSERT(slre_exec_limited(&re, buf, 2999, caps, 10, &limits, &msg) == -1);
+    ASSERT(calls == 3);
+    limits.is_expired = NULL;
+    limits.max_steps = 2000;
+    ASSERT(slre_exec_limited(&re, buf, 2999, NULL, 0, &limits, &msg) == -1);
+    ASSERT(slre_exec_limited(&re, buf, 1000, NULL, 0, &limits, &msg) == 0);
+
+    /* No limits at all, same as slre_exec() */
+    ASSERT(slre_exec_limited(&re, buf, 2999, caps, 10, NULL, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_no_match) == 0);
+    ASSERT(slre_exec_limited(&re, "abc", 3, caps, 10, NULL, &msg) == 3);
+  }
+
+  {
+    /* Work counters, engine is reported even without SLRE_STATS */
+    struct slre_compiled re;
+    struct slre_stats stats;
+
+    ASSERT(slre_compile("(x|y)+z", 0, &re, &msg) == 1);
+    ASSERT(slre_exec_stats(&re, "abxyz", 5, caps, 10, &stats, &msg) == 5);
+    ASSERT(stats.engine == SLRE_ENGINE_BACKTRACK);
+    ASSERT(slre_exec_stats(&re, "abxyz", 5, NULL, 0, &stats, &msg) == 5);
+    ASSERT(stats.engine == SLRE_ENGINE_DFA);
+    ASSERT(slre_compile("a(b|bc)d", SLRE_NFA, &re, &msg) == 1);
+    ASSERT(slre_exec_stats(&re, "xabcd", 5, caps, 10, &stats, &msg) == 5);
+    ASSERT(stats.engine == SLRE_ENGINE_NFA);
+#ifdef SLRE_STATS
+    ASSERT(stats.starts == 2 && stats.bytes_skipped == 1);
+    ASSERT(stats.bytes == 4 && stats.threads > 4);
+    ASSERT(slre_compile("a(b|bc)d", 0, &re, &msg) == 1);
+    ASSERT(slre_exec_stats(&re, "xabcd", 5, caps, 10, &stats, &msg) == 5);
+    ASSERT(stats.starts == 1 && stats.branches == 1 && stats.backtracks == 1);
+    ASSERT(stats.recursions > 1 && stats.bytes == 5);
+    ASSERT(slre_exec_stats(&re, "xabcd", 5, NULL, 0, &stats, &msg) == 5);
+    ASSERT(stats.dfa_states > 1 && stats.bytes == 4);
+#else
+    ASSERT(stats.starts == 0 && stats.bytes == 0);
+#endif
+
+    /* Without stats, same as slre_exec() */
+    ASSERT(slre_exec_stats(&re, "xabcd", 5, caps, 10, NULL, &msg) == 5);
+    ASSERT(caps[0].len == 2);
+    ASSERT(slre_exec_stats(&re, "xbcd", 4, NULL, 0, NULL, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_no_match) == 0);
+  }
+
+  {
+    /* Batch of buffers, with and without captures */
+    static const char *ids[] = { "id-12", "id-", "x-1", "ID-7", "id-345x" };
+    struct slre_compiled re;
+    struct slre_cap bufs[5], batch_caps[5 * 2];
+    int i, results[5];
+
+    for (i = 0; i < 5; i++) {
+      bufs[i].ptr = ids[i];
+      bufs[i].len = (int) strlen(ids[i]);
+    }
+    ASSERT(slre_compile("^([a-z]+)-(\\d+)$", 0, &re, &msg) == 1);
+    ASSERT(slre_exec_batch(&re, bufs, 5, results, NULL, 0, NULL, 0,
+                           &msg) == 2);
+    ASSERT(results[0] == 5 && results[1] == 0 && results[2] == 3);
+    ASSERT(results[3] == 0 && results[4] == 0);
+    ASSERT(slre_exec_batch(&re, bufs, 5, results, batch_caps, 2, NULL, 0,
+                           &msg) == 2);
+    ASSERT(batch_caps[1].len == 2 && batch_caps[4].ptr == ids[2]);
+    ASSERT(batch_caps[5].ptr == ids[2] + 2 && batch_caps[5].len == 1);
+    ASSERT(slre_exec_batch(&re, bufs + 1, 1, results, NULL, 0, NULL, 0,
+                           &msg) == 0);
+    ASSERT(strcmp(msg, static_error_no_match) == 0);
+    ASSERT(slre_exec_batch(&re, bufs, 5, results, batch_caps, 1, NULL, 0,
+                           &msg) == -1);
+    ASSERT(strcmp(msg, static_error_more_caps) == 0);
+
+    /* Loop counters start at 0 for every buffer of the shared DFA */
+    bufs[0].ptr = bufs[1].ptr = "bacb";
+    bufs[0].len = bufs[1].len = 4;
+    bufs[2].ptr = "abab";
+    bufs[2].len = 4;
+    ASSERT(slre_compile("[ab]{3}", 0, &re, &msg) == 1);
+    ASSERT(slre_exec_batch(&re, bufs, 3, results, NULL, 0, NULL, 0,
+                           &msg) == 1);
+    ASSERT(results[0] == 0 && results[1] == 0 && results[2] == 3);
+  }
+
+#if SLRE_CACHE_SIZE > 0
+  {
+    /* Regexes compiled by slre_match() are cached, then evicted */
+    struct slre_compiled re;
+    char regex[20], buf[20];
+    int i, j;
+
+    for (j = 0; j < 3; j++) {
+      for (i = 0; i < 3 * SLRE_CACHE_SIZE; i++) {
+        sprintf(regex, "(a+)%d", i % (SLRE_CACHE_SIZE + 2));
+        sprintf(buf, "xaa%d", i % (SLRE_CACHE_SIZE + 2));
+        ASSERT(slre_match(regex, buf, strlen(buf), caps, 10, &msg) ==
+               (int) strlen(buf));
+        ASSERT(caps[0].len == 2);
+      }
+    }
+    ASSERT(cache_get(regex, &re) == 1);
+    ASSERT(slre_match("(", "", 0, NULL, 0, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_unbalanced_brackets) == 0);
+    ASSERT(slre_match("(", "", 0, NULL, 0, &msg) == 0);
+    ASSERT(cache_get("(", &re) == 0);
+  }
+#endif
+
+  /* NFA engine */
+  ASSERT(engines_agree("(?i)[abc]", "1C2"));
+  ASSERT(engines_agree("[^\\d]+", "abc123"));
+  ASSERT(engines_agree(".+k.", "fooklmn"));
+  ASSERT(engines_agree("^o", "fooklmn"));
+  ASSERT(engines_agree("n$", "fooklmn"));
+  ASSERT(engines_agree("l$", "fooklmn"));
+  ASSERT(engines_agree("a?", "fooklmn"));
+  ASSERT(engines_agree("(.*(2.))", "123"));
+  ASSERT(engines_agree("(\\d+)\\s+(\\S+)", "12 hi"));
+  ASSERT(engines_agree("ab(cd)+?.", "abcdcdef"));
+  ASSERT(engines_agree("(.+/\\d+\\.\\d+)\\.jpg$", "/foo/bar/12.34.jpg"));
+  ASSERT(engines_agree(".+?c", "abcabc"));
+  ASSERT(engines_agree("bc.d?k?b+", "abcabc"));
+  ASSERT(engines_agree("|.", "abc"));
+  ASSERT(engines_agree("k(xx|yy)|ca|bc", "abcabc"));
+  ASSERT(engines_agree("(|.c)", "abc"));
+  ASSERT(engines_agree("(a|ab)c", "abc"));
+  ASSERT(engines_agree("a(x)?b", "ab"));
+  ASSERT(engines_agree("({{.+?}})", "Hi, {{foo}}. How are you, {{bar}}?"));
+  ASSERT(engines_agree("^\\s*(\\S+)\\s+(\\S+)\\s+HTTP/(\\d)\\.(\\d)",
+                       " GET /index.html HTTP/1.0\r\n\r\n"));
+  ASSERT(engines_agree("(?i)((https?://)[^\\s/'\"<>]+/?[^\\s'\"<>]*)",
+                       "<img src=\"HTTPS://FOO.COM/x?b#c=tab1\"/> "));
+  {
+    /* DFA cache thrashes on this regex, and falls back to NFA */
+    static char buf[5000];
+    const char *regex = "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)c";
+    unsigned long i, seed = 1;
+
+    for (i = 0; i < sizeof(buf) - 1; i++) {
+      seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+      buf[i] = (seed >> 16) & 1 ? 'a' : 'b';
+    }
+    ASSERT(engines_agree(regex, buf));
+    buf[sizeof(buf) - 10] = 'a';
+    buf[sizeof(buf) - 2] = 'c';
+    ASSERT(engines_agree(regex, buf));
+    ASSERT(slre_match(regex, buf, strlen(buf), NULL, 0, &msg) ==
+           (int) sizeof(buf) - 1);
+  }
+
+  {
+    /* Literal prefix is used to skip offsets where match cannot start */
+    struct slre_compiled re;
+
+    ASSERT(slre_compile("HTTP/(\\d)", 0, &re, NULL) == 1);
+    ASSERT(re.prefix_len == 5 && memcmp(re.prefix, "HTTP/", 5) == 0);
+    ASSERT(slre_compile("(ab)+c", 0, &re, NULL) == 1);
+    ASSERT(re.prefix_len == 2);
+    ASSERT(slre_compile("(?i)-aB", 0, &re, NULL) == 1);
+    ASSERT(re.prefix_len == 3 && memcmp(re.prefix, "-ab", 3) == 0);
+    ASSERT(slre_compile("^abc", 0, &re, NULL) == 1);
+    ASSERT(re.prefix_len == 0);
+    ASSERT(slre_compile("a*b", 0, &re, NULL) == 1);
+    ASSERT(re.prefix_len == 0);
+
+    ASSERT(slre_match("HTTP/(\\d)", "xx HTTP HTTP/1", 14, caps, 10,
+                      NULL) == 14);
+    ASSERT(caps[0].len == 1 && caps[0].ptr[0] == '1');
+    ASSERT(slre_match("aab", "aaab", 4, NULL, 0, NULL) == 4);
+    ASSERT(slre_match("aab", "aaab", 4, caps, 10, NULL) == 4);
+    ASSERT(slre_match("(?i)aab", "AAAB", 4, NULL, 0, NULL) == 4);
+    ASSERT(slre_match("ab", "aaaa", 4, NULL, 0, NULL) == 0);
+    ASSERT(slre_match("ab$", "ab ab", 5, NULL, 0, NULL) == 5);
+    ASSERT(engines_agree("ab(a|b)*", "bbabba"));
+    ASSERT(engines_agree("(ab)+", "aababab"));
+    ASSERT(engines_agree("b$", "abab"));
+  }
+
+  {
+    /* Case is folded at compile time, prefix is searched in either case */
+    struct slre_compiled re;
+    char buf[100];
+    int i;
+
+    ASSERT(slre_compile("(?i)X@", 0, &re, NULL) == 1);
+    ASSERT(re.insns[0].op == I_CHAR && re.insns[0].c == 'x' &&
+           re.insns[0].y == 1);
+    ASSERT(re.insns[1].op == I_CHAR && re.insns[1].y == 0);
+    ASSERT(slre_exec(&re, "x`X@", 4, NULL, 0, NULL) == 4);
+    ASSERT(slre_exec(&re, "X`x`", 4, NULL, 0, NULL) == 0);
+
+    ASSERT(slre_compile("(?i)aB(c)", 0, &re, NULL) == 1);
+    for (i = 0; i + 3 <= (int) sizeof(buf); i++) {
+      memset(buf, 'B', sizeof(buf));
+      buf[i / 2] = '\xc1';
+      memcpy(buf + i, i % 2 ? "AbC" : "abc", 3);
+      ASSERT(slre_exec(&re, buf, sizeof(buf), caps, 10, NULL) == i + 3);
+      ASSERT(caps[0].ptr == buf + i + 2);
+      buf[i] = '\x01';
+      ASSERT(slre_exec(&re, buf, sizeof(buf), NULL, 0, NULL) == 0);
+    }
+  }
+
+  {
+    /* Class scanning, on both sides of 16 and 32-byte blocks */
+    static const char *tail = "xyz\xff\x80 ";
+    char buf[100];
+    struct slre_compiled re;
+    int i, n;
+
+    ASSERT(slre_compile("\\d+", 0, &re, NULL) == 1);
+    ASSERT(re.first_class >= 0 && (re.flags & CAN_SKIP));
+    ASSERT(slre_compile("(a|[xy])+", 0, &re, NULL) == 1);
+    ASSERT(re.first_class >= 0);
+    ASSERT(!CLASS_HAS(re.classes[re.first_class], 'b'));
+    ASSERT(slre_compile("a|.", 0, &re, NULL) == 1);
+    ASSERT(re.first_class < 0 && !(re.flags & CAN_SKIP));
+
+    for (n = 0; n < 70; n++) {
+      for (i = 0; i < n; i++) buf[i] = tail[i % 6];
+      strcpy(buf + n, "42 abc");
+      ASSERT(slre_match("(\\d+)", buf, n + 6, caps, 10, NULL) == n + 2);
+      ASSERT(slre_match("\\d+", buf, n + 6, NULL, 0, NULL) == n + 2);
+      ASSERT(slre_match("^([^0-9]*)", buf, n + 6, caps, 10, NULL) == n);
+    }
+  }
+
+  {
+    /* Iterator */
+    static const char *buf =
+      "<a href=\"http://x.com/\">, <img src=\"https://y\"";
+    struct slre_compiled re;
+    struct slre_iter it;
+    int flags;
+
+    for (flags = 0; flags <= SLRE_NFA; flags += SLRE_NFA) {
+      ASSERT(slre_compile("(https?)://([^\"]+)", flags, &re, NULL) == 1);
+      slre_iter_init(&it, &re, buf, strlen(buf));
+      ASSERT(slre_iter_next(&it, caps, 10, &msg) == 22);
+      ASSERT(it.match_start == 9 && it.match_end == 22);
+      ASSERT(caps[0].ptr == buf + 9 && caps[0].len == 4);
+      ASSERT(caps[1].ptr == buf + 16 && caps[1].len == 6);
+      ASSERT(slre_iter_next(&it, NULL, 0, &msg) == 45);
+      ASSERT(it.match_start == 36);
+      ASSERT(slre_iter_next(&it, caps, 10, &msg) == 0);
+      ASSERT(strcmp(msg, static_error_no_match) == 0);
+      ASSERT(slre_iter_next(&it, caps, 10, &msg) == 0);
+    }
+
+    /* ^ matches only at the beginning of the buffer */
+    ASSERT(slre_compile("^a", 0, &re, NULL) == 1);
+    slre_iter_init(&it, &re, "aaa", 3);
+    ASSERT(slre_iter_next(&it, NULL, 0, NULL) == 1);
+    ASSERT(slre_iter_next(&it, NULL, 0, NULL) == 0);
+
+    ASSERT(slre_compile("b*", 0, &re, NULL) == 1);
+    slre_iter_init(&it, &re, "bbabb", 5);
+    ASSERT(slre_iter_next(&it, NULL, 0, NULL) == 2);
+    ASSERT(slre_iter_next(&it, NULL, 0, NULL) == 5);
+    ASSERT(it.match_start == 3);
+    ASSERT(slre_iter_next(&it, NULL, 0, NULL) == 0);
+  }
+
+  {
+    /* Chunks, with matches that cross their boundaries */
+    static const char *buf = "ababababa abba";
+    struct slre_compiled re;
+    struct slre_chunk chunks[2];
+    struct slre_span spans[2][4], out[4];
+    int i;
+
+    ASSERT(slre_compile("aba|bb", 0, &re, NULL) == 1);
+    chunks[0].start = 0;
+    chunks[0].end = chunks[1].start = 2;
+    chunks[1].end = 14;
+    chunks[0].spans = spans[0];
+    chunks[1].spans = spans[1];
+    chunks[0].max_spans = chunks[1].max_spans = 4;
+    ASSERT(slre_chunk_exec(&re, buf, 14, &chunks[0], &msg) == 1);
+    ASSERT(chunks[0].is_complete && spans[0][0].end == 3);
+    ASSERT(slre_chunk_exec(&re, buf, 14, &chunks[1], &msg) == 3);
+    ASSERT(spans[1][0].start == 2 && spans[1][1].start == 6);
+    ASSERT(slre_chunk_merge(&re, buf, 14, chunks, 2, out, 4, &msg) == 3);
+    ASSERT(out[0].start == 0 && out[1].start == 4 && out[1].end == 7);
+    ASSERT(out[2].start == 11 && out[2].end == 13);
+
+    /* Same result for any boundary, even if matches do not fit */
+    for (i = 0; i <= 14; i++) {
+      chunks[0].end = chunks[1].start = i;
+      chunks[0].max_spans = 1;
+      ASSERT(slre_chunk_exec(&re, buf, 14, &chunks[0], &msg) >= 0);
+      ASSERT(slre_chunk_exec(&re, buf, 14, &chunks[1], &msg) >= 0);
+      ASSERT(slre_chunk_merge(&re, buf, 14, chunks, 2, out, 2, &msg) == 3);
+      ASSERT(out[0].end == 3 && out[1].end == 7);
+    }
+    chunks[1].start = 1;
+    ASSERT(slre_chunk_merge(&re, buf, 14, chunks, 2, out, 2, &msg) == -1);
+  }
+
+  {
+    /* Replacement with references, dry run and truncated output */
+    static const char *str = "a=1, bb=22;";
+    struct slre_compiled re;
+    char out[64];
+
+    ASSERT(slre_compile("([a-z]+)=(\\d+)", 0, &re, NULL) == 1);
+    ASSERT(slre_replace(&re, str, 11, "$2:$1", out, sizeof(out), &msg) == 11);
+    ASSERT(strcmp(msg, "") == 0 && strcmp(out, "1:a, 22:bb;") == 0);
+    ASSERT(slre_replace(&re, str, 11, "<$0>$$", NULL, 0, &msg) == 17);
+    ASSERT(slre_replace(&re, str, 11, "<$0>$$", out, 8, &msg) == 17);
+    ASSERT(strcmp(out, "<a=1>$,") == 0);
+    ASSERT(slre_replace(&re, str, 11, "<$0>$$", out, 18, &msg) == 17);
+    ASSERT(strcmp(out, "<a=1>$, <bb=22>$;") == 0);
+    ASSERT(slre_replace(&re, str, 11, "$3", out, sizeof(out), &msg) == -1);
+    ASSERT(strcmp(msg, "Invalid $ reference") == 0);
+    ASSERT(slre_replace(&re, "xyz", 3, "$1", out, sizeof(out), &msg) == 3);
+    ASSERT(strcmp(out, "xyz") == 0);
+
+    ASSERT(slre_compile("(x)|(y)", 0, &re, NULL) == 1);
+    ASSERT(slre_replace(&re, "xyz", 3, "[$1$2$]", out, sizeof(out), &msg) == 9);
+    ASSERT(strcmp(out, "[x$][y$]z") == 0);
+  }
+
+  {
+    /* Streaming match */
+    static struct slre_stream st;
+    struct slre_compiled re;
+
+    ASSERT(slre_compile("HTTP/(\\d+)\\.(\\d+)", 0, &re, NULL) == 1);
+    ASSERT(slre_stream_init(&st, &re, 2, &msg) == 1);
+    ASSERT(slre_stream_feed(&st, "GET / HT", 8, 0, &msg) == 0);
+    ASSERT(slre_stream_feed(&st, "TP/1", 4, 0, &msg) == 0);
+    ASSERT(slre_stream_feed(&st, "", 0, 0, &msg) == 0);
+    ASSERT(slre_stream_feed(&st, "1.", 2, 0, &msg) == 0);
+    ASSERT(slre_stream_feed(&st, "0\r\n", 3, 0, &msg) == 15);
+    ASSERT(strcmp(msg, "") == 0);
+    ASSERT(st.match_start == 6);
+    ASSERT(st.caps[0] == 11 && st.caps[1] == 13);
+    ASSERT(st.caps[2] == 14 && st.caps[3] == 15);
+    ASSERT(slre_stream_feed(&st, "x", 1, 1, &msg) == 15);
+
+    /* Greedy loop and $ need to know where the stream ends */
+    ASSERT(slre_compile("b+$", 0, &re, NULL) == 1);
+    ASSERT(slre_stream_init(&st, &re, 0, &msg) == 1);
+    ASSERT(slre_stream_feed(&st, "abb", 3, 0, &msg) == 0);
+    ASSERT(slre_stream_feed(&st, "ab", 2, 0, &msg) == 0);
+    ASSERT(slre_stream_feed(&st, "b", 1, 1, &msg) == 6);
+    ASSERT(st.match_start == 4);
+
+    ASSERT(slre_compile("^a", 0, &re, NULL) == 1);
+    ASSERT(slre_stream_init(&st, &re, 0, &msg) == 1);
+    ASSERT(slre_stream_feed(&st, "b", 1, 0, &msg) == -1);
+    ASSERT(strcmp(msg, static_error_no_match) == 0);
+    ASSERT(slre_stream_init(&st, &re, 0, &msg) == 1);
+    ASSERT(slre_stream_feed(&st, "", 0, 1, &msg) == -1);
+
+    /* Loop counters are a part of thread state */
+    ASSERT(slre_compile("(ab){3}c", 0, &re, NULL) == 1);
+    ASSERT(slre_stream_init(&st, &re, 2, &msg) == 1);
+    ASSERT(slre_stream_feed(&st, "zabab", 5, 0, &msg) == 0);
+    ASSERT(slre_stream_feed(&st, "ababa", 5, 0, &msg) == 0);
+    ASSERT(slre_stream_feed(&st, "bc", 2, 0, &msg) == 12);
+    ASSERT(st.match_start == 5 && st.caps[0] == 9 && st.caps[1] == 11);
+    ASSERT(slre_compile("(a{200}){200}", 0, &re, NULL) == 1);
+    ASSERT(slre_stream_init(&st, &re, 0, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_scratch) == 0);
+  }
+
+  {
+    /* Regex set */
+    static const char *regexps[] = {
+      "^/api/", "(?i)\\.CSS$", "x+y", "/$", "^$", "a*", "b|^c", "[0-9]$"
+    };
+    static struct slre_set set;
+    unsigned char matched[2];
+    int i;
+
+    ASSERT(slre_set_compile(regexps, 8, 0, &set, &msg) == 1);
+    ASSERT(slre_set_exec(&set, "/api/x.css", 10, matched, &msg) == 3);
+    ASSERT(matched[0] == 0x23);
+    ASSERT(slre_set_exec(&set, "/static/", 8, matched, &msg) == 2);
+    ASSERT(matched[0] == 0x28);
+    ASSERT(slre_set_exec(&set, "", 0, matched, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_no_match) == 0);
+    ASSERT(slre_set_exec(&set, "cxxxy5", 6, matched, &msg) == 3);
+    ASSERT(matched[0] == 0xc4);
+    ASSERT(slre_set_exec(&set, "zz", 2, matched, &msg) == 0);
+    ASSERT(matched[0] == 0);
+
+    /* Every regex gives the same result as on its own */
+    slre_set_exec(&set, "/api/x.css", 10, matched, &msg);
+    for (i = 0; i < 8; i++) {
+      ASSERT(!(matched[0] & (1 << i)) == !slre_match(regexps[i], "/api/x.css",
+                                                     10, NULL, 0, NULL));
+    }
+
+    ASSERT(slre_set_compile(regexps, 0, 0, &set, &msg) == 0);
+    ASSERT(slre_set_compile(regexps + 1, 2, 0, &set, &msg) == 1);
+    ASSERT(slre_set_exec(&set, "a.cssxy", 7, matched, &msg) == 1);
+    ASSERT(matched[0] == 2);
+    ASSERT(slre_set_compile(regexps + 1, 2, SLRE_FULL_MATCH, &set,
+                            &msg) == 1);
+    ASSERT(slre_set_exec(&set, "a.cssxy", 7, matched, &msg) == 0);
+    ASSERT(slre_set_exec(&set, "xxy", 3, matched, &msg) == 1);
+    ASSERT(matched[0] == 2);
+
+    /* Counted loops of different regexes get counters of their own */
+    regexps[0] = "^(ab){2,3}$";
+    regexps[1] = "\\d{3}-\\d{2}";
+    regexps[2] = "(ab){60}";
+    ASSERT(slre_set_compile(regexps, 2, 0, &set, &msg) == 1);
+    ASSERT(set.progs[0].num_counters == 3);
+    ASSERT(slre_set_exec(&set, "ababab", 6, matched, &msg) == 1);
+    ASSERT(matched[0] == 1);
+    ASSERT(slre_set_exec(&set, "abab 123-45", 11, matched, &msg) == 1);
+    ASSERT(matched[0] == 2);
+    ASSERT(slre_set_compile(regexps, 3, 0, &set, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_set_states) == 0);
+  }
+
+  {
+    /* Large set is split into several programs */
+    static char routes[200][40];
+    static const char *regexps[200];
+    static struct slre_set set;
+    unsigned char matched[25];
+    char buf[40];
+    int i;
+
+    for (i = 0; i < 200; i++) {
+      sprintf(routes[i], "^GET /api/v1/r%d/([a-z]+)/(\\d+)$", i);
+      regexps[i] = routes[i];
+    }
+    ASSERT(slre_set_compile(regexps, 200, 0, &set, &msg) == 1);
+    ASSERT(set.num_programs > 1 && set.num_programs <= SLRE_SET_PROGRAMS);
+    for (i = 0; i < 200; i += 37) {
+      sprintf(buf, "GET /api/v1/r%d/users/42", i);
+      ASSERT(slre_set_exec(&set, buf, (int) strlen(buf), matched, &msg) == 1);
+      ASSERT(matched[i / 8] == 1 << (i % 8));
+    }
+    ASSERT(slre_set_exec(&set, "GET /api/v1/r7/x/y", 18, matched, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_no_match) == 0);
+
+    /* Matches in the first and the last program are both reported */
+    strcpy(routes[199], "^GET /");
+    ASSERT(slre_set_compile(regexps, 200, 0, &set, &msg) == 1);
+    ASSERT(slre_set_exec(&set, "GET /api/v1/r3/a/1", 18, matched, &msg) == 2);
+    ASSERT(matched[0] == 1 << 3 && matched[24] == 0x80);
+
+    for (i = 0; i < 200; i++) regexps[i] = "[^a][^b][^c][^d][^e][^f][^g]";
+    ASSERT(slre_set_compile(regexps, 200, 0, &set, &msg) == 0);
+    ASSERT(strstr(msg, "SLRE_SET_PROGRAMS") != NULL);
+  }
+
+  {
+    /* Nested quantifiers take linear time */
+    static char buf[10001];
+    struct slre_compiled re;
+
+    memset(buf, 'a', sizeof(buf) - 1);
+    ASSERT(slre_compile("(a+)+b", SLRE_NFA, &re, &msg) == 1);
+    ASSERT(slre_exec(&re, buf, sizeof(buf) - 1, caps, 10, &msg) == 0);
+    ASSERT(strcmp(msg, static_error_no_match) == 0);
+    buf[sizeof(buf) - 2] = 'b';
+    ASSERT(slre_exec(&re, buf, sizeof(buf) - 1, caps, 10, &msg) == 10000);
+    ASSERT(caps[0].len == 9999);
+  }
 
   {
     /* Example: HTTP request */
@@ -613,12 +5861,14 @@ int main(void) {
 
   {
     /* Example: string replacement */
-    char *s = slre_replace("({{.+?}})",
-                           "Good morning, {{foo}}. How are you, {{bar}}?",
-                           "Bob");
+    static const char *str = "Good morning, {{foo}}. How are you, {{bar}}?";
+    struct slre_compiled re;
+    char s[100];
+
+    slre_compile("{{.+?}}", 0, &re, NULL);
+    slre_replace(&re, str, strlen(str), "Bob", s, sizeof(s), NULL);
     printf("%s\n", s);
     ASSERT(strcmp(s, "Good morning, Bob. How are you, Bob?") == 0);
-    free(s);
   }
 
   {
@@ -638,6 +5888,10 @@ int main(void) {
     }
   }
 
+#ifdef SLRE_THREAD_TEST
+  ASSERT(thread_test());
+#endif
+
   printf("Unit test %s (total test: %d, failed tests: %d)\n",
          static_failed_tests > 0 ? "FAILED" : "PASSED",
          static_total_tests, static_failed_tests);
@@ -645,3 +5899,134 @@ int main(void) {
   return static_failed_tests == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 #endif /* SLRE_UNIT_TEST */
+
+#ifdef SLRE_BENCHMARK
+#ifdef SLRE_UNIT_TEST
+#error SLRE_BENCHMARK and SLRE_UNIT_TEST both define main()
+#endif
+/*
+ * Benchmark of a fixed corpus, built with -DSLRE_BENCHMARK. Every case is
+ * compiled and matched by each engine for at least argv[1] seconds, 0.2
+ * by default. Output is a header and one tab-separated line per case and
+ * engine, so that runs of different versions can be compared directly.
+ */
+#include <time.h>
+
+/* Buffer is fill repeated up to len bytes, followed by text */
+struct bench_case {
+  const char *name;
+  const char *regex;
+  const char *fill;
+  int len;
+  const char *text;
+};
+
+static const struct bench_case bench_cases[] = {
+  { "http_request", "^\\s*(\\S+)\\s+(\\S+)\\s+HTTP/(\\d)\\.(\\d)", "", 0,
+    " GET /index.html HTTP/1.0\r\n\r\n" },
+  { "url", "(?i)((https?://)[^\\s/'\"<>]+/?[^\\s'\"<>]*)",
+    "<p>Some text, no links</p> ", 4096,
+    "<a href=\"http://cesanta.com/x?b#c=tab1\">link</a>" },
+  { "log_filter", "\\] (ERROR|WARN) .*timeout",
+    "2026-10-14 12:00:01 [db] INFO query ok\n", 65536,
+    "2026-10-14 12:00:02 [db] ERROR read timeout\n" },
+  { "nested_quantifier", "(a+)+[bc]", "a", 20, " b" },
+  { "template", "{{.+?}}", "Dear customer, thank you. ", 1024,
+    "Hello {{name}}!" },
+  { "large_no_match", "foo\\d+bar|(baz|qux)x",
+    "Lorem ipsum dolor sit amet, consectetur adipiscing elit. ", 1 << 20,
+    "" }
+};
+
+static const struct bench_engine {
+  const char *name;
+  int flags;
+  int num_caps;
+} bench_engines[] = {
+  { "backtrack", 0, 10 }, { "nfa", SLRE_NFA, 10 }, { "dfa", SLRE_NFA, 0 }
+};
+
+#define BENCH_SAMPLES 100000
+static double bench_samples[BENCH_SAMPLES];
+
+/* Seconds from an arbitrary point, monotonic where POSIX clock exists */
+static double bench_now(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+#else
+  return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static int bench_cmp(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static char *bench_buf(const struct bench_case *c, int *len) {
+  int i, fill_len = (int) strlen(c->fill), text_len = (int) strlen(c->text);
+  char *buf = (char *) malloc(c->len + text_len + 1);
+
+  if (buf == NULL) return NULL;
+  for (i = 0; i < c->len; i++) buf[i] = c->fill[i % fill_len];
+  memcpy(buf + c->len, c->text, text_len + 1);
+  *len = c->len + text_len;
+
+  return buf;
+}
+
+static void bench_run(const struct bench_case *c,
+                      const struct bench_engine *e, const char *buf,
+                      int len, double seconds) {
+  struct slre_compiled re;
+  struct slre_cap caps[10];
+  double start, t, total = 0, compile_time;
+  long i, n, matched = 0;
+  int result = 0;
+
+  for (n = 0, start = t = bench_now(); n == 0 || t - start < seconds / 4;
+       n++, t = bench_now()) {
+    if (!slre_compile(c->regex, e->flags, &re, NULL)) {
+      printf("%s\t%s\tcompile error\n", c->name, e->name);
+      return;
+    }
+  }
+  compile_time = (t - start) / n;
+
+  for (n = 0; n == 0 || (total < seconds && n < BENCH_SAMPLES); n++) {
+    start = bench_now();
+    result = slre_exec(&re, buf, len, e->num_caps > 0 ? caps : NULL,
+                       e->num_caps, NULL);
+    bench_samples[n] = bench_now() - start;
+    total += bench_samples[n];
+    if (result > 0) matched++;
+  }
+  qsort(bench_samples, n, sizeof(bench_samples[0]), bench_cmp);
+  i = n * 99 / 100;
+
+  printf("%s\t%s\t%d\t%d\t%.0f\t%.0f\t%.0f\t%.0f\t%.2f\t%.0f\n", c->name,
+         e->name, len, result, compile_time * 1e9, total / n * 1e9,
+         bench_samples[n / 2] * 1e9, bench_samples[i] * 1e9,
+         len * (double) n / total / 1e6, matched / total);
+}
+
+int main(int argc, char *argv[]) {
+  double seconds = argc > 1 ? atof(argv[1]) : 0.2;
+  int i, j, len;
+  char *buf;
+
+  printf("case\tengine\tbytes\tresult\tcompile_ns\texec_ns\tp50_ns\tp99_ns"
+         "\tmb_s\tmatches_s\n");
+  for (i = 0; i < ARRAY_SIZE(bench_cases); i++) {
+    if ((buf = bench_buf(&bench_cases[i], &len)) == NULL) return EXIT_FAILURE;
+    for (j = 0; j < ARRAY_SIZE(bench_engines); j++) {
+      bench_run(&bench_cases[i], &bench_engines[j], buf, len, seconds);
+    }
+    free(buf);
+  }
+
+  return EXIT_SUCCESS;
+}
+#endif /* SLRE_BENCHMARK */
@@ -29,14 +29,248 @@
 extern "C" {
 #endif
 
+#ifndef SLRE_MAX_BRACKETS
+#define SLRE_MAX_BRACKETS 100
+#endif
+
+#ifndef SLRE_MAX_INSNS
+#define SLRE_MAX_INSNS 256
+#endif
+
+#ifndef SLRE_MAX_CLASSES
+#define SLRE_MAX_CLASSES 16
+#endif
+
+/*
+ * Working memory of slre_exec() on the stack, see slre_scratch_size().
+ * Each call of slre_exec(), and of the iterator, set, limited, stats and
+ * replace functions, puts this many bytes on the stack, and so does
+ * struct slre_stream. Typical regexes need 3 to 4 KB. Programs of more
+ * than about 150 instructions, like UTF-8 ones, can need more for NFA
+ * threads with captures, and are then matched by backtracking: pass
+ * memory to slre_exec_scratch() or slre_exec_batch() to keep the NFA.
+ */
+#ifndef SLRE_SCRATCH_SIZE
+#define SLRE_SCRATCH_SIZE 8192
+#endif
+
+#ifndef SLRE_MAX_PREFIX
+#define SLRE_MAX_PREFIX 16
+#endif
+
+/* Programs of a regex set, each of up to SLRE_MAX_INSNS instructions */
+#ifndef SLRE_SET_PROGRAMS
+#define SLRE_SET_PROGRAMS 32
+#endif
+
 struct slre_cap {
   const char *ptr;
   int len;
 };
 
+/* Instruction of the compiled program. Fields are private to slre.c */
+struct slre_insn {
+  unsigned char op;     /* Opcode                                       */
+  unsigned char c;      /* Byte to match, or opcode-specific flags      */
+  unsigned short x, y;  /* Jump targets, or opcode-specific operands    */
+};
+
+/* Flags for slre_compile() */
+enum {
+  SLRE_IGNORE_CASE = 1,  /* Case-insensitive match, same as (?i) prefix  */
+  SLRE_NFA = 2,          /* Match with NFA engine, in linear time        */
+  SLRE_ANCHORED = 4,     /* Match at buffer start only, same as ^ prefix */
+  SLRE_FULL_MATCH = 8,   /* Match whole buffer, same as ^ prefix, $ end  */
+  SLRE_UTF8 = 16         /* Match UTF-8 characters rather than bytes     */
+};
+
+/*
+ * Compiled regular expression, filled by slre_compile(). It is
+ * self-contained and does not reference the regexp string. Matching never
+ * modifies it, so any number of threads can match it at once, without
+ * locking: all mutable state of a match is per call.
+ */
+struct slre_compiled {
+  struct slre_insn insns[SLRE_MAX_INSNS];
+  int num_insns;
+  int num_rev_insns;    /* Reversed program follows, if regex ends in $ */
+  int num_brackets;     /* Number of bracket pairs, i.e. captures       */
+  int num_regs;         /* Number of loop registers used by the program */
+  int num_counters;     /* Number of counters of {} loops               */
+  unsigned char classes[SLRE_MAX_CLASSES][32];  /* Byte class bitmaps    */
+  unsigned char nibbles[SLRE_MAX_CLASSES][32];  /* Same, for SIMD lookup  */
+  int num_classes;
+  int first_class;      /* Class of bytes that start a match, or -1     */
+  unsigned char byte_classes[256];  /* Bytes indistinguishable by program */
+  int num_byte_classes;
+  unsigned char prefix[SLRE_MAX_PREFIX];  /* Every match starts with it  */
+  int prefix_len;
+  unsigned char must[SLRE_MAX_PREFIX];    /* Every match contains it     */
+  int must_len;         /* Both are lower case with SLRE_IGNORE_CASE    */
+  int min_len, max_len;  /* Length of a match, max_len -1 if unbounded  */
+  int flags;            /* SLRE_* flags, and ones private to slre.c     */
+};
+
+/* Limits of work done by one match, see slre_exec_limited() */
+struct slre_limits {
+  long max_steps;     /* Steps of the engine, 0 for no limit            */
+  int max_depth;      /* Depth of backtracking recursion, 0 for no limit */
+  int (*is_expired)(void *arg);  /* If not NULL, called every few       */
+  void *arg;                     /* thousand steps, non-zero to stop    */
+};
+
+/* Engine that found the result, see slre_stats */
+enum {
+  SLRE_ENGINE_BACKTRACK = 1, SLRE_ENGINE_NFA, SLRE_ENGINE_DFA,
+  SLRE_ENGINE_ONE_PASS
+};
+
+/*
+ * Work done by one slre_exec_stats() call. Engine is always set, other
+ * counters only if slre.c is built with -DSLRE_STATS, zero otherwise.
+ */
+struct slre_stats {
+  int engine;           /* SLRE_ENGINE_*, 0 if buffer is rejected early */
+  long starts;          /* Start offsets tried by backtracking or NFA   */
+  long bytes;           /* Bytes examined by the engine                 */
+  long bytes_skipped;   /* Bytes skipped by a search for the prefix     */
+  long recursions;      /* Calls of backtracking recursion              */
+  long branches;        /* Alternatives, SPLITs run by backtracking     */
+  long backtracks;      /* Returns to an alternative or to a loop       */
+  long threads;         /* Thread steps of NFA                          */
+  long dfa_states;      /* States built by DFA                          */
+};
+
+/*
+ * Regular expressions that are matched together, see slre_set_compile().
+ * Regexes are joined into as few programs as the limits allow.
+ */
+struct slre_set {
+  struct slre_compiled progs[SLRE_SET_PROGRAMS];  /* Each in one pass  */
+  int counts[SLRE_SET_PROGRAMS];  /* Number of regexes in each program */
+  int num_programs;
+  int num_regexps;
+};
+
+/*
+ * NFA engine state: two lists of threads, in order of preference, for
+ * the current and the next offset. Arrays are in scratch memory, sized
+ * for the program. Fields are private to slre.c
+ */
+struct slre_nfa_list {
+  int num_threads;
+  short *pc;                  /* State: pc and loop counter values     */
+  int *slots;                 /* Start of the match, then captures     */
+  int *mark;                  /* Generation when state was added       */
+};
+
+struct slre_nfa {
+  struct slre_nfa_list lists[2];
+  int cur, stride, generation;
+  int result;                 /* End of the best match so far, or -1   */
+  int *match;                 /* Its start and captures                */
+  int *states;                /* Numbering of states, if with counters */
+  int *counters;              /* Values of counters in a state         */
+};
+
+/* Iterator over all matches in a buffer, see slre_iter_init() */
+struct slre_iter {
+  int match_start;    /* Offsets of the last match in the buffer        */
+  int match_end;
+
+  /* Fields below are private to slre.c */
+  const struct slre_compiled *re;
+  const char *buf;
+  int buf_len;
+};
+
+/* Offsets of a match in the buffer */
+struct slre_span {
+  int start;
+  int end;
+};
+
+/* Part of a buffer matched on its own, see slre_chunk_exec() */
+struct slre_chunk {
+  int start;          /* Offsets of the part in the buffer, set by caller */
+  int end;
+  struct slre_span *spans;  /* Caller's array for matches that start here */
+  int max_spans;
+
+  /* Fields below are set by slre_chunk_exec() */
+  int num_spans;      /* Number of matches found, or -1 on error          */
+  int is_complete;    /* Non-zero if all of them fit into spans           */
+};
+
+/* State of a match over a stream of buffers, see slre_stream_init() */
+struct slre_stream {
+  int match_start;    /* Offset of the match from the stream start      */
+  int caps[2 * SLRE_MAX_BRACKETS];  /* Capture start and end offsets, or -1 */
+
+  /* Fields below are private to slre.c */
+  const struct slre_compiled *re;
+  int offset;         /* Offset of the next buffer from the stream start */
+  int pending;        /* Last byte, if it is not matched yet, or -1      */
+  int result;         /* Like slre_stream_feed() returns, once known     */
+  struct slre_nfa nfa;
+  long mem[SLRE_SCRATCH_SIZE / sizeof(long)];  /* Arrays of the NFA   */
+};
+
 int slre_match(const char *regexp, const char *buf, int buf_len,
                struct slre_cap *caps, int num_caps, const char **error_msg);
 
+int slre_compile(const char *regexp, int flags, struct slre_compiled *re,
+                 const char **error_msg);
+int slre_exec(const struct slre_compiled *re, const char *buf, int buf_len,
+              struct slre_cap *caps, int num_caps, const char **error_msg);
+
+int slre_scratch_size(const struct slre_compiled *re);
+int slre_exec_scratch(const struct slre_compiled *re, const char *buf,
+                      int buf_len, struct slre_cap *caps, int num_caps,
+                      void *scratch, int scratch_size, const char **error_msg);
+int slre_exec_limited(const struct slre_compiled *re, const char *buf,
+                      int buf_len, struct slre_cap *caps, int num_caps,
+                      const struct slre_limits *limits,
+                      const char **error_msg);
+int slre_exec_stats(const struct slre_compiled *re, const char *buf,
+                    int buf_len, struct slre_cap *caps, int num_caps,
+                    struct slre_stats *stats, const char **error_msg);
+int slre_exec_batch(const struct slre_compiled *re,
+                    const struct slre_cap *bufs, int num_bufs, int *results,
+                    struct slre_cap *caps, int num_caps,
+                    void *scratch, int scratch_size, const char **error_msg);
+
+void slre_iter_init(struct slre_iter *it, const struct slre_compiled *re,
+                    const char *buf, int buf_len);
+int slre_iter_next(struct slre_iter *it, struct slre_cap *caps, int num_caps,
+                   const char **error_msg);
+
+int slre_chunk_exec(const struct slre_compiled *re, const char *buf,
+                    int buf_len, struct slre_chunk *chunk,
+                    const char **error_msg);
+int slre_chunk_merge(const struct slre_compiled *re, const char *buf,
+                     int buf_len, const struct slre_chunk *chunks,
+                     int num_chunks, struct slre_span *spans, int max_spans,
+                     const char **error_msg);
+
+int slre_replace(const struct slre_compiled *re, const char *buf, int buf_len,
+                 const char *sub, char *out, int out_len,
+                 const char **error_msg);
+
+int slre_stream_init(struct slre_stream *st, const struct slre_compiled *re,
+                     int num_caps, const char **error_msg);
+int slre_stream_feed(struct slre_stream *st, const char *buf, int buf_len,
+                     int is_last, const char **error_msg);
+
+int slre_set_compile(const char **regexps, int num_regexps, int flags,
+                     struct slre_set *set, const char **error_msg);
+int slre_set_exec(const struct slre_set *set, const char *buf, int buf_len,
+                  unsigned char *matched, const char **error_msg);
+
+int slre_save(const struct slre_compiled *re, void *buf, int buf_len);
+const struct slre_compiled *slre_load(const void *buf, int buf_len,
+                                      const char **error_msg);
+
 #ifdef __cplusplus
 }
 #endif
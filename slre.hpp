@@ -0,0 +1,784 @@
+/*
+ * Copyright (c) 2004-2013 Sergey Lyubka <valenok@gmail.com>
+ * Copyright (c) 2013 Cesanta Software Limited
+ * All rights reserved
+ *
+ * This library is dual-licensed: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. For the terms of this
+ * license, see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this library under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * Alternatively, you can license this library under a commercial
+ * license, as set out in <http://cesanta.com/products.html>.
+ */
+
+/*
+ * Header-only C++20 matcher for regexes known at build time, with the
+ * same syntax and results as slre_compile() and slre_exec(). Regex is
+ * a template argument, parsed and checked at compile time, and every
+ * instruction of its program is a function of its own, so nothing is
+ * interpreted at run time. Please refer to README.md for details.
+ */
+
+#ifndef SLRE_HPP_DEFINED
+#define SLRE_HPP_DEFINED
+
+#if __cplusplus < 202002L
+#error slre.hpp needs C++20
+#endif
+
+#include <array>
+#include <climits>
+#include <cstddef>
+#include <string_view>
+
+#include "slre.h"
+
+namespace slre {
+
+/* Regex string as a template argument, e.g. static_regex<"\\d+"> */
+template <std::size_t N>
+struct fixed_string {
+  char s[N] = {};
+
+  consteval fixed_string(const char (&src)[N]) {
+    for (std::size_t i = 0; i < N; i++) s[i] = src[i];
+  }
+  constexpr int size() const { return static_cast<int>(N) - 1; }
+};
+
+namespace detail {
+
+/*
+ * Malformed regex fails the build with a call to one of these, as they
+ * are not constexpr. These are the errors slre_compile() returns.
+ */
+inline void unexpected_quantifier() {}
+inline void unbalanced_brackets() {}
+inline void invalid_set() {}
+inline void invalid_metacharacter() {}
+inline void empty_brackets() {}  /* slre_compile() says "No match" */
+inline void invalid_count() {}
+inline void too_long() {}
+
+/* Same opcodes and parse tree nodes as in slre.c */
+enum {
+  I_CHAR, I_ANY, I_CLASS, I_BOL, I_EOL, I_SPLIT, I_JMP, I_SAVE, I_MARK,
+  I_CHECK, I_REPEAT, I_INC, I_MATCH
+};
+
+/* REPEAT of a lazy counted loop, see REPEAT_LAZY in slre.c */
+enum { REPEAT_LAZY = 0x80 };
+
+enum {
+  N_EMPTY, N_CHAR, N_ANY, N_CLASS, N_BOL, N_EOL, N_CAT, N_ALT, N_GROUP,
+  N_STAR, N_PLUS, N_QUEST, N_REPEAT
+};
+
+/* SPLIT with c set starts a loop over the single-byte instruction at x */
+struct insn {
+  int op, c, x, y;
+};
+
+struct node {
+  int type, a, b, lo, hi;
+};
+
+struct byte_class {
+  unsigned char bits[32] = {};
+
+  constexpr bool has(int ch) const { return bits[ch >> 3] & (1 << (ch & 7)); }
+  constexpr void add(int ch) {
+    bits[ch >> 3] = static_cast<unsigned char>(bits[ch >> 3] | 1 << (ch & 7));
+  }
+};
+
+constexpr bool is_metacharacter(int ch) {
+  for (const char *p = "^$().[]{}*+?|\\"; *p != '\0'; p++) {
+    if (*p == ch) return true;
+  }
+  return false;
+}
+
+constexpr bool is_quantifier(int ch) {
+  return ch == '*' || ch == '+' || ch == '?';
+}
+
+constexpr bool is_space_byte(int ch) {
+  return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
+
+constexpr bool is_digit_byte(int ch) { return ch >= '0' && ch <= '9'; }
+
+constexpr bool is_xdigit_byte(int ch) {
+  return is_digit_byte(ch) || (ch >= 'a' && ch <= 'f') ||
+    (ch >= 'A' && ch <= 'F');
+}
+
+constexpr int to_lower_byte(int ch) {
+  return ch >= 'A' && ch <= 'Z' ? ch + 'a' - 'A' : ch;
+}
+
+constexpr int to_upper_byte(int ch) {
+  return ch >= 'a' && ch <= 'z' ? ch - 'a' + 'A' : ch;
+}
+
+constexpr int hextoi(int hi, int lo) {
+  hi = to_lower_byte(hi);
+  lo = to_lower_byte(lo);
+  return (is_digit_byte(hi) ? hi - '0' : hi - 'W') << 4 |
+    (is_digit_byte(lo) ? lo - '0' : lo - 'W');
+}
+
+/*
+ * Program of a regex of len bytes, with num_insns instructions worked out
+ * by a first compilation. A class takes at least 2 bytes of regex.
+ */
+template <int Len, int NumInsns>
+struct program {
+  insn insns[NumInsns > 0 ? NumInsns : 1] = {};
+  byte_class classes[Len / 2 + 1] = {};
+  int num_insns = 0, num_classes = 0, num_brackets = 0, num_regs = 0;
+  int num_counters = 0;
+  bool anchored = false;
+};
+
+/*
+ * Same parser and code generator as slre.c, run at compile time. With
+ * NumInsns 0, instructions are only counted.
+ */
+template <int Len, int NumInsns>
+struct compiler {
+  const char *re = nullptr;
+  int re_len = 0, pos = 0, flags = 0;
+  node nodes[4 * Len + 8] = {};
+  int num_nodes = 1;
+  program<Len, NumInsns> prog = {};
+
+  constexpr int new_node(int type, int a, int b) {
+    nodes[num_nodes] = node{type, a, b, 0, 0};
+    return num_nodes++;
+  }
+
+  constexpr int at(int i) const {
+    return static_cast<unsigned char>(re[i]);
+  }
+
+  constexpr int op_len(int i) const {
+    return at(i) == '\\' && i + 1 < re_len && at(i + 1) == 'x' ? 4 :
+      at(i) == '\\' ? 2 : 1;
+  }
+
+  /* Length of {n}, {n,} or {n,m} at i, 0 if there is none */
+  constexpr int count_len(int i) const {
+    int len = 1;
+
+    if (re_len - i < 3 || at(i) != '{' || !is_digit_byte(at(i + 1))) return 0;
+    while (i + len < re_len && is_digit_byte(at(i + len))) len++;
+    if (i + len < re_len && at(i + len) == ',') {
+      len++;
+      while (i + len < re_len && is_digit_byte(at(i + len))) len++;
+    }
+
+    return i + len < re_len && at(i + len) == '}' ? len + 1 : 0;
+  }
+
+  constexpr bool is_valid_escape(int i, int end) const {
+    if (end - i < 2) return false;
+    if (at(i + 1) == 'x') {
+      return end - i >= 4 && is_xdigit_byte(at(i + 2)) &&
+        is_xdigit_byte(at(i + 3));
+    }
+    return at(i + 1) == 's' || at(i + 1) == 'S' || at(i + 1) == 'd' ||
+      is_metacharacter(at(i + 1));
+  }
+
+  constexpr void add_range(byte_class &bits, int lo, int hi) const {
+    for (int ch = lo; ch <= hi; ch++) {
+      bits.add(ch);
+      if (flags & SLRE_IGNORE_CASE) {
+        bits.add(to_lower_byte(ch));
+        bits.add(to_upper_byte(ch));
+      }
+    }
+  }
+
+  static constexpr void add_escape(byte_class &bits, int esc) {
+    for (int ch = 0; ch < 256; ch++) {
+      if ((esc == 's' && is_space_byte(ch)) ||
+          (esc == 'S' && !is_space_byte(ch)) ||
+          (esc == 'd' && is_digit_byte(ch))) {
+        bits.add(ch);
+      }
+    }
+  }
+
+  constexpr int new_class_node(const byte_class &bits) {
+    prog.classes[prog.num_classes] = bits;
+    return new_node(N_CLASS, prog.num_classes++, 0);
+  }
+
+  /* Parse [] set, pos points to the first character after '[' */
+  constexpr int parse_set() {
+    byte_class bits;
+    int i = pos, end = pos, invert = 0;
+
+    while (end < re_len && at(end) != ']') end += op_len(end);
+    if (end >= re_len) {
+      invalid_set();
+      return 0;
+    }
+    invert = end > pos && at(pos) == '^';
+
+    for (i = pos + invert; i < end; i += op_len(i)) {
+      if (at(i) != '-' && at(i) != '\\' && i + 2 < end && at(i + 1) == '-') {
+        add_range(bits, at(i), at(i + 2));
+        i += 2;
+      } else if (at(i) == '\\') {
+        if (!is_valid_escape(i, end)) {
+          invalid_metacharacter();
+          return 0;
+        }
+        if (at(i + 1) == 'x') {
+          add_range(bits, hextoi(at(i + 2), at(i + 3)),
+                    hextoi(at(i + 2), at(i + 3)));
+        } else if (is_metacharacter(at(i + 1))) {
+          add_range(bits, at(i + 1), at(i + 1));
+        } else {
+          add_escape(bits, at(i + 1));
+        }
+      } else if (at(i) == '.') {
+        for (int ch = 0; ch < 256; ch++) bits.add(ch);
+      } else {
+        add_range(bits, at(i), at(i));
+      }
+    }
+
+    if (invert) {
+      for (auto &b : bits.bits) b = static_cast<unsigned char>(~b);
+    }
+    pos = end + 1;
+
+    return new_class_node(bits);
+  }
+
+  constexpr int parse_atom() {
+    byte_class bits;
+    int c = at(pos), n, bracket;
+
+    if (is_quantifier(c) || count_len(pos) > 0) {
+      unexpected_quantifier();
+      return 0;
+    }
+    pos++;
+
+    switch (c) {
+      case '(':
+        if (pos < re_len && at(pos) == ')') {
+          empty_brackets();
+          return 0;
+        }
+        bracket = ++prog.num_brackets;
+        if ((n = parse_alt()) == 0) return 0;
+        if (pos >= re_len) {
+          unbalanced_brackets();
+          return 0;
+        }
+        pos++;
+        return new_node(N_GROUP, n, bracket);
+      case '[': return parse_set();
+      case '.': return new_node(N_ANY, 0, 0);
+      case '^': return new_node(N_BOL, 0, 0);
+      case '$': return new_node(N_EOL, 0, 0);
+      case '\\':
+        if (!is_valid_escape(pos - 1, re_len)) {
+          invalid_metacharacter();
+          return 0;
+        }
+        n = pos - 1;
+        pos = n + op_len(n);
+        switch (at(n + 1)) {
+          case 's': case 'S': case 'd':
+            add_escape(bits, at(n + 1));
+            return new_class_node(bits);
+          case 'x': return new_node(N_CHAR, hextoi(at(n + 2), at(n + 3)), 0);
+          default: return new_node(N_CHAR, at(n + 1), 0);
+        }
+      default:
+        return new_node(N_CHAR, c, 0);
+    }
+  }
+
+  constexpr int parse_count() {
+    int count = 0;
+
+    for (; is_digit_byte(at(pos)); pos++) {
+      if ((count = count * 10 + at(pos) - '0') > SHRT_MAX) {
+        invalid_count();
+        return -1;
+      }
+    }
+
+    return count;
+  }
+
+  /* Parse {n}, {n,} or {n,m} quantifier over node n */
+  constexpr int parse_repeat(int n) {
+    int lo, hi;
+
+    pos++;
+    if ((lo = hi = parse_count()) < 0) return 0;
+    if (at(pos) == ',') {
+      pos++;
+      if (at(pos) == '}') {
+        hi = -1;
+      } else if ((hi = parse_count()) < 0) {
+        return 0;
+      }
+    }
+    if (hi >= 0 && hi < lo) {
+      invalid_count();
+      return 0;
+    }
+    pos++;
+
+    n = new_node(N_REPEAT, n, 0);
+    nodes[n].lo = lo;
+    nodes[n].hi = hi;
+    return n;
+  }
+
+  /* Parse a sequence of atoms with optional quantifiers, up to | or ) */
+  constexpr int parse_seq() {
+    int result = 0, n, type;
+
+    while (pos < re_len && at(pos) != '|' && at(pos) != ')') {
+      if ((n = parse_atom()) == 0) return 0;
+
+      if (pos < re_len && (is_quantifier(at(pos)) || count_len(pos) > 0)) {
+        if (at(pos) == '{') {
+          if ((n = parse_repeat(n)) == 0) return 0;
+        } else {
+          type = at(pos) == '*' ? N_STAR : at(pos) == '+' ? N_PLUS : N_QUEST;
+          pos++;
+          n = new_node(type, n, 0);
+        }
+        if (pos < re_len && at(pos) == '?') {
+          pos++;
+          nodes[n].b = 1;
+        }
+      }
+
+      result = result == 0 ? n : new_node(N_CAT, result, n);
+    }
+
+    return result == 0 ? new_node(N_EMPTY, 0, 0) : result;
+  }
+
+  constexpr int parse_alt() {
+    int result = parse_seq(), n;
+
+    if (result != 0 && pos < re_len && at(pos) == '|') {
+      pos++;
+      if ((n = parse_alt()) == 0) return 0;
+      result = new_node(N_ALT, result, n);
+    }
+
+    return result;
+  }
+
+  constexpr bool is_nullable(int i) const {
+    const node &n = nodes[i];
+
+    switch (n.type) {
+      case N_CAT: return is_nullable(n.a) && is_nullable(n.b);
+      case N_ALT: return is_nullable(n.a) || is_nullable(n.b);
+      case N_GROUP: case N_PLUS: return is_nullable(n.a);
+      case N_REPEAT: return n.lo == 0 || is_nullable(n.a);
+      case N_STAR: case N_QUEST: case N_EMPTY: case N_BOL: case N_EOL:
+        return true;
+      default: return false;
+    }
+  }
+
+  constexpr bool is_anchored(int i) const {
+    const node &n = nodes[i];
+
+    switch (n.type) {
+      case N_BOL: return true;
+      case N_CAT: case N_GROUP: case N_PLUS: return is_anchored(n.a);
+      case N_ALT: return is_anchored(n.a) && is_anchored(n.b);
+      case N_REPEAT: return n.lo > 0 && is_anchored(n.a);
+      default: return false;
+    }
+  }
+
+  constexpr int emit(int op, int c, int x, int y) {
+    if (prog.num_insns < NumInsns) {
+      prog.insns[prog.num_insns] = insn{op, c, x, y};
+    }
+    return prog.num_insns++;
+  }
+
+  /* Set jump targets of instruction at pc, once it is generated */
+  constexpr void patch(int pc, int x, int y) {
+    if (pc < NumInsns) {
+      prog.insns[pc].x = x;
+      prog.insns[pc].y = y;
+    }
+  }
+
+  constexpr bool is_single_byte(int i) const {
+    return nodes[i].type == N_CHAR || nodes[i].type == N_ANY ||
+      nodes[i].type == N_CLASS;
+  }
+
+  /* Loop over node n, see gen_loop() in slre.c */
+  constexpr void gen_loop(const node &n, bool is_plus) {
+    int split, body, reg = -1;
+
+    if (is_single_byte(n.a)) {
+      if (is_plus) gen(n.a);
+      split = emit(I_SPLIT, 1, 0, 0);
+      gen(n.a);
+      emit(I_JMP, 0, split, 0);
+      patch(split, n.b ? split + 3 : split + 1, n.b ? split + 1 : split + 3);
+      return;
+    }
+
+    /* Iteration that matched nothing must not loop again, see I_CHECK */
+    if (is_nullable(n.a)) reg = prog.num_regs++;
+
+    if (is_plus) {
+      if (reg >= 0) emit(I_MARK, 1, reg, 0);
+      body = prog.num_insns;
+      gen(n.a);
+      if (reg >= 0) emit(I_CHECK, 0, reg, 0);
+      split = emit(I_SPLIT, 0, 0, 0);
+      if (reg >= 0) emit(I_MARK, 0, reg, 0);
+      emit(I_JMP, 0, body, 0);
+      patch(split, n.b ? prog.num_insns : split + 1,
+            n.b ? split + 1 : prog.num_insns);
+    } else {
+      split = emit(I_SPLIT, 0, 0, 0);
+      if (reg >= 0) emit(I_MARK, 0, reg, 0);
+      gen(n.a);
+      if (reg >= 0) emit(I_CHECK, 0, reg, 0);
+      emit(I_JMP, 0, split, 0);
+      patch(split, n.b ? prog.num_insns : split + 1,
+            n.b ? split + 1 : prog.num_insns);
+    }
+  }
+
+  /* Node that may be skipped, see gen_quest() in slre.c */
+  constexpr void gen_quest(const node &n) {
+    int split = emit(I_SPLIT, 0, 0, 0);
+
+    gen(n.a);
+    patch(split, n.b ? prog.num_insns : split + 1,
+          n.b ? split + 1 : prog.num_insns);
+  }
+
+  /* Node repeated lo to hi times, see gen_count() in slre.c */
+  constexpr void gen_count(const node &n, int lo, int hi) {
+    int repeat, jmp, counter = prog.num_counters;
+
+    if (hi == 0) return;
+    if (hi == 1) {
+      if (lo == 1) {
+        gen(n.a);
+      } else {
+        gen_quest(n);
+      }
+      return;
+    }
+
+    if (counter >= REPEAT_LAZY) {
+      too_long();
+      return;
+    }
+    prog.num_counters++;
+    repeat = emit(I_REPEAT, counter | (n.b ? REPEAT_LAZY : 0), lo, hi);
+    jmp = emit(I_JMP, 0, 0, 0);
+    gen(n.a);
+    emit(I_INC, counter, repeat, 0);
+    patch(jmp, prog.num_insns, 0);
+  }
+
+  /* Counted loop for {lo,hi}, see gen_repeat() in slre.c */
+  constexpr void gen_repeat(const node &n) {
+    node loop = n;
+
+    if (n.hi >= 0) {
+      gen_count(n, n.lo, n.hi);
+    } else {
+      gen_count(n, n.lo, n.lo);
+      loop.type = N_STAR;
+      gen_loop(loop, false);
+    }
+  }
+
+  constexpr void gen(int i) {
+    const node n = nodes[i];
+    int split, jmp;
+
+    switch (n.type) {
+      case N_CHAR:
+        if ((flags & SLRE_IGNORE_CASE) &&
+            to_lower_byte(n.a) != to_upper_byte(n.a)) {
+          emit(I_CHAR, to_lower_byte(n.a), 0, 1);
+        } else {
+          emit(I_CHAR, n.a, 0, 0);
+        }
+        break;
+      case N_ANY: emit(I_ANY, 0, 0, 0); break;
+      case N_CLASS: emit(I_CLASS, 0, n.a, 0); break;
+      case N_BOL: emit(I_BOL, 0, 0, 0); break;
+      case N_EOL: emit(I_EOL, 0, 0, 0); break;
+      case N_CAT:
+        gen(n.a);
+        gen(n.b);
+        break;
+      case N_GROUP:
+        emit(I_SAVE, 0, 2 * (n.b - 1), 0);
+        gen(n.a);
+        emit(I_SAVE, 0, 2 * (n.b - 1) + 1, 0);
+        break;
+      case N_ALT:
+        split = emit(I_SPLIT, 0, 0, 0);
+        gen(n.a);
+        jmp = emit(I_JMP, 0, 0, 0);
+        patch(split, split + 1, prog.num_insns);
+        gen(n.b);
+        patch(jmp, prog.num_insns, 0);
+        break;
+      case N_QUEST: gen_quest(n); break;
+      case N_STAR: gen_loop(n, false); break;
+      case N_PLUS: gen_loop(n, true); break;
+      case N_REPEAT: gen_repeat(n); break;
+      default: break;
+    }
+  }
+
+  /* Compile regex of re_len bytes with SLRE_* flags, like slre_compile() */
+  constexpr void compile(const char *regex, int len, int regex_flags) {
+    int root;
+
+    re = regex;
+    re_len = len;
+    flags = regex_flags;
+    if (len >= 4 && re[0] == '(' && re[1] == '?' && re[2] == 'i' &&
+        re[3] == ')') {
+      flags |= SLRE_IGNORE_CASE;
+      pos = 4;
+    }
+
+    if ((root = parse_alt()) == 0) return;
+    if (pos < re_len) {
+      unbalanced_brackets();
+      return;
+    }
+    if (flags & (SLRE_ANCHORED | SLRE_FULL_MATCH)) {
+      root = new_node(N_CAT, new_node(N_BOL, 0, 0), root);
+    }
+    if (flags & SLRE_FULL_MATCH) {
+      root = new_node(N_CAT, root, new_node(N_EOL, 0, 0));
+    }
+    prog.anchored = is_anchored(root);
+    gen(root);
+    emit(I_MATCH, 0, 0, 0);
+  }
+};
+
+template <fixed_string Re, int Flags>
+consteval int count_insns() {
+  compiler<Re.size(), 0> c;
+
+  c.compile(Re.s, Re.size(), Flags);
+  return c.prog.num_insns;
+}
+
+template <fixed_string Re, int Flags>
+consteval program<Re.size(), count_insns<Re, Flags>()> compile() {
+  compiler<Re.size(), count_insns<Re, Flags>()> c;
+
+  c.compile(Re.s, Re.size(), Flags);
+  return c.prog;
+}
+
+}  /* namespace detail */
+
+/*
+ * Regex compiled at build time, e.g. static_regex<"^(\\S+)\\s+(\\S+)">.
+ * Flags are SLRE_IGNORE_CASE, SLRE_ANCHORED and SLRE_FULL_MATCH. With no
+ * run-time state but the stack, match() can run in constant expressions.
+ */
+template <fixed_string Re, int Flags = 0>
+class static_regex {
+  static_assert(!(Flags & SLRE_UTF8), "SLRE_UTF8 needs slre_compile()");
+  static constexpr auto prog = detail::compile<Re, Flags>();
+
+ public:
+  static constexpr int num_caps = prog.num_brackets;
+
+  /*
+   * Result of match(): end is the offset past the match, as returned by
+   * slre_exec(), or 0 if there is no match. Captures that did not take
+   * part in the match are empty, with nullptr data.
+   */
+  struct result {
+    int end = 0;
+    std::array<std::string_view, num_caps> caps = {};
+
+    constexpr explicit operator bool() const { return end > 0; }
+  };
+
+  /* Find leftmost match in s, trying alternatives in order of preference */
+  static constexpr result match(std::string_view s) {
+    state st;
+    result r;
+    int i, end = -1;
+
+    st.s = s;
+    for (i = 0; i < static_cast<int>(s.size()) && end < 0; i++) {
+      st.start = i;
+      end = run<0>(i, st);
+      if (prog.anchored) break;
+    }
+    if (end < 0) return r;
+
+    r.end = end;
+    for (i = 0; i < num_caps; i++) {
+      if (st.slots[2 * i] >= 0 && st.slots[2 * i + 1] >= 0) {
+        r.caps[i] = s.substr(st.slots[2 * i],
+                             st.slots[2 * i + 1] - st.slots[2 * i]);
+      }
+    }
+
+    return r;
+  }
+
+ private:
+  /* Capture slots and loop registers, -1 if not set, and loop counters */
+  struct state {
+    std::string_view s;
+    int start = 0;
+    int slots[2 * num_caps + 1] = {};
+    int regs[prog.num_regs + 1] = {};
+    int counters[prog.num_counters + 1] = {};
+
+    constexpr state() {
+      for (int &x : slots) x = -1;
+      for (int &x : regs) x = -1;
+    }
+  };
+
+  template <int PC>
+  static constexpr bool match_byte(char c) {
+    constexpr detail::insn in = prog.insns[PC];
+    const int ch = static_cast<unsigned char>(c);
+
+    if constexpr (in.op == detail::I_ANY) {
+      return true;
+    } else if constexpr (in.op == detail::I_CLASS) {
+      return prog.classes[in.x].has(ch);
+    } else if constexpr (in.y) {
+      return (ch | 0x20) == in.c;
+    } else {
+      return ch == in.c;
+    }
+  }
+
+  /* Loop over single-byte instruction at PC + 1, exit is at PC + 3 */
+  template <int PC>
+  static constexpr int loop(int sp, state &st) {
+    const int len = static_cast<int>(st.s.size());
+    int n = 0, result;
+
+    if constexpr (prog.insns[PC].x == PC + 1) {
+      while (sp + n < len && match_byte<PC + 1>(st.s[sp + n])) n++;
+      for (; n >= 0; n--) {
+        if ((result = run<PC + 3>(sp + n, st)) >= 0) return result;
+      }
+      return -1;
+    } else {
+      for (;; n++) {
+        if ((result = run<PC + 3>(sp + n, st)) >= 0) return result;
+        if (sp + n >= len || !match_byte<PC + 1>(st.s[sp + n])) return -1;
+      }
+    }
+  }
+
+  /*
+   * Run the program from instruction PC at offset sp, as backtrack() in
+   * slre.c does. Returns the end offset of the match, or -1.
+   */
+  template <int PC>
+  static constexpr int run(int sp, state &st) {
+    constexpr detail::insn in = prog.insns[PC];
+    int result, saved;
+
+    if constexpr (in.op == detail::I_CHAR || in.op == detail::I_ANY ||
+                  in.op == detail::I_CLASS) {
+      if (sp >= static_cast<int>(st.s.size()) ||
+          !match_byte<PC>(st.s[sp])) {
+        return -1;
+      }
+      return run<PC + 1>(sp + 1, st);
+    } else if constexpr (in.op == detail::I_BOL) {
+      return sp == 0 ? run<PC + 1>(sp, st) : -1;
+    } else if constexpr (in.op == detail::I_EOL) {
+      return sp == static_cast<int>(st.s.size()) ? run<PC + 1>(sp, st) : -1;
+    } else if constexpr (in.op == detail::I_JMP) {
+      return run<in.x>(sp, st);
+    } else if constexpr (in.op == detail::I_SPLIT && in.c) {
+      return loop<PC>(sp, st);
+    } else if constexpr (in.op == detail::I_SPLIT) {
+      if ((result = run<in.x>(sp, st)) >= 0) return result;
+      return run<in.y>(sp, st);
+    } else if constexpr (in.op == detail::I_SAVE) {
+      saved = st.slots[in.x];
+      st.slots[in.x] = sp;
+      if ((result = run<PC + 1>(sp, st)) < 0) st.slots[in.x] = saved;
+      return result;
+    } else if constexpr (in.op == detail::I_MARK) {
+      saved = st.regs[in.x];
+      st.regs[in.x] = in.c ? -1 : sp;
+      if ((result = run<PC + 1>(sp, st)) < 0) st.regs[in.x] = saved;
+      return result;
+    } else if constexpr (in.op == detail::I_CHECK) {
+      return st.regs[in.x] == sp ? -1 : run<PC + 1>(sp, st);
+    } else if constexpr (in.op == detail::I_REPEAT) {
+      constexpr int c = in.c & ~detail::REPEAT_LAZY;
+      constexpr bool is_lazy = in.c & detail::REPEAT_LAZY;
+
+      saved = st.counters[c];
+      if (saved < in.x) return run<PC + 2>(sp, st);
+      if (saved < in.y && !is_lazy &&
+          (result = run<PC + 2>(sp, st)) >= 0) {
+        return result;
+      }
+      st.counters[c] = 0;
+      result = run<PC + 1>(sp, st);
+      st.counters[c] = saved;
+      if (result >= 0 || saved >= in.y || !is_lazy) return result;
+      return run<PC + 2>(sp, st);
+    } else if constexpr (in.op == detail::I_INC) {
+      st.counters[in.c]++;
+      if ((result = run<in.x>(sp, st)) < 0) st.counters[in.c]--;
+      return result;
+    } else {
+      /* Empty match is not reported, try other alternatives */
+      return sp > st.start ? sp : -1;
+    }
+  }
+};
+
+}  /* namespace slre */
+
+#endif /* SLRE_HPP_DEFINED */
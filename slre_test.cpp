@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2004-2013 Sergey Lyubka <valenok@gmail.com>
+ * Copyright (c) 2013 Cesanta Software Limited
+ * All rights reserved
+ *
+ * This library is dual-licensed: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. For the terms of this
+ * license, see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this library under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * Alternatively, you can license this library under a commercial
+ * license, as set out in <http://cesanta.com/products.html>.
+ */
+
+/*
+ * Unit test of slre.hpp. Every regex of the table is matched at compile
+ * time in static_assert(), so a wrong result fails the build, and at run
+ * time against slre_exec(), which must give the same result and captures.
+ * Malformed regexes must fail to compile. Build with slre.c:
+ *
+ *   cc -c slre.c && c++ -std=c++20 slre_test.cpp slre.o -o slre_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string_view>
+#include <type_traits>
+
+#include "slre.hpp"
+
+static int static_total_tests = 0;
+static int static_failed_tests = 0;
+
+#define FAIL(str, line) do {                      \
+  printf("Fail on line %d: [%s]\n", line, str);   \
+  static_failed_tests++;                          \
+} while (0)
+
+#define ASSERT(expr) do {               \
+  static_total_tests++;                 \
+  if (!(expr)) FAIL(#expr, __LINE__);   \
+} while (0)
+
+/* Regex, flags, buffer and the result of slre_exec() for them */
+#define MATCH_CASES(X)                                                    \
+  X("[abc]", 0, "1c2", 2)                                                 \
+  X("(?i)[abc]", 0, "1C2", 2)                                             \
+  X("[^\\d]+", 0, "abc123", 3)                                            \
+  X("[1-5a-]+", 0, "123a--2oo", 7)                                        \
+  X("[\\S]+\\s+[tyc]*", 0, "ab cd", 4)                                    \
+  X("[\\x41-]+", 0, "-A", 2)                                              \
+  X(".+k.", 0, "fooklmn", 5)                                              \
+  X("^o", 0, "fooklmn", 0)                                                \
+  X("n$", 0, "fooklmn", 7)                                                \
+  X("l$", 0, "fooklmn", 0)                                                \
+  X("(.+2)", 0, "123", 2)                                                 \
+  X("(.*(2.))", 0, "123", 3)                                              \
+  X("(\\d+)\\s+(\\S+)", 0, "12 hi", 5)                                    \
+  X(".(d.)\\)?", 0, "abcdef", 5)                                          \
+  X("ab(cd)+?.", 0, "abcdcdef", 5)                                        \
+  X(".+?c", 0, "abcabc", 3)                                               \
+  X("bc.d?k?b+", 0, "abcabc", 5)                                          \
+  X("|.", 0, "abc", 1)                                                    \
+  X("k(xx|yy)|ca|bc", 0, "abcabc", 3)                                     \
+  X("(|.c)", 0, "abc", 3)                                                 \
+  X("(a|ab)(c|bcd)", 0, "abcd", 4)                                        \
+  X("a(x)?b", 0, "ab", 2)                                                 \
+  X("(a*)+b", 0, "b", 1)                                                  \
+  X("(a|)*b", 0, "aab", 3)                                                \
+  X("(a+)+b", 0, "aaab", 4)                                               \
+  X("(a*)$", 0, "baa", 3)                                                 \
+  X("b+|c", SLRE_ANCHORED, "cb", 1)                                       \
+  X("b+|c", SLRE_ANCHORED, "abb", 0)                                      \
+  X("(b+|c)", SLRE_FULL_MATCH, "bbb", 3)                                  \
+  X("(b+|c)", SLRE_FULL_MATCH, "bbc", 0)                                  \
+  X("(?i)a|b", SLRE_FULL_MATCH, "A", 1)                                   \
+  X("(?i)(b+)c", 0, "aBbc", 4)                                            \
+  X("a{3}", 0, "aaaa", 3)                                                 \
+  X("a{2,3}b", 0, "aaaab", 5)                                             \
+  X("(a|bc){2,}$", 0, "xabcaa", 6)                                        \
+  X("(\\d{1,3})\\.\\d{1,3}?", 0, "1234.567", 6)                           \
+  X("x{0}y", 0, "xy", 2)                                                  \
+  X("(ab){3}c", 0, "abababababc", 11)                                     \
+  X("a{2,5}?b", 0, "aaaaaab", 7)                                          \
+  X("(a?){2,3}?b", 0, "aab", 3)                                           \
+  X("(\\d{1,3}\\.){3}\\d{1,3}", 0, "ip 10.0.0.255!", 13)                  \
+  X("a{,2}", 0, "a{,2}", 5)                                               \
+  X("{{.+?}}", 0, "x{{a}}", 6)                                            \
+  X("^\\s*(\\S+)\\s+(\\S+)\\s+HTTP/(\\d)\\.(\\d)", 0,                     \
+    " GET /index.html HTTP/1.0\r\n\r\n", 25)                              \
+  X("(?i)((https?://)[^\\s/'\"<>]+/?[^\\s'\"<>]*)", 0,                    \
+    "<img src=\"HTTPS://FOO.COM/x?b#c=tab1\"/> ", 36)
+
+/* Malformed regex and the error of slre_compile() for it */
+#define ERROR_CASES(X)                                                    \
+  X("(ab", "Unbalanced brackets")                                         \
+  X("(x))", "Unbalanced brackets")                                        \
+  X("[abc", "Invalid [] spec")                                            \
+  X("\\_", "Invalid metacharacter")                                       \
+  X("[\\_]", "Invalid metacharacter")                                     \
+  X("+", "Unexpected quantifier")                                         \
+  X("{2}", "Unexpected quantifier")                                       \
+  X("a{3,2}", "Invalid {} count")                                         \
+  X("a{99999}", "Invalid {} count")
+
+/* True if the regex compiles, false if it calls a detail:: error */
+template <slre::fixed_string Re, int Flags = 0>
+concept compiles = requires {
+  typename std::integral_constant<int,
+                                  slre::detail::count_insns<Re, Flags>()>;
+};
+
+template <slre::fixed_string Re, int Flags>
+constexpr int match_end(std::string_view s) {
+  return slre::static_regex<Re, Flags>::match(s).end;
+}
+
+#define STATIC_MATCH(re, flags, buf, end) \
+  static_assert(match_end<re, flags>(buf) == (end));
+#define STATIC_ERROR(re, msg) static_assert(!compiles<re>);
+
+MATCH_CASES(STATIC_MATCH)
+ERROR_CASES(STATIC_ERROR)
+static_assert(compiles<"(a)|b">);
+
+/* Captures are views of the buffer, found at compile time too */
+constexpr std::string_view request = " GET /index.html HTTP/1.0\r\n";
+constexpr auto request_match = slre::static_regex<
+  "^\\s*(\\S+)\\s+(\\S+)\\s+HTTP/(\\d)\\.(\\d)">::match(request);
+static_assert(request_match.caps[0] == "GET");
+static_assert(request_match.caps[1] == "/index.html");
+static_assert(request_match.caps[3] == "0");
+static_assert(slre::static_regex<"a(x)?b">::match("ab").caps[0].data() ==
+              nullptr);
+
+/* Result and captures of static_regex are those of slre_exec() */
+template <slre::fixed_string Re, int Flags>
+static bool same_as_exec(const char *buf, int end) {
+  using regex = slre::static_regex<Re, Flags>;
+  struct slre_compiled re;
+  struct slre_cap caps[regex::num_caps + 1];
+  int i, n = (int) strlen(buf);
+  auto r = regex::match(std::string_view(buf, n));
+
+  if (!slre_compile(Re.s, Flags, &re, NULL) ||
+      slre_exec(&re, buf, n, caps, regex::num_caps, NULL) != r.end ||
+      r.end != end) {
+    return false;
+  }
+  for (i = 0; r.end > 0 && i < regex::num_caps; i++) {
+    if ((caps[i].ptr == NULL) != (r.caps[i].data() == nullptr) ||
+        (caps[i].ptr != NULL && (caps[i].ptr != r.caps[i].data() ||
+                                 caps[i].len != (int) r.caps[i].size()))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool same_error(const char *regex, const char *msg) {
+  struct slre_compiled re;
+  const char *error_msg = "";
+
+  return slre_compile(regex, 0, &re, &error_msg) == 0 &&
+    strcmp(error_msg, msg) == 0;
+}
+
+#define RUN_MATCH(re, flags, buf, end) \
+  ASSERT((same_as_exec<re, flags>(buf, end)));
+#define RUN_ERROR(re, msg) ASSERT(same_error(re, msg));
+
+int main(void) {
+  MATCH_CASES(RUN_MATCH)
+  ERROR_CASES(RUN_ERROR)
+
+  printf("C++ unit test %s (total test: %d, failed tests: %d)\n",
+         static_failed_tests > 0 ? "FAILED" : "PASSED",
+         static_total_tests, static_failed_tests);
+
+  return static_failed_tests == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}